@@ -18,11 +18,40 @@
 #define PDSC_ALGORITHM_HPP
 
 #include "point.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+
+// Additive summary of one cluster, exchanged between instances of the same
+// algorithm. linear_sum / weight is the cluster's mean; squared_sum may be
+// empty when the algorithm does not track it. DStream stores its grid cell
+// coordinates in linear_sum.
+struct Summary {
+  std::vector<double> linear_sum, squared_sum;
+  double weight = 0.0;
+  double timestamp = 0.0;
+};
 
 class Algorithm {
 public:
+  virtual ~Algorithm() = default;
   virtual void cluster(const std::vector<Point> &points) = 0;
-  virtual std::vector<Point> output_centers() = 0;
+  // Read-only view of the current centers, valid until the next call to
+  // any other member. Algorithms keep it in a persistent buffer and only
+  // recompute the clusters changed since the last call.
+  virtual const std::vector<Point> &centers() = 0;
+  std::vector<Point> output_centers() { return centers(); }
+  // Summaries of the current state, for merging into another instance.
+  virtual std::vector<Summary> export_summaries() = 0;
+  // Folds summaries exported by an instance of the same algorithm into this
+  // one, as if their points had been clustered here.
+  virtual void merge(const std::vector<Summary> &summaries) = 0;
+  // Appends this instance's state to out. restore() rebuilds it in an
+  // instance constructed with the same dimensionality and configuration.
+  virtual void snapshot(SnapshotWriter &out) const = 0;
+  virtual void restore(SnapshotReader &in) = 0;
+  // Gives up part of the state by the algorithm's own policy; called while
+  // a memory budget is exceeded.
+  virtual void shrink() = 0;
 };
 
 #endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_ALIGNED_ALLOCATOR_HPP
+#define PDSC_ALIGNED_ALLOCATOR_HPP
+
+#include "common.hpp"
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+const size_t CACHE_LINE = 64;
+
+// Allocator handing out cache-line aligned storage, so feature rows start on
+// a vector-register boundary.
+template <typename T, size_t Align = CACHE_LINE> struct AlignedAllocator {
+  using value_type = T;
+  template <typename U> struct rebind {
+    using other = AlignedAllocator<U, Align>;
+  };
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Align> &) noexcept {}
+
+  T *allocate(size_t n) {
+    size_t bytes = (n * sizeof(T) + Align - 1) / Align * Align;
+    void *ptr = std::aligned_alloc(Align, bytes);
+    if (!ptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(ptr);
+  }
+  void deallocate(T *ptr, size_t) noexcept { std::free(ptr); }
+
+  template <typename U> bool operator==(const AlignedAllocator<U, Align> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const AlignedAllocator<U, Align> &) const {
+    return false;
+  }
+};
+
+template <typename T> using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+#endif // PDSC_ALIGNED_ALLOCATOR_HPP
@@ -0,0 +1,586 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmarks for distance kernels, per-algorithm insert paths,
+// group_by_centers and dataset loading, on doubles and quantized points.
+// Every case is repeated, one warm-up repetition is discarded, and
+// mean/stddev/median/min/max are reported per operation. Inputs come from a
+// fixed seed so builds can be compared.
+
+#include "birch.hpp"
+#include "cf_table.hpp"
+#include "cluster_index.hpp"
+#include "clustream.hpp"
+#include "common.hpp"
+#include "denstream.hpp"
+#include "dstream.hpp"
+#include "edmstream.hpp"
+#include "evaluation.hpp"
+#include "point.hpp"
+#include "slkmeans.hpp"
+#include "stats.hpp"
+#include "streamkm.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const u32 BENCH_DIMS[] = {8, 54};
+const u64 BENCH_STATE_SIZES[] = {100, 1000, 10000};
+const u64 BENCH_BATCH_SIZES[] = {1, 100};
+const u64 BENCH_CENTERS[] = {10, 100, 1000};
+const u64 BENCH_INDEX_CLUSTERS[] = {1000, 10000, 100000};
+const double BENCH_RADIUS = 350.0; // Neighbour radius of the index cases
+const u64 BENCH_EVAL_POINTS = 10000;
+const u64 BENCH_LOAD_POINTS = 20000;
+const int BENCH_QUANTIZE_BITS[] = {8, 16};
+const double BENCH_SPREAD = 1e5; // Warm-up points are this far apart
+
+struct BenchResult {
+  string name;
+  map<string, u64> params;
+  vector<double> samples; // ns per operation, one per repetition
+
+  double mean() const {
+    return accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+  }
+  double stddev() const {
+    double m = mean(), var = 0.0;
+    for (double s : samples) {
+      var += (s - m) * (s - m);
+    }
+    return samples.size() > 1 ? sqrt(var / (samples.size() - 1)) : 0.0;
+  }
+  double median() const {
+    vector<double> sorted = samples;
+    sort(sorted.begin(), sorted.end());
+    size_t n = sorted.size();
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+  }
+};
+
+struct Bench {
+  int reps = 10;
+  u64 seed = 42;
+  string filter;
+  vector<BenchResult> results;
+  volatile double sink = 0.0; // Keeps measured work from being elided
+
+  // Runs body(reps + 1) times; body returns the elapsed ns and sets ops to
+  // the number of operations it timed. The first repetition is a warm-up.
+  template <typename F>
+  void run(const string &name, map<string, u64> params, F &&body) {
+    string label = name;
+    for (const auto &[key, value] : params) {
+      label += " " + key + "=" + to_string(value);
+    }
+    if (!filter.empty() && label.find(filter) == string::npos) {
+      return;
+    }
+    BenchResult result{name, params};
+    for (int r = 0; r <= reps; r++) {
+      u64 ops = 1;
+      double ns = body(ops);
+      if (r > 0) {
+        result.samples.push_back(ns / ops);
+      }
+    }
+    printf("%-66s %12.1f ns/op  +- %5.1f%%  (median %.1f)\n", label.c_str(),
+           result.mean(), 100.0 * result.stddev() / result.mean(),
+           result.median());
+    fflush(stdout);
+    results.push_back(result);
+  }
+
+  void write_json(const string &path) const {
+    ofstream out(path);
+    out << "{\n  \"seed\": " << seed << ",\n  \"reps\": " << reps
+        << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      const auto &r = results[i];
+      out << (i ? "," : "") << "\n    {\"name\": \"" << r.name
+          << "\", \"params\": {";
+      bool first = true;
+      for (const auto &[key, value] : r.params) {
+        out << (first ? "" : ", ") << "\"" << key << "\": " << value;
+        first = false;
+      }
+      auto minmax = minmax_element(r.samples.begin(), r.samples.end());
+      out << "}, \"unit\": \"ns/op\", \"mean\": " << r.mean()
+          << ", \"stddev\": " << r.stddev() << ", \"median\": " << r.median()
+          << ", \"min\": " << *minmax.first << ", \"max\": " << *minmax.second
+          << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+};
+
+template <typename F> double time_ns(F &&f) {
+  auto start = chrono::steady_clock::now();
+  f();
+  return chrono::duration<double, nano>(chrono::steady_clock::now() - start)
+      .count();
+}
+
+vector<Point> random_points(u64 n, u32 dim, double scale, mt19937_64 &gen) {
+  uniform_real_distribution<double> dis(0.0, scale);
+  vector<Point> points(n, Point(dim));
+  for (u64 i = 0; i < n; i++) {
+    for (u32 d = 0; d < dim; d++) {
+      points[i].features[d] = dis(gen);
+    }
+    points[i].timestamp = i + 1;
+    points[i].true_clu_id = i % 7 + 1;
+  }
+  return points;
+}
+
+void bench_distances(Bench &bench) {
+  const u64 ops = 100000;
+  for (u32 dim : BENCH_DIMS) {
+    mt19937_64 gen(bench.seed);
+    auto points = random_points(1024, dim, 1000.0, gen);
+    bench.run("l2_dist", {{"dim", dim}}, [&](u64 &n) {
+      n = ops;
+      double acc = 0.0;
+      double ns = time_ns([&] {
+        for (u64 i = 0; i < ops; i++) {
+          acc += points[i & 1023].l2_dist(points[(i * 7 + 1) & 1023]);
+        }
+      });
+      bench.sink = bench.sink + acc;
+      return ns;
+    });
+
+    // One summary of 16 points, then a nearest scan over 100 summaries.
+    CFTable table(dim);
+    u32 slot = table.allocate();
+    for (int i = 0; i < 16; i++) {
+      table.add_point(slot, points[i].features.data());
+    }
+    bench.run("cf_distance", {{"dim", dim}}, [&](u64 &n) {
+      n = ops;
+      double acc = 0.0;
+      double ns = time_ns([&] {
+        for (u64 i = 0; i < ops; i++) {
+          acc += table.distance(slot, points[i & 1023].features.data());
+        }
+      });
+      bench.sink = bench.sink + acc;
+      return ns;
+    });
+    for (int i = 16; i < 116; i++) {
+      table.add_point(table.allocate(), points[i].features.data());
+    }
+    bench.run("cf_nearest", {{"dim", dim}, {"slots", table.size()}},
+              [&](u64 &n) {
+                n = ops / 100;
+                double acc = 0.0;
+                double ns = time_ns([&] {
+                  for (u64 i = 0; i < n; i++) {
+                    double dist;
+                    table.nearest(points[i & 1023].features.data(), dist);
+                    acc += dist;
+                  }
+                });
+                bench.sink = bench.sink + acc;
+                return ns;
+              });
+  }
+}
+
+// Times insert batches against an instance warmed up with `state` far-apart
+// points. Probes are jittered copies of warm-up points, so they mostly hit
+// existing summaries and the state size stays put across repetitions; the
+// state size actually reached is reported alongside.
+template <typename Make>
+void bench_insert(Bench &bench, const string &name, Make &&make) {
+  for (u32 dim : BENCH_DIMS) {
+    for (u64 state : BENCH_STATE_SIZES) {
+      mt19937_64 gen(bench.seed);
+      auto warm = random_points(state, dim, BENCH_SPREAD, gen);
+      auto algo = make(dim);
+      algo->cluster(warm);
+      u64 reached = thread_stats[Gauge::StateSize];
+      normal_distribution<double> jitter(0.0, 1.0);
+      uniform_int_distribution<u64> pick(0, state - 1);
+      for (u64 batch_size : BENCH_BATCH_SIZES) {
+        vector<Point> batch(batch_size, Point(dim));
+        bench.run("insert/" + name,
+                  {{"dim", dim},
+                   {"state", state},
+                   {"batch", batch_size},
+                   {"state_reached", reached}},
+                  [&](u64 &n) {
+                    for (auto &p : batch) {
+                      p = warm[pick(gen)];
+                      for (auto &f : p.features) {
+                        f += jitter(gen);
+                      }
+                      p.timestamp = state;
+                    }
+                    n = batch_size;
+                    return time_ns([&] { algo->cluster(batch); });
+                  });
+      }
+    }
+  }
+}
+
+// Times a centers poll after each single-point insert, so one summary
+// changes between polls. make(dim, state) configures an instance to keep
+// `state` summaries; it is warmed up with `copies` jittered copies of each
+// of `state` far-apart points, enough for every summary to report a center.
+template <typename Make>
+void bench_centers(Bench &bench, const string &name, int copies,
+                   Make &&make) {
+  const u64 polls = 20;
+  for (u32 dim : BENCH_DIMS) {
+    for (u64 state : BENCH_STATE_SIZES) {
+      mt19937_64 gen(bench.seed);
+      auto warm = random_points(state, dim, BENCH_SPREAD, gen);
+      normal_distribution<double> jitter(0.0, 1.0);
+      auto algo = make(dim, state);
+      algo->cluster(warm);
+      for (int c = 1; c < copies; c++) {
+        vector<Point> batch = warm;
+        for (auto &p : batch) {
+          for (auto &f : p.features) {
+            f += jitter(gen);
+          }
+        }
+        algo->cluster(batch);
+      }
+      u64 centers = algo->centers().size();
+      uniform_int_distribution<u64> pick(0, state - 1);
+      vector<Point> batch(1, Point(dim));
+      bench.run("centers/" + name,
+                {{"dim", dim}, {"state", state}, {"centers", centers}},
+                [&](u64 &n) {
+                  n = polls;
+                  double ns = 0.0;
+                  for (u64 i = 0; i < polls; i++) {
+                    batch[0] = warm[pick(gen)];
+                    for (auto &f : batch[0].features) {
+                      f += jitter(gen);
+                    }
+                    batch[0].timestamp = state;
+                    algo->cluster(batch);
+                    ns += time_ns([&] {
+                      bench.sink = bench.sink + algo->centers().size();
+                    });
+                  }
+                  return ns;
+                });
+    }
+  }
+}
+
+// Nearest-cluster lookups over far-apart clusters with each index kind.
+// Queries lie within BENCH_RADIUS of a cluster, like an insert that joins
+// one; recall_pct is how often the answer matches the exact scan.
+void bench_index(Bench &bench) {
+  const u64 ops = 200;
+  for (u32 dim : BENCH_DIMS) {
+    for (u64 clusters : BENCH_INDEX_CLUSTERS) {
+      mt19937_64 gen(bench.seed);
+      auto centers = random_points(clusters, dim, BENCH_SPREAD, gen);
+      normal_distribution<double> jitter(0.0,
+                                         BENCH_RADIUS / 2 / sqrt(double(dim)));
+      uniform_int_distribution<u64> pick(0, clusters - 1);
+      vector<Point> queries(ops, Point(dim));
+      for (auto &q : queries) {
+        q = centers[pick(gen)];
+        for (auto &f : q.features) {
+          f += jitter(gen);
+        }
+      }
+      CFTable table(dim);
+      for (const auto &c : centers) {
+        table.add_point(table.allocate(), c.features.data());
+      }
+      vector<u32> exact(ops);
+      for (u64 i = 0; i < ops; i++) {
+        double dist;
+        exact[i] = table.nearest(queries[i].features.data(), dist);
+      }
+      for (IndexKind kind :
+           {IndexKind::Scan, IndexKind::BruteForce, IndexKind::LSH}) {
+        IndexConfig config;
+        config.kind = kind;
+        table.use_index(make_cluster_index(config, dim, BENCH_RADIUS));
+        u64 hits = 0;
+        for (u64 i = 0; i < ops; i++) {
+          double dist;
+          hits += table.nearest(queries[i].features.data(), dist) == exact[i];
+        }
+        bench.run("nearest_index",
+                  {{"dim", dim},
+                   {"clusters", clusters},
+                   {"index", static_cast<u64>(kind)},
+                   {"recall_pct", hits * 100 / ops}},
+                  [&](u64 &n) {
+                    n = ops;
+                    double acc = 0.0;
+                    double ns = time_ns([&] {
+                      for (u64 i = 0; i < ops; i++) {
+                        double dist;
+                        table.nearest(queries[i].features.data(), dist);
+                        acc += dist;
+                      }
+                    });
+                    bench.sink = bench.sink + acc;
+                    return ns;
+                  });
+      }
+    }
+  }
+}
+
+// CluStream at capacity with the LSH index: every insert lands far from the
+// micro-clusters, so it opens one and evicts the oldest.
+void bench_evict(Bench &bench) {
+  const u64 batch_size = 100;
+  for (u32 dim : BENCH_DIMS) {
+    for (u64 clusters : BENCH_INDEX_CLUSTERS) {
+      mt19937_64 gen(bench.seed);
+      CluStreamConfig config;
+      config.max_micro_clusters = clusters;
+      config.threshold = BENCH_RADIUS;
+      config.index.kind = IndexKind::LSH;
+      CluStream algo(dim, config);
+      algo.cluster(random_points(clusters, dim, BENCH_SPREAD, gen));
+      u64 now = clusters;
+      bench.run("evict/clustream.lsh", {{"dim", dim}, {"clusters", clusters}},
+                [&](u64 &n) {
+                  auto batch =
+                      random_points(batch_size, dim, BENCH_SPREAD, gen);
+                  for (auto &point : batch) {
+                    point.timestamp = ++now;
+                  }
+                  n = batch_size;
+                  return time_ns([&] { algo.cluster(batch); });
+                });
+    }
+  }
+}
+
+// EDMStream over a chain of cells spaced 0.6 BENCH_RADIUS apart, the
+// dependent distance, with and without the LSH index. Each insert lands
+// near a random chain cell, so the descent checks every cell above it.
+void bench_descent(Bench &bench) {
+  const u64 batch_size = 100;
+  for (u32 dim : BENCH_DIMS) {
+    for (u64 cells : {u64(1000), u64(10000)}) {
+      for (IndexKind kind : {IndexKind::Scan, IndexKind::LSH}) {
+        mt19937_64 gen(bench.seed);
+        EDMStreamConfig config;
+        config.dependent_distance = BENCH_RADIUS;
+        config.decay_interval = numeric_limits<int>::max();
+        config.index.kind = kind;
+        EDMStream algo(dim, config);
+        vector<Point> chain(cells, Point(dim));
+        for (u64 i = 0; i < cells; i++) {
+          chain[i].features[0] = 0.6 * BENCH_RADIUS * i;
+          chain[i].timestamp = i + 1;
+        }
+        algo.cluster(chain);
+        normal_distribution<double> jitter(0.0, 1.0);
+        uniform_int_distribution<u64> pick(0, cells - 1);
+        vector<Point> batch(batch_size, Point(dim));
+        bench.run("descent/edmstream",
+                  {{"dim", dim},
+                   {"cells", cells},
+                   {"index", static_cast<u64>(kind)}},
+                  [&](u64 &n) {
+                    for (auto &p : batch) {
+                      p = chain[pick(gen)];
+                      for (auto &f : p.features) {
+                        f += jitter(gen);
+                      }
+                    }
+                    n = batch_size;
+                    return time_ns([&] { algo.cluster(batch); });
+                  });
+      }
+    }
+  }
+}
+
+void bench_group_by_centers(Bench &bench) {
+  for (u32 dim : BENCH_DIMS) {
+    mt19937_64 gen(bench.seed);
+    auto points = random_points(BENCH_EVAL_POINTS, dim, 1000.0, gen);
+    for (u64 num_centers : BENCH_CENTERS) {
+      auto centers = random_points(num_centers, dim, 1000.0, gen);
+      bench.run("group_by_centers",
+                {{"dim", dim}, {"points", points.size()},
+                 {"centers", num_centers}},
+                [&](u64 &n) {
+                  n = points.size();
+                  vector<int> predicts;
+                  double ns = time_ns(
+                      [&] { predicts = group_by_centers(points, centers); });
+                  bench.sink = bench.sink + predicts[0];
+                  return ns;
+                });
+      for (int bits : BENCH_QUANTIZE_BITS) {
+        Dataset dataset;
+        dataset.dim = dim;
+        dataset.points = points;
+        dataset.quantize(bits);
+        bench.run("group_by_centers.quantized",
+                  {{"dim", dim}, {"points", points.size()},
+                   {"centers", num_centers}, {"bits", bits}},
+                  [&](u64 &n) {
+                    n = points.size();
+                    vector<int> predicts;
+                    double ns = time_ns(
+                        [&] { predicts = group_by_centers(dataset, centers); });
+                    bench.sink = bench.sink + predicts[0];
+                    return ns;
+                  });
+      }
+    }
+  }
+}
+
+void bench_load(Bench &bench) {
+  for (u32 dim : BENCH_DIMS) {
+    mt19937_64 gen(bench.seed);
+    auto points = random_points(BENCH_LOAD_POINTS, dim, 1000.0, gen);
+    string path = "pdsc_bench_" + to_string(dim) + ".csv";
+    {
+      ofstream out(path);
+      out << "# bench " << points.size() << " " << dim << " 7\n";
+      for (const auto &p : points) {
+        for (double f : p.features) {
+          out << f << ",";
+        }
+        out << p.true_clu_id << "\n";
+      }
+    }
+    bench.run("dataset_load", {{"dim", dim}, {"points", points.size()}},
+              [&](u64 &n) {
+                n = points.size();
+                Dataset dataset;
+                double ns = time_ns([&] { dataset.load(path); });
+                bench.sink = bench.sink + dataset.points.size();
+                return ns;
+              });
+    for (int bits : BENCH_QUANTIZE_BITS) {
+      bench.run("dataset_load.quantized",
+                {{"dim", dim}, {"points", points.size()}, {"bits", bits}},
+                [&](u64 &n) {
+                  n = points.size();
+                  Dataset dataset;
+                  double ns = time_ns([&] { dataset.load(path, bits); });
+                  bench.sink = bench.sink + dataset.size();
+                  return ns;
+                });
+    }
+    remove(path.c_str());
+  }
+}
+
+const char *USAGE = "[-r reps] [-s seed] [-f filter] [-o out.json]";
+
+int main(int argc, char *argv[]) {
+  Bench bench;
+  string json = "pdsc_bench.json";
+  int opt;
+  while ((opt = getopt(argc, argv, "r:s:f:o:")) != -1) {
+    switch (opt) {
+    case 'r':
+      bench.reps = max(1, atoi(optarg));
+      break;
+    case 's':
+      bench.seed = strtoull(optarg, nullptr, 10);
+      break;
+    case 'f':
+      bench.filter = optarg;
+      break;
+    case 'o':
+      json = optarg;
+      break;
+    default:
+      cerr << "Usage: " << argv[0] << " " << USAGE << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  bench_distances(bench);
+  bench_insert(bench, "birch", [](u32 dim) { return make_unique<BIRCH>(dim); });
+  bench_insert(bench, "clustream",
+               [](u32 dim) { return make_unique<CluStream>(dim); });
+  bench_insert(bench, "denstream",
+               [](u32 dim) { return make_unique<DenStream>(dim); });
+  bench_insert(bench, "denstream.lsh", [](u32 dim) {
+    DenStreamConfig config;
+    config.index.kind = IndexKind::LSH;
+    return make_unique<DenStream>(dim, config);
+  });
+  bench_insert(bench, "dstream",
+               [](u32 dim) { return make_unique<DStream>(dim); });
+  bench_insert(bench, "edmstream",
+               [](u32 dim) { return make_unique<EDMStream>(dim); });
+  bench_insert(bench, "slkmeans",
+               [](u32 dim) { return make_unique<SLKMeans>(dim, 7); });
+  bench_insert(bench, "streamkm",
+               [](u32 dim) { return make_unique<StreamKM>(dim, 7); });
+  bench_centers(bench, "birch", 1, [](u32 dim, u64) {
+    return make_unique<BIRCH>(dim);
+  });
+  bench_centers(bench, "clustream", 1, [](u32 dim, u64 state) {
+    CluStreamConfig config;
+    config.max_micro_clusters = state;
+    config.time_window = state;
+    return make_unique<CluStream>(dim, config);
+  });
+  bench_centers(bench, "denstream", MIN_POINTS, [](u32 dim, u64) {
+    return make_unique<DenStream>(dim);
+  });
+  bench_centers(bench, "dstream", 1, [](u32 dim, u64 state) {
+    DStreamConfig config;
+    config.time_window = state;
+    return make_unique<DStream>(dim, config);
+  });
+  bench_centers(bench, "edmstream", 1, [](u32 dim, u64) {
+    EDMStreamConfig config;
+    config.decay_interval = numeric_limits<int>::max();
+    return make_unique<EDMStream>(dim, config);
+  });
+  bench_index(bench);
+  bench_evict(bench);
+  bench_descent(bench);
+  bench_group_by_centers(bench);
+  bench_load(bench);
+
+  bench.write_json(json);
+  cout << "Results written to " << json << endl;
+  return 0;
+}
@@ -18,132 +18,261 @@
 #define PDSC_BIRCH_HPP
 
 #include "algorithm.hpp"
+#include "cf_table.hpp"
 #include "common.hpp"
+#include "memory.hpp"
 
 #include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 
 const int BRANCHING_FACTOR = 50;
 const int MAX_ENTRIES = 100;
 
-struct ClusteringFeature {
-  std::vector<double> linear_sum;
-  std::vector<double> squared_sum;
-  int n; // Number of points
+struct BIRCHConfig {
+  int branching_factor = BRANCHING_FACTOR;
+  int max_entries = MAX_ENTRIES;
+  double threshold = 1000.0; // Threshold for CF entry distance
 
-  ClusteringFeature(int dimensions)
-      : linear_sum(dimensions, 0.0), squared_sum(dimensions, 0.0), n(0) {}
-
-  void addPoint(const Point &point) {
-    n++;
-    for (int i = 0; i < point.features.size(); i++) {
-      linear_sum[i] += point.features[i];
-      squared_sum[i] += point.features[i] * point.features[i];
-    }
-  }
-
-  void addCF(const ClusteringFeature &cf) {
-    n += cf.n;
-    for (int i = 0; i < linear_sum.size(); i++) {
-      linear_sum[i] += cf.linear_sum[i];
-      squared_sum[i] += cf.squared_sum[i];
-    }
-  }
-
-  double calcDistance(const Point &point) const {
-    double dist = 0.0;
-    for (int i = 0; i < point.features.size(); i++) {
-      double mean = linear_sum[i] / n;
-      dist += (point.features[i] - mean) * (point.features[i] - mean);
+  bool set(const std::string &key, double value) {
+    if (key == "branching_factor") {
+      branching_factor = checked_count(key, value, 2);
+    } else if (key == "max_entries") {
+      max_entries = checked_count(key, value, 1);
+    } else if (key == "threshold") {
+      threshold = checked_param(key, value, 0.0);
+    } else {
+      return false;
     }
-    return sqrt(dist);
+    return true;
   }
 };
 
-struct CFNode;
-
-struct CFNode {
+// Entries live in slots [0, entries.size()) of the node's table, in order;
+// entry i of an inner node summarises children[i]. A leaf's centers are
+// filed under its serial in the upper half of the key.
+struct CFNode : TrackedObject<MemoryCategory::TreeNodes> {
   bool isLeaf;
-  std::vector<ClusteringFeature> entries;
-  std::vector<CFNode *> children;
+  bool touched = false; // Leaf changed since the last centers()
+  u32 serial;
+  CFTable entries;
+  tracked_vector<CFNode *, MemoryCategory::TreeNodes> children;
 
-  CFNode(bool leaf) : isLeaf(leaf) {
-    entries.reserve(MAX_ENTRIES);
-    children.reserve(BRANCHING_FACTOR);
+  CFNode(bool leaf, u32 serial, int dimensions, const BIRCHConfig &config)
+      : isLeaf(leaf), serial(serial), entries(dimensions) {
+    children.reserve(config.branching_factor);
   }
 };
 
 class BIRCH : public Algorithm {
 public:
-  BIRCH(int dimensions) : dimensions(dimensions), root(new CFNode(true)) {}
+  BIRCH(int dimensions, const BIRCHConfig &config = {})
+      : dimensions(dimensions), config(config), filed(dimensions),
+        root(makeNode(true)) {}
+
+  ~BIRCH() { deleteTree(root); }
 
-  void insert(const Point &point) {
-    ClusteringFeature cf(dimensions);
-    insertCF(root, cf, point);
+  void insert(const Point &point) { insertCF(root, point.features.data()); }
+
+  std::vector<Summary> export_summaries() {
+    std::vector<Summary> summaries;
+    export_recursive(root, summaries);
+    return summaries;
+  }
+
+  void merge(const std::vector<Summary> &summaries) {
+    std::vector<double> mean(dimensions);
+    for (const auto &summary : summaries) {
+      for (int d = 0; d < dimensions; d++) {
+        mean[d] = summary.linear_sum[d] / summary.weight;
+      }
+      insertCF(root, mean.data(), &summary);
+    }
+    PDSC_GAUGE(StateSize, num_entries);
   }
 
   void cluster(const std::vector<Point> &points) {
     for (const auto &point : points) {
       insert(point);
     }
+    PDSC_GAUGE(StateSize, num_entries);
   }
 
-  std::vector<Point> output_centers() {
-    std::vector<Point> centers;
-    output_centers_recursive(root, centers);
-    return centers;
+  // Only the leaves inserted into since the last call are refiled.
+  const std::vector<Point> &centers() {
+    for (CFNode *leaf : touched) {
+      leaf->entries.sync_centers(filed, u64(leaf->serial) << 32,
+                                 [](u32) { return true; });
+      leaf->touched = false;
+    }
+    touched.clear();
+    return filed.view();
+  }
+
+  // Classic BIRCH rebuild: doubles the threshold and reinserts the leaf
+  // entries, so close entries are absorbed into each other.
+  void shrink() {
+    std::vector<Summary> entries = export_summaries();
+    forgetCenters();
+    deleteTree(root);
+    root = makeNode(true);
+    num_entries = 0;
+    config.threshold *= 2;
+    merge(entries);
+  }
+
+  // The tree is written in preorder, each node followed by the preorder
+  // indices of its children.
+  void snapshot(SnapshotWriter &out) const {
+    out.write_header("birch", dimensions);
+    out.write<u64>(num_entries);
+    std::vector<const CFNode *> nodes;
+    preorder(root, nodes);
+    std::unordered_map<const CFNode *, u32> index;
+    for (u32 i = 0; i < nodes.size(); i++) {
+      index[nodes[i]] = i;
+    }
+    out.write<u64>(nodes.size());
+    std::vector<u32> children;
+    for (const CFNode *node : nodes) {
+      const CFTable &entries = node->entries;
+      out.write<bool>(node->isLeaf);
+      out.write<u64>(entries.size());
+      for (u32 e = 0; e < entries.end(); e++) {
+        out.write<double>(entries.count(e));
+        out.write_array(entries.linear_sum(e), dimensions);
+        out.write_array(entries.squared_sum(e), dimensions);
+      }
+      children.clear();
+      for (const CFNode *child : node->children) {
+        children.push_back(index[child]);
+      }
+      out.write_vector(children);
+    }
   }
 
-  void output_centers_recursive(CFNode *node, std::vector<Point> &centers) {
+  void restore(SnapshotReader &in) {
+    in.expect_header("birch", dimensions);
+    u64 restored_entries = in.read<u64>();
+    std::vector<std::unique_ptr<CFNode>> nodes(in.read_count());
+    std::vector<std::vector<u32>> children(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+      nodes[i].reset(makeNode(in.read<bool>()));
+      CFTable &entries = nodes[i]->entries;
+      u64 num = in.read_count();
+      for (u64 e = 0; e < num; e++) {
+        u32 slot = entries.allocate();
+        entries.count(slot) = in.read<double>();
+        in.read_array(entries.linear_sum(slot), dimensions);
+        in.read_array(entries.squared_sum(slot), dimensions);
+        entries.refresh(slot);
+      }
+      in.read_vector(children[i]);
+    }
+    if (nodes.empty()) {
+      throw std::runtime_error("snapshot has an empty BIRCH tree");
+    }
+    link_tree(nodes, children, "BIRCH tree");
+    forgetCenters();
+    deleteTree(root);
+    root = nodes[0].get();
+    num_entries = restored_entries;
+    for (auto &node : nodes) {
+      touch(node.release());
+    }
+  }
+
+private:
+  void preorder(const CFNode *node, std::vector<const CFNode *> &nodes) const {
+    nodes.push_back(node);
+    for (const CFNode *child : node->children) {
+      preorder(child, nodes);
+    }
+  }
+
+  void deleteTree(CFNode *node) {
+    for (CFNode *child : node->children) {
+      deleteTree(child);
+    }
+    delete node;
+  }
+
+  void export_recursive(CFNode *node, std::vector<Summary> &summaries) {
     if (node->isLeaf) {
-      for (const auto &cf : node->entries) {
-        Point center(cf.linear_sum);
-        center /= cf.n;
-        centers.push_back(center);
+      const CFTable &entries = node->entries;
+      for (u32 e = 0; e < entries.end(); e++) {
+        summaries.push_back(
+            {{entries.linear_sum(e), entries.linear_sum(e) + dimensions},
+             {entries.squared_sum(e), entries.squared_sum(e) + dimensions},
+             entries.count(e)});
       }
     } else {
       for (const auto &child : node->children) {
-        output_centers_recursive(child, centers);
+        export_recursive(child, summaries);
       }
     }
   }
 
-private:
   int dimensions;
+  BIRCHConfig config;
+  u32 serials = 0; // Nodes made
+  CenterCache filed;
+  std::vector<CFNode *> touched;
   CFNode *root;
 
-  void insertCF(CFNode *&node, ClusteringFeature &cf, const Point &point) {
+  CFNode *makeNode(bool leaf) {
+    return new CFNode(leaf, serials++, dimensions, config);
+  }
+
+  void touch(CFNode *node) {
+    if (node->isLeaf && !node->touched) {
+      node->touched = true;
+      touched.push_back(node);
+    }
+  }
+
+  // Before the tree is replaced.
+  void forgetCenters() {
+    filed.clear();
+    touched.clear();
+  }
+  u64 num_entries = 0; // Leaf CF entries created
+
+  // Inserts point, or the whole of incoming (whose mean is point) when set.
+  void insertCF(CFNode *&node, const double *point,
+                const Summary *incoming = nullptr) {
+    CFTable &entries = node->entries;
     if (node->isLeaf) {
       // Find the closest CF entry
-      int closestIndex = -1;
-      double closestDist = std::numeric_limits<double>::max();
-      for (int i = 0; i < node->entries.size(); i++) {
-        double dist = node->entries[i].calcDistance(point);
-        if (dist < closestDist) {
-          closestDist = dist;
-          closestIndex = i;
-        }
-      }
+      double closestDist;
+      u32 closest = entries.nearest(point, closestDist);
 
-      // Add the point to the closest CF entry
-      if (closestDist < threshold) {
-        node->entries[closestIndex].addPoint(point);
+      // Add the point to the closest CF entry, or create a new one
+      u32 slot = closest;
+      if (closestDist >= config.threshold) {
+        slot = entries.allocate();
+        num_entries++;
+      }
+      if (incoming) {
+        entries.add(slot, incoming->linear_sum.data(),
+                    incoming->squared_sum.data(), incoming->weight);
       } else {
-        // Create a new CF entry
-        ClusteringFeature newCF(dimensions);
-        newCF.addPoint(point);
-        node->entries.push_back(newCF);
-
-        // Split the node if necessary
-        if (node->entries.size() > MAX_ENTRIES) {
-          splitNode(node);
-        }
+        entries.add_point(slot, point);
+      }
+      touch(node);
+
+      // Split the node if necessary
+      if (entries.size() > config.max_entries) {
+        splitNode(node);
       }
     } else {
-      // Find the closest child node
+      // Find the closest child node by its first entry
       int closestIndex = -1;
       double closestDist = std::numeric_limits<double>::max();
       for (int i = 0; i < node->children.size(); i++) {
-        double dist = node->children[i]->entries[0].calcDistance(point);
+        double dist = node->children[i]->entries.distance(0, point);
         if (dist < closestDist) {
           closestDist = dist;
           closestIndex = i;
@@ -151,18 +280,22 @@ private:
       }
 
       // Recursively insert the CF into the child node
-      insertCF(node->children[closestIndex], node->entries[closestIndex],
-               point);
+      insertCF(node->children[closestIndex], point, incoming);
     }
   }
 
   void splitNode(CFNode *&node) {
-    // Split the node into two nodes
-    CFNode *newNode(new CFNode(node->isLeaf));
-    for (int i = 0; i < node->entries.size() / 2; i++) {
-      newNode->entries.push_back(node->entries.back());
-      node->entries.pop_back();
+    PDSC_COUNT(BirchSplits);
+    // Split the node into two nodes; the new one takes the back half of the
+    // entries and children, last first
+    CFNode *newNode = makeNode(node->isLeaf);
+    touch(newNode);
+    u32 total = node->entries.end();
+    u32 kept = total - total / 2;
+    for (u32 e = total; e-- > kept;) {
+      newNode->entries.copy_from(node->entries, e);
     }
+    node->entries.truncate(kept);
 
     if (!node->isLeaf) {
       for (int i = 0; i < node->children.size() / 2; i++) {
@@ -173,8 +306,8 @@ private:
 
     // Add the new node to the parent
     if (node == root) {
-      CFNode *newRoot(new CFNode(false));
-      newRoot->entries.push_back(ClusteringFeature(dimensions));
+      CFNode *newRoot = makeNode(false);
+      newRoot->entries.allocate();
       newRoot->children.push_back(root);
       newRoot->children.push_back(newNode);
       root = newRoot;
@@ -182,7 +315,7 @@ private:
       // Add the new node to the parent's children
       CFNode *parent = findParent(root, node);
       parent->children.push_back(newNode);
-      parent->entries.push_back(ClusteringFeature(dimensions));
+      parent->entries.allocate();
     }
   }
 
@@ -203,8 +336,6 @@ private:
     }
     return nullptr;
   }
-
-  const double threshold = 1000.0; // Threshold for CF entry distance
 };
 
 #endif // PDSC_BIRCH_HPP
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_CENTER_CACHE_HPP
+#define PDSC_CENTER_CACHE_HPP
+
+#include "common.hpp"
+#include "point.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+// Persistent buffer of cluster centers, each filed under a key the
+// algorithm chooses (a slot id, a node serial). An algorithm brings it in
+// step with only the clusters it changed since the last query, and hands
+// out the buffer itself as the read-only view. Removal swaps the last
+// center into the hole, so the order of the centers is unspecified.
+class CenterCache {
+public:
+  explicit CenterCache(int dimensions) : dims(dimensions) {}
+
+  const std::vector<Point> &view() const { return centers; }
+  size_t size() const { return centers.size(); }
+
+  // Features of the center under `key`, added if absent, to be overwritten.
+  double *put(u64 key) {
+    auto [it, added] = positions.emplace(key, centers.size());
+    if (added) {
+      centers.emplace_back(dims);
+      keys.push_back(key);
+    }
+    return centers[it->second].features.data();
+  }
+
+  void erase(u64 key) {
+    auto it = positions.find(key);
+    if (it == positions.end()) {
+      return;
+    }
+    u32 hole = it->second;
+    positions.erase(it);
+    if (hole + 1 != centers.size()) {
+      std::swap(centers[hole], centers.back());
+      keys[hole] = keys.back();
+      positions[keys[hole]] = hole;
+    }
+    centers.pop_back();
+    keys.pop_back();
+  }
+
+  // Keys of the centers, in the order of view().
+  const std::vector<u64> &filed_under() const { return keys; }
+
+  void clear() {
+    centers.clear();
+    keys.clear();
+    positions.clear();
+  }
+
+private:
+  int dims;
+  std::vector<Point> centers;
+  std::vector<u64> keys;
+  std::unordered_map<u64, u32> positions;
+};
+
+#endif // PDSC_CENTER_CACHE_HPP
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_CENTER_PUBLISHER_HPP
+#define PDSC_CENTER_PUBLISHER_HPP
+
+#include "aligned_allocator.hpp"
+#include "common.hpp"
+#include "evaluation.hpp"
+#include "point.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+const int MAX_READERS = 64; // Reader handles one publisher can hand out
+
+struct Assignment {
+  int cluster = -1; // Index into the snapshot's centers; -1 without centers
+  double distance = 0.0;
+  u64 version = 0; // Snapshot the answer came from
+};
+
+// Immutable set of centers with its nearest-center index.
+struct CenterSnapshot {
+  CenterSnapshot(std::vector<Point> centers, u64 version)
+      : centers(std::move(centers)), assigner(this->centers),
+        version(version) {}
+
+  const std::vector<Point> centers;
+  const CenterAssigner assigner;
+  const u64 version;
+};
+
+// Publishes center snapshots from the ingest thread to any number of query
+// threads with epoch-based reclamation. publish() swaps in a new immutable
+// snapshot and retires the old one under the current epoch; a reader
+// announces the epoch in its own cache line before loading the snapshot
+// and withdraws it afterwards. A retired snapshot is freed once every
+// announced epoch is newer than its retirement. Readers never lock, never
+// wait and never write shared lines; the ingest thread never waits for
+// readers either, it only frees less often while they are active.
+class CenterPublisher {
+public:
+  class Reader {
+  public:
+    Reader(Reader &&other) noexcept
+        : publisher(std::exchange(other.publisher, nullptr)),
+          slot(other.slot) {}
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+    ~Reader() {
+      if (publisher) {
+        publisher->slots[slot].claimed.store(false, std::memory_order_release);
+      }
+    }
+
+    // Nearest center of x in the latest published snapshot.
+    Assignment assign(const double *x) const {
+      auto &announced = publisher->slots[slot].epoch;
+      announced.store(publisher->epoch.load());
+      const CenterSnapshot *snapshot = publisher->current.load();
+      Assignment result;
+      double dist2;
+      result.cluster = snapshot->assigner.nearest(x, dist2);
+      result.distance = result.cluster >= 0 ? std::sqrt(dist2) : 0.0;
+      result.version = snapshot->version;
+      announced.store(IDLE, std::memory_order_release);
+      return result;
+    }
+
+    Assignment assign(const Point &point) const {
+      return assign(point.features.data());
+    }
+
+  private:
+    friend class CenterPublisher;
+    Reader(CenterPublisher *publisher, int slot)
+        : publisher(publisher), slot(slot) {}
+
+    CenterPublisher *publisher;
+    int slot;
+  };
+
+  CenterPublisher() : current(new CenterSnapshot({}, 0)) {}
+
+  ~CenterPublisher() {
+    delete current.load();
+    for (const auto &entry : retired) {
+      delete entry.first;
+    }
+  }
+
+  CenterPublisher(const CenterPublisher &) = delete;
+  CenterPublisher &operator=(const CenterPublisher &) = delete;
+
+  // Claims one of MAX_READERS slots for the calling thread. Throws
+  // std::runtime_error when all are taken.
+  Reader reader() {
+    for (int i = 0; i < MAX_READERS; i++) {
+      bool expected = false;
+      if (slots[i].claimed.compare_exchange_strong(expected, true)) {
+        return Reader(this, i);
+      }
+    }
+    throw std::runtime_error("no free reader slot");
+  }
+
+  // Single writer: the thread that owns the algorithm.
+  void publish(std::vector<Point> centers) {
+    auto *next = new CenterSnapshot(std::move(centers), ++version);
+    CenterSnapshot *old = current.exchange(next);
+    retired.emplace_back(old, epoch.fetch_add(1));
+    reclaim();
+  }
+
+  u64 published() const { return version; }
+  size_t pending() const { return retired.size(); } // Retired, not yet freed
+
+private:
+  static constexpr u64 IDLE = std::numeric_limits<u64>::max();
+
+  struct alignas(CACHE_LINE) Slot {
+    std::atomic<u64> epoch{IDLE}; // Announced while a query is in flight
+    std::atomic<bool> claimed{false};
+  };
+
+  std::atomic<CenterSnapshot *> current;
+  std::atomic<u64> epoch{1};
+  Slot slots[MAX_READERS];
+  std::vector<std::pair<CenterSnapshot *, u64>> retired; // Writer only
+  u64 version = 0;
+
+  void reclaim() {
+    u64 oldest = IDLE;
+    for (const auto &slot : slots) {
+      oldest = std::min(oldest, slot.epoch.load());
+    }
+    size_t kept = 0;
+    for (const auto &entry : retired) {
+      if (entry.second < oldest) {
+        delete entry.first;
+      } else {
+        retired[kept++] = entry;
+      }
+    }
+    retired.resize(kept);
+  }
+};
+
+#endif // PDSC_CENTER_PUBLISHER_HPP
@@ -0,0 +1,385 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_CF_TABLE_HPP
+#define PDSC_CF_TABLE_HPP
+
+#include "aligned_allocator.hpp"
+#include "center_cache.hpp"
+#include "cluster_index.hpp"
+#include "common.hpp"
+#include "kdtree.hpp"
+#include "memory.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+const u32 NO_SLOT = ~0u;
+
+// Cluster features of many clusters as a structure of arrays: a count,
+// weight and timestamp per slot, and row-major linear sums, squared sums and
+// cached means whose rows are padded to whole cache lines. A nearest-cluster
+// scan streams through the means and their cached squared norms in slot
+// order. Slot ids are stable until released and are reused from a free list;
+// rows move when the table grows, so hold ids rather than row pointers.
+// With a ClusterIndex installed, nearest() only measures the candidates it
+// proposes, and the index follows every slot that is added to or released.
+// Slots whose sums change or that are released are journaled, so a
+// CenterCache can follow the table by refiling just those.
+class CFTable {
+public:
+  explicit CFTable(int dimensions)
+      : dims(dimensions), stride((dimensions + 7) / 8 * 8) {}
+
+  int dimensions() const { return dims; }
+  size_t size() const { return live; }
+  u32 end() const { return counts.size(); } // One past the highest slot
+  bool occupied(u32 slot) const { return used[slot]; }
+
+  // Installs an index over the current and future slots; nullptr removes it.
+  void use_index(std::unique_ptr<ClusterIndex> new_index) {
+    index = std::move(new_index);
+    reindexAll();
+  }
+
+  // A zeroed slot. Its mean is undefined (NaN) until something is added.
+  u32 allocate() {
+    u32 slot;
+    if (!free_slots.empty()) {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    } else {
+      slot = end();
+      counts.push_back(0.0);
+      weights.push_back(0.0);
+      times.push_back(0.0);
+      norms2.push_back(0.0);
+      used.push_back(0);
+      marked.push_back(0);
+      sums.resize(sums.size() + stride);
+      squares.resize(squares.size() + stride);
+      means.resize(means.size() + stride);
+    }
+    counts[slot] = weights[slot] = times[slot] = 0.0;
+    std::fill_n(&sums[slot * stride], dims, 0.0);
+    std::fill_n(&squares[slot * stride], dims, 0.0);
+    refresh(slot);
+    used[slot] = 1;
+    live++;
+    return slot;
+  }
+
+  void release(u32 slot) {
+    if (index) {
+      index->remove(slot);
+    }
+    touch(slot);
+    used[slot] = 0;
+    free_slots.push_back(slot);
+    live--;
+  }
+
+  // Drops every slot at or above `new_end`.
+  void truncate(u32 new_end) {
+    if (new_end >= end()) {
+      return;
+    }
+    for (u32 slot = new_end; slot < end(); slot++) {
+      live -= used[slot];
+      if (index) {
+        index->remove(slot);
+      }
+    }
+    free_slots.erase(std::remove_if(free_slots.begin(), free_slots.end(),
+                                    [&](u32 slot) { return slot >= new_end; }),
+                     free_slots.end());
+    resize(new_end);
+    relaid = true;
+  }
+
+  // Moves the occupied slots down to [0, size()) in their current order and
+  // returns storage. Returns the new id of every old slot, NO_SLOT if free.
+  std::vector<u32> compact() {
+    std::vector<u32> moved(end(), NO_SLOT);
+    u32 next = 0;
+    for (u32 slot = 0; slot < end(); slot++) {
+      if (!used[slot]) {
+        continue;
+      }
+      if (slot != next) {
+        counts[next] = counts[slot];
+        weights[next] = weights[slot];
+        times[next] = times[slot];
+        norms2[next] = norms2[slot];
+        used[next] = 1;
+        std::copy_n(&sums[slot * stride], stride, &sums[next * stride]);
+        std::copy_n(&squares[slot * stride], stride, &squares[next * stride]);
+        std::copy_n(&means[slot * stride], stride, &means[next * stride]);
+      }
+      moved[slot] = next++;
+    }
+    free_slots.clear();
+    resize(next);
+    counts.shrink_to_fit();
+    weights.shrink_to_fit();
+    times.shrink_to_fit();
+    norms2.shrink_to_fit();
+    used.shrink_to_fit();
+    marked.shrink_to_fit();
+    sums.shrink_to_fit();
+    squares.shrink_to_fit();
+    means.shrink_to_fit();
+    free_slots.shrink_to_fit();
+    reindexAll();
+    relaid = true;
+    return moved;
+  }
+
+  void clear() { truncate(0); }
+
+  double &count(u32 slot) { return counts[slot]; }
+  double count(u32 slot) const { return counts[slot]; }
+  double &weight(u32 slot) { return weights[slot]; }
+  double weight(u32 slot) const { return weights[slot]; }
+  double &time(u32 slot) { return times[slot]; }
+  double time(u32 slot) const { return times[slot]; }
+
+  // Writable rows; call refresh() after changing them directly.
+  double *linear_sum(u32 slot) { return &sums[slot * stride]; }
+  const double *linear_sum(u32 slot) const { return &sums[slot * stride]; }
+  double *squared_sum(u32 slot) { return &squares[slot * stride]; }
+  const double *squared_sum(u32 slot) const { return &squares[slot * stride]; }
+  const double *mean(u32 slot) const { return &means[slot * stride]; }
+  double norm2(u32 slot) const { return norms2[slot]; }
+
+  void add_point(u32 slot, const double *x) {
+    counts[slot] += 1;
+    double *ls = linear_sum(slot), *ss = squared_sum(slot);
+    for (int d = 0; d < dims; d++) {
+      ls[d] += x[d];
+      ss[d] += x[d] * x[d];
+    }
+    refresh(slot);
+  }
+
+  // Absorbs another cluster feature of n points.
+  void add(u32 slot, const double *ls_in, const double *ss_in, double n) {
+    counts[slot] += n;
+    double *ls = linear_sum(slot), *ss = squared_sum(slot);
+    for (int d = 0; d < dims; d++) {
+      ls[d] += ls_in[d];
+      ss[d] += ss_in[d];
+    }
+    refresh(slot);
+  }
+
+  // Copies a slot of another table of the same dimensionality into a new one.
+  u32 copy_from(const CFTable &other, u32 from) {
+    u32 slot = allocate();
+    counts[slot] = other.counts[from];
+    weights[slot] = other.weights[from];
+    times[slot] = other.times[from];
+    norms2[slot] = other.norms2[from];
+    std::copy_n(&other.sums[from * stride], stride, &sums[slot * stride]);
+    std::copy_n(&other.squares[from * stride], stride, &squares[slot * stride]);
+    std::copy_n(&other.means[from * stride], stride, &means[slot * stride]);
+    reindex(slot);
+    return slot;
+  }
+
+  // Recomputes the cached mean and its squared norm from the sums.
+  void refresh(u32 slot) {
+    const double *ls = linear_sum(slot);
+    double *mu = &means[slot * stride];
+    double norm = 0.0;
+    for (int d = 0; d < dims; d++) {
+      mu[d] = ls[d] / counts[slot];
+      norm += mu[d] * mu[d];
+    }
+    norms2[slot] = norm;
+    reindex(slot);
+    touch(slot);
+  }
+
+  // Brings `cache` in step with the slots changed since the last call,
+  // filing slot s under base + s; `include(slot)` picks the occupied slots
+  // that are centers. The journal serves one cache per table.
+  template <typename Include>
+  void sync_centers(CenterCache &cache, u64 base, Include include) {
+    auto file = [&](u32 slot) {
+      if (used[slot] && include(slot)) {
+        std::copy_n(mean(slot), dims, cache.put(base + slot));
+      } else {
+        cache.erase(base + slot);
+      }
+    };
+    if (relaid) {
+      for (u32 slot = 0; slot < synced_end; slot++) {
+        cache.erase(base + slot);
+      }
+      for (u32 slot = 0; slot < end(); slot++) {
+        file(slot);
+      }
+      std::fill(marked.begin(), marked.end(), 0);
+      relaid = false;
+    } else {
+      for (u32 slot : changed) {
+        file(slot);
+        marked[slot] = 0;
+      }
+    }
+    changed.clear();
+    synced_end = end();
+  }
+
+  // Makes the next sync_centers() refile every slot, for a change in what
+  // `include` selects.
+  void invalidate_centers() { relaid = true; }
+
+  // Drops every center this table filed into `cache` under `base`.
+  void forget_centers(CenterCache &cache, u64 base) {
+    for (u32 slot = 0; slot < synced_end; slot++) {
+      cache.erase(base + slot);
+    }
+  }
+
+  double distance(u32 slot, const double *x) const {
+    PDSC_COUNT(DistanceCalls);
+    return std::sqrt(bounded_distance2(x, mean(slot), dims,
+                                       std::numeric_limits<double>::max()));
+  }
+
+  // Nearest occupied slot to x that `accept` lets through, or NO_SLOT with
+  // dist at the largest double. Without an index, ties go to the lowest id.
+  // A slot is only measured if | |x| - |mean| |, a lower bound on its
+  // distance, could beat the best so far; slots without a mean are never
+  // chosen.
+  template <typename Accept>
+  u32 nearest(const double *x, double &dist, Accept accept) const {
+    double x_norm = 0.0;
+    for (int d = 0; d < dims; d++) {
+      x_norm += x[d] * x[d];
+    }
+    x_norm = std::sqrt(x_norm);
+    u32 best = NO_SLOT;
+    double best2 = std::numeric_limits<double>::max();
+    auto consider = [&](u32 slot) {
+      if (!accept(slot)) {
+        return;
+      }
+      double gap = x_norm - std::sqrt(norms2[slot]);
+      if (gap * gap >= best2) {
+        return;
+      }
+      PDSC_COUNT(DistanceCalls);
+      double d2 = bounded_distance2(x, &means[slot * stride], dims, best2);
+      if (d2 < best2) {
+        best2 = d2;
+        best = slot;
+      }
+    };
+    if (index) {
+      candidates.clear();
+      index->candidates(x, candidates);
+      PDSC_COUNT_N(IndexCandidates, candidates.size());
+      for (u32 slot : candidates) {
+        consider(slot);
+      }
+    } else {
+      for (u32 slot = 0; slot < end(); slot++) {
+        if (used[slot]) {
+          consider(slot);
+        }
+      }
+    }
+    dist = best == NO_SLOT ? std::numeric_limits<double>::max()
+                           : std::sqrt(best2);
+    return best;
+  }
+
+  u32 nearest(const double *x, double &dist) const {
+    return nearest(x, dist, [](u32) { return true; });
+  }
+
+private:
+  template <typename T, size_t Align = alignof(std::max_align_t)>
+  using Column = tracked_vector<T, MemoryCategory::Summaries, Align>;
+
+  int dims;
+  size_t stride; // Doubles per row, a multiple of a cache line
+  size_t live = 0;
+  Column<double> counts, weights, times, norms2;
+  Column<char> used;
+  Column<u32> free_slots;
+  Column<char> marked;  // Slots in `changed`
+  Column<u32> changed;  // Slots refreshed or released since sync_centers()
+  bool relaid = false;  // Slots were dropped or renumbered since then
+  u32 synced_end = 0;   // end() at the last sync_centers()
+  Column<double, CACHE_LINE> sums, squares, means;
+  std::unique_ptr<ClusterIndex> index;
+  mutable std::vector<u32> candidates; // Scratch of nearest()
+
+  // Keeps the index entry of a slot in step with its mean, which only
+  // exists once something has been added.
+  void reindex(u32 slot) {
+    if (!index) {
+      return;
+    }
+    if (counts[slot] <= 0.0) {
+      index->remove(slot);
+    } else if (index->contains(slot)) {
+      index->move(slot, mean(slot));
+    } else {
+      index->insert(slot, mean(slot));
+    }
+  }
+
+  void reindexAll() {
+    if (!index) {
+      return;
+    }
+    index->clear();
+    for (u32 slot = 0; slot < end(); slot++) {
+      if (used[slot]) {
+        reindex(slot);
+      }
+    }
+  }
+
+  void touch(u32 slot) {
+    if (!marked[slot]) {
+      marked[slot] = 1;
+      changed.push_back(slot);
+    }
+  }
+
+  void resize(u32 slots) {
+    counts.resize(slots);
+    weights.resize(slots);
+    times.resize(slots);
+    norms2.resize(slots);
+    used.resize(slots);
+    marked.resize(slots);
+    sums.resize(slots * stride);
+    squares.resize(slots * stride);
+    means.resize(slots * stride);
+  }
+};
+
+#endif // PDSC_CF_TABLE_HPP
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_CHECKPOINT_HPP
+#define PDSC_CHECKPOINT_HPP
+
+#include "algorithm.hpp"
+#include "common.hpp"
+#include "metrics.hpp"
+#include "snapshot.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+#include <string>
+
+// Serializes algo into buffer behind a versioned file header. position is the
+// number of stream points the state has absorbed.
+inline void save_snapshot(const Algorithm &algo, u64 position,
+                          std::string &buffer) {
+  buffer.clear();
+  SnapshotWriter out(buffer);
+  out.write<u32>(SNAPSHOT_MAGIC);
+  out.write<u32>(SNAPSHOT_VERSION);
+  out.write<u64>(position);
+  algo.snapshot(out);
+}
+
+// Restores algo from a buffer written by save_snapshot and returns the
+// stream position it was taken at.
+inline u64 restore_snapshot(Algorithm &algo, const std::string &buffer) {
+  SnapshotReader in(buffer.data(), buffer.size());
+  if (in.read<u32>() != SNAPSHOT_MAGIC) {
+    throw std::runtime_error("not a snapshot");
+  }
+  if (in.read<u32>() != SNAPSHOT_VERSION) {
+    throw std::runtime_error("unsupported snapshot version");
+  }
+  u64 position = in.read<u64>();
+  algo.restore(in);
+  return position;
+}
+
+// Whole file in one read, so restore runs from memory.
+inline std::string read_file(const std::string &path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    throw std::runtime_error("cannot open " + path);
+  }
+  std::string buffer(file.tellg(), '\0');
+  file.seekg(0);
+  file.read(&buffer[0], buffer.size());
+  return buffer;
+}
+
+// Double-buffered background checkpointing. checkpoint() serializes the
+// state into the idle buffer on the calling thread, which costs a bulk copy
+// of the summaries, then hands it to a background writer and returns; the
+// other buffer stays owned by the write in flight. The file is replaced
+// atomically by writing a temporary and renaming it.
+class Checkpointer {
+public:
+  explicit Checkpointer(std::string path) : path(std::move(path)) {}
+  ~Checkpointer() { wait(); }
+
+  Checkpointer(const Checkpointer &) = delete;
+  Checkpointer &operator=(const Checkpointer &) = delete;
+
+  // Returns false, without taking a checkpoint, while the previous write is
+  // still in flight.
+  bool checkpoint(const Algorithm &algo, u64 position) {
+    if (pending.valid() && pending.wait_for(std::chrono::seconds(0)) !=
+                               std::future_status::ready) {
+      skipped++;
+      return false;
+    }
+    wait();
+    u64 start = CycleClock::now();
+    std::string &buffer = buffers[current];
+    save_snapshot(algo, position, buffer);
+    serialize_ns += CycleClock::to_ns(CycleClock::now() - start);
+    bytes = buffer.size();
+    taken++;
+    pending = std::async(std::launch::async,
+                         [this, &buffer] { write(buffer); });
+    current ^= 1;
+    return true;
+  }
+
+  // Blocks until the write in flight, if any, has finished.
+  void wait() {
+    if (!pending.valid()) {
+      return;
+    }
+    try {
+      pending.get();
+    } catch (const std::exception &e) {
+      failed++;
+      error = e.what();
+    }
+  }
+
+  u64 taken = 0;        // Checkpoints written
+  u64 skipped = 0;      // Requests dropped while a write was in flight
+  u64 bytes = 0;        // Size of the latest checkpoint
+  u64 serialize_ns = 0; // Ingestion time spent serializing, summed
+  u64 failed = 0;       // Writes that failed; error holds the latest reason
+  std::string error;
+
+private:
+  std::string path;
+  std::string buffers[2];
+  int current = 0;
+  std::future<void> pending;
+
+  void write(const std::string &buffer) const {
+    std::string tmp = path + ".tmp";
+    {
+      std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+      file.write(buffer.data(), buffer.size());
+      if (!file) {
+        throw std::runtime_error("cannot write " + tmp);
+      }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+      throw std::runtime_error("cannot rename " + tmp);
+    }
+  }
+};
+
+#endif // PDSC_CHECKPOINT_HPP
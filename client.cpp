@@ -0,0 +1,138 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays a dataset into a running `pdsc -D` daemon at full speed, then
+// queries its centers and labels every point through it.
+
+#include "common.hpp"
+#include "evaluation.hpp"
+#include "point.hpp"
+#include "server.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const char *USAGE =
+    "[-s socket|-] [-b batch_size] [-n num_points] [-x] /path/to/dataset\n"
+    "  -s  daemon socket, or - to write batches to stdout for piping into\n"
+    "      `pdsc -D -`; queries need a socket\n"
+    "  -x  shut the daemon down afterwards";
+
+int main(int argc, char *argv[]) {
+  string path = "pdsc.sock";
+  u64 batch_size = BATCH_SIZE;
+  u64 num_points = 0;
+  bool shutdown = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:b:n:x")) != -1) {
+    switch (opt) {
+    case 's':
+      path = optarg;
+      break;
+    case 'b':
+      batch_size = std::max(1, atoi(optarg));
+      break;
+    case 'n':
+      num_points = std::max(0, atoi(optarg));
+      break;
+    case 'x':
+      shutdown = true;
+      break;
+    default:
+      cerr << "Usage: " << argv[0] << " " << USAGE << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc) {
+    cerr << "Usage: " << argv[0] << " " << USAGE << endl;
+    return EXIT_FAILURE;
+  }
+
+  Dataset dataset;
+  dataset.load(argv[optind]);
+  dataset.limit(num_points);
+  if (dataset.points.empty()) {
+    cerr << "No points in " << argv[optind] << endl;
+    return EXIT_FAILURE;
+  }
+  const vector<Point> &points = dataset.points;
+  signal(SIGPIPE, SIG_IGN);
+
+  bool piped = path == "-";
+  int fd = STDOUT_FILENO;
+  try {
+    if (!piped) {
+      fd = IngestServer::connect_unix(path);
+    }
+    IngestClient client(fd, fd);
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < points.size(); i += batch_size) {
+      client.send_batch(points, i, std::min(points.size(), i + batch_size));
+    }
+    double seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << "Sent " << points.size() << " points in " << seconds * 1e3
+         << " ms: " << points.size() / std::max(seconds, 1e-9)
+         << " points/s, " << client.bytes_sent() / 1e6 / std::max(seconds, 1e-9)
+         << " MB/s" << endl;
+
+    if (!piped) {
+      // Replies come in order, so the centers query also waits for every
+      // batch to be clustered.
+      start = chrono::steady_clock::now();
+      vector<Point> centers = client.centers();
+      seconds =
+          chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cerr << "Centers: " << centers.size() << " after " << seconds * 1e3
+           << " ms" << endl;
+
+      Contingency table;
+      start = chrono::steady_clock::now();
+      for (size_t i = 0; i < points.size(); i += batch_size) {
+        size_t end = std::min(points.size(), i + batch_size);
+        vector<int> labels = client.assign(points, i, end);
+        for (size_t j = i; j < end; j++) {
+          table.add(points[j].true_clu_id, labels[j - i] + 1);
+        }
+      }
+      seconds =
+          chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      Quality quality = table.quality();
+      cerr << "Assigned " << points.size() << " points: "
+           << points.size() / std::max(seconds, 1e-9) << " points/s" << endl;
+      cerr << "Purity: " << quality.purity << ", NMI: " << quality.nmi
+           << ", ARI: " << quality.ari << endl;
+    }
+    if (shutdown) {
+      client.shutdown();
+    }
+  } catch (const exception &e) {
+    cerr << "Client failed: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  if (!piped) {
+    ::close(fd);
+  }
+  return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_CLUSTER_INDEX_HPP
+#define PDSC_CLUSTER_INDEX_HPP
+
+#include "common.hpp"
+#include "memory.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+const int LSH_TABLES = 6;
+const int LSH_HASHES = 4;        // Hashes concatenated into one bucket key
+const int LSH_PROBES = 4;        // Neighbouring buckets probed per table
+const double LSH_WIDTH_RADII = 4; // Default bucket width, in cluster radii
+const u64 LSH_SEED = 42;
+
+enum class IndexKind {
+  Scan,       // The owner's own linear scan, no index
+  BruteForce, // Exact: every cluster is a candidate
+  LSH,        // Approximate: multi-probe p-stable LSH
+};
+
+// Selected through the "index" parameter of the algorithms that keep their
+// clusters in a CFTable, and of EDMStream: 0 scans, 1 brute force, 2 LSH.
+struct IndexConfig {
+  IndexKind kind = IndexKind::Scan;
+  int tables = LSH_TABLES;
+  int hashes = LSH_HASHES;
+  int probes = LSH_PROBES;
+  double width = 0.0; // Bucket width; 0 derives it from the cluster radius
+
+  bool set(const std::string &key, double value) {
+    if (key == "index") {
+      int max = static_cast<int>(IndexKind::LSH);
+      kind = static_cast<IndexKind>(checked_param(key, value, 0, max));
+    } else if (key == "index_tables") {
+      tables = checked_count(key, value, 1);
+    } else if (key == "index_hashes") {
+      hashes = checked_count(key, value, 1);
+    } else if (key == "index_probes") {
+      probes = checked_count(key, value, 0);
+    } else if (key == "index_width") {
+      width = checked_param(key, value, 0.0);
+    } else {
+      return false;
+    }
+    return true;
+  }
+};
+
+// Candidate generator for nearest-cluster queries over clusters identified
+// by small dense ids. The owner measures the candidates exactly, so an
+// approximate index only ever misses a neighbour, never reports a wrong one.
+// Queries reuse internal scratch and are not thread-safe.
+class ClusterIndex {
+public:
+  virtual ~ClusterIndex() = default;
+  virtual bool contains(u32 id) const = 0;
+  virtual void insert(u32 id, const double *center) = 0;
+  virtual void remove(u32 id) = 0;
+  virtual void move(u32 id, const double *center) = 0;
+  virtual void clear() = 0;
+  // Appends ids that may be nearest to x, each once.
+  virtual void candidates(const double *x, std::vector<u32> &out) const = 0;
+};
+
+class BruteForceIndex : public ClusterIndex {
+public:
+  bool contains(u32 id) const {
+    return id < positions.size() && positions[id] != ABSENT;
+  }
+
+  void insert(u32 id, const double *) {
+    if (id >= positions.size()) {
+      positions.resize(id + 1, ABSENT);
+    }
+    positions[id] = ids.size();
+    ids.push_back(id);
+  }
+
+  void remove(u32 id) {
+    if (!contains(id)) {
+      return;
+    }
+    u32 last = ids.back();
+    ids[positions[id]] = last;
+    positions[last] = positions[id];
+    ids.pop_back();
+    positions[id] = ABSENT;
+  }
+
+  void move(u32, const double *) {}
+
+  void clear() {
+    ids.clear();
+    positions.clear();
+  }
+
+  void candidates(const double *, std::vector<u32> &out) const {
+    out.insert(out.end(), ids.begin(), ids.end());
+  }
+
+private:
+  static constexpr u32 ABSENT = ~0u;
+  tracked_vector<u32, MemoryCategory::HashTables> ids, positions;
+};
+
+// Multi-probe LSH for Euclidean distance (Datar et al., Lv et al.). Each of
+// `tables` tables hashes a center to the cell floor((a . x + b) / width) of
+// `hashes` random Gaussian directions. A query visits its own cell in every
+// table and then the `probes` cells across the nearest cell boundaries. A
+// center that moves is only rehashed in the tables where its cell changed.
+class LSHIndex : public ClusterIndex {
+public:
+  LSHIndex(int dimensions, const IndexConfig &config, double width)
+      : dims(dimensions), tables(config.tables), hashes(config.hashes),
+        probes(std::min(config.probes, config.hashes)),
+        rows(config.tables * config.hashes), directions(dims * rows),
+        offsets(rows), projected(rows), cells(rows), order(config.hashes) {
+    if (!(width > 0.0)) {
+      throw std::invalid_argument("LSH bucket width must be positive");
+    }
+    // Scaled by 1 / width up front, so a projection is already in cells.
+    std::mt19937_64 gen(LSH_SEED);
+    std::normal_distribution<double> gaussian(0.0, 1.0 / width);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    for (double &a : directions) {
+      a = gaussian(gen);
+    }
+    for (double &b : offsets) {
+      b = uniform(gen);
+    }
+  }
+
+  bool contains(u32 id) const { return id < present.size() && present[id]; }
+
+  void insert(u32 id, const double *center) {
+    if (id >= present.size()) {
+      present.resize(id + 1, 0);
+      keys.resize((id + 1) * tables);
+      seen.resize(id + 1, 0);
+    }
+    present[id] = 1;
+    project(center);
+    for (int t = 0; t < tables; t++) {
+      u64 key = keyOf(t, &cells[t * hashes]);
+      keys[id * tables + t] = key;
+      buckets[key].push_back(id);
+    }
+  }
+
+  void remove(u32 id) {
+    if (!contains(id)) {
+      return;
+    }
+    for (int t = 0; t < tables; t++) {
+      unlink(keys[id * tables + t], id);
+    }
+    present[id] = 0;
+  }
+
+  void move(u32 id, const double *center) {
+    project(center);
+    for (int t = 0; t < tables; t++) {
+      u64 key = keyOf(t, &cells[t * hashes]);
+      u64 &old = keys[id * tables + t];
+      if (key != old) {
+        PDSC_COUNT(LSHRehashes);
+        unlink(old, id);
+        buckets[key].push_back(id);
+        old = key;
+      }
+    }
+  }
+
+  void clear() {
+    buckets.clear();
+    present.clear();
+    keys.clear();
+    seen.clear();
+  }
+
+  void candidates(const double *x, std::vector<u32> &out) const {
+    if (++epoch == 0) {
+      std::fill(seen.begin(), seen.end(), 0);
+      epoch = 1;
+    }
+    project(x);
+    for (int t = 0; t < tables; t++) {
+      i64 *cell = &cells[t * hashes];
+      const double *v = &projected[t * hashes];
+      collect(keyOf(t, cell), out);
+      if (probes == 0) {
+        continue;
+      }
+      // Probe across the boundaries the query lies closest to, one
+      // coordinate at a time.
+      for (int j = 0; j < hashes; j++) {
+        order[j] = j;
+      }
+      auto gap = [&](int j) {
+        double f = v[j] - cell[j];
+        return std::min(f, 1.0 - f);
+      };
+      std::partial_sort(order.begin(), order.begin() + probes, order.end(),
+                        [&](int a, int b) { return gap(a) < gap(b); });
+      for (int p = 0; p < probes; p++) {
+        int j = order[p];
+        i64 step = v[j] - cell[j] < 0.5 ? -1 : 1;
+        cell[j] += step;
+        collect(keyOf(t, cell), out);
+        cell[j] -= step;
+      }
+    }
+  }
+
+private:
+  using Bucket = tracked_vector<u32, MemoryCategory::HashTables>;
+
+  int dims, tables, hashes, probes, rows;
+  // Input dimension major, so projecting is a run of axpys that vectorize.
+  tracked_vector<double, MemoryCategory::HashTables> directions, offsets;
+  std::unordered_map<u64, Bucket, std::hash<u64>, std::equal_to<u64>,
+                     TrackingAllocator<std::pair<const u64, Bucket>,
+                                       MemoryCategory::HashTables>>
+      buckets;
+  tracked_vector<char, MemoryCategory::HashTables> present;
+  tracked_vector<u64, MemoryCategory::HashTables> keys; // tables per id
+  // Query scratch
+  mutable std::vector<double> projected;
+  mutable std::vector<i64> cells;
+  mutable std::vector<int> order;
+  mutable tracked_vector<u32, MemoryCategory::HashTables> seen;
+  mutable u32 epoch = 0;
+
+  void project(const double *x) const {
+    std::copy(offsets.begin(), offsets.end(), projected.begin());
+    for (int d = 0; d < dims; d++) {
+      const double *a = &directions[d * rows];
+      for (int r = 0; r < rows; r++) {
+        projected[r] += x[d] * a[r];
+      }
+    }
+    for (int r = 0; r < rows; r++) {
+      cells[r] = std::floor(projected[r]);
+    }
+  }
+
+  u64 keyOf(int table, const i64 *cell) const {
+    u64 key = table;
+    for (int j = 0; j < hashes; j++) {
+      key = (key ^ static_cast<u64>(cell[j])) * 0x9E3779B97F4A7C15ull;
+      key ^= key >> 29;
+    }
+    return key;
+  }
+
+  void collect(u64 key, std::vector<u32> &out) const {
+    auto it = buckets.find(key);
+    if (it == buckets.end()) {
+      return;
+    }
+    for (u32 id : it->second) {
+      if (seen[id] != epoch) {
+        seen[id] = epoch;
+        out.push_back(id);
+      }
+    }
+  }
+
+  void unlink(u64 key, u32 id) {
+    auto it = buckets.find(key);
+    Bucket &bucket = it->second;
+    *std::find(bucket.begin(), bucket.end(), id) = bucket.back();
+    bucket.pop_back();
+    if (bucket.empty()) {
+      buckets.erase(it);
+    }
+  }
+};
+
+// nullptr for IndexKind::Scan. `radius` is the distance within which the
+// owner looks for a neighbour; it sets the LSH bucket width unless the
+// configuration fixes one.
+inline std::unique_ptr<ClusterIndex>
+make_cluster_index(const IndexConfig &config, int dimensions, double radius) {
+  switch (config.kind) {
+  case IndexKind::BruteForce:
+    return std::make_unique<BruteForceIndex>();
+  case IndexKind::LSH:
+    return std::make_unique<LSHIndex>(
+        dimensions, config,
+        config.width > 0.0 ? config.width : LSH_WIDTH_RADII * radius);
+  default:
+    return nullptr;
+  }
+}
+
+#endif // PDSC_CLUSTER_INDEX_HPP
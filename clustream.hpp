@@ -18,90 +18,66 @@
 #define PDSC_CLUSTREAM_HPP
 
 #include "algorithm.hpp"
+#include "cf_table.hpp"
 
-const int MAX_MICRO_CLUSTERS = 100;
-
-struct MicroCluster {
-  std::vector<double> linear_sum;
-  std::vector<double> squared_sum;
-  int n; // Number of points
-  double last_update_time;
-
-  MicroCluster(int dimensions)
-      : linear_sum(dimensions, 0.0), squared_sum(dimensions, 0.0), n(0),
-        last_update_time(0.0) {}
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
 
-  void addPoint(const Point &point) {
-    n++;
-    for (int i = 0; i < point.features.size(); i++) {
-      linear_sum[i] += point.features[i];
-      squared_sum[i] += point.features[i] * point.features[i];
-    }
-    last_update_time = point.timestamp;
-  }
+const int MAX_MICRO_CLUSTERS = 100;
 
-  double calcDistance(const Point &point) const {
-    double dist = 0.0;
-    for (int i = 0; i < point.features.size(); i++) {
-      double mean = linear_sum[i] / n;
-      dist += (point.features[i] - mean) * (point.features[i] - mean);
-    }
-    return sqrt(dist);
-  }
+struct CluStreamConfig {
+  int max_micro_clusters = MAX_MICRO_CLUSTERS;
+  double threshold = 350.0; // Threshold for micro-cluster distance
+  double time_window = TIME_WINDOW;
+  IndexConfig index;
 
-  double calcRadius() const {
-    double radius = 0.0;
-    for (int i = 0; i < linear_sum.size(); i++) {
-      double mean = linear_sum[i] / n;
-      double variance = (squared_sum[i] / n) - (mean * mean);
-      radius += variance;
+  bool set(const std::string &key, double value) {
+    if (key == "max_micro_clusters") {
+      max_micro_clusters = checked_count(key, value, 1);
+    } else if (key == "threshold") {
+      threshold = checked_param(key, value, 0.0);
+    } else if (key == "time_window") {
+      time_window = checked_param(key, value, 0.0);
+    } else {
+      return index.set(key, value);
     }
-    return sqrt(radius);
-  }
-
-  bool isWithinTimeWindow(double current_time) const {
-    return (current_time - last_update_time) <= TIME_WINDOW;
+    return true;
   }
 };
 
+// Micro-clusters are CFTable slots: count is the number of points and time
+// the last update.
 class CluStream : public Algorithm {
 public:
-  CluStream(int dimensions) : dimensions(dimensions) {}
+  CluStream(int dimensions, const CluStreamConfig &config = {})
+      : dimensions(dimensions), config(config), micro_clusters(dimensions),
+        filed(dimensions) {
+    micro_clusters.use_index(
+        make_cluster_index(config.index, dimensions, config.threshold));
+  }
 
   void insert(const Point &point) {
-    if (micro_clusters.empty()) {
-      // Create the first micro-cluster
-      MicroCluster newMC(dimensions);
-      newMC.addPoint(point);
-      micro_clusters.push_back(newMC);
-      return;
-    }
-
+    const double *x = point.features.data();
     // Find the closest micro-cluster
-    int closestIndex = -1;
-    double closestDist = std::numeric_limits<double>::max();
-    for (int i = 0; i < micro_clusters.size(); i++) {
-      if (micro_clusters[i].isWithinTimeWindow(point.timestamp)) {
-        double dist = micro_clusters[i].calcDistance(point);
-        if (dist < closestDist) {
-          closestDist = dist;
-          closestIndex = i;
-        }
-      }
-    }
+    double closestDist;
+    u32 closest = findClosest(x, point.timestamp, closestDist);
 
     // Add the point to the closest micro-cluster
-    if (closestDist < threshold) {
-      micro_clusters[closestIndex].addPoint(point);
+    if (closestDist < config.threshold) {
+      micro_clusters.add_point(closest, x);
+      stamp(closest, point.timestamp);
     } else {
       // Create a new micro-cluster
-      MicroCluster newMC(dimensions);
-      newMC.addPoint(point);
-      micro_clusters.push_back(newMC);
+      newest = micro_clusters.allocate();
+      micro_clusters.add_point(newest, x);
+      stamp(newest, point.timestamp);
 
       // Remove the oldest micro-cluster if necessary
-      if (micro_clusters.size() > MAX_MICRO_CLUSTERS) {
-        removeOldestMicroCluster(point.timestamp);
+      if (micro_clusters.size() > config.max_micro_clusters) {
+        removeOldestMicroCluster();
       }
     }
   }
@@ -110,36 +86,231 @@ public:
     for (const auto &point : points) {
       insert(point);
     }
+    PDSC_GAUGE(StateSize, micro_clusters.size());
+  }
+
+  std::vector<Summary> export_summaries() {
+    std::vector<Summary> summaries;
+    for (u32 mc = 0; mc < micro_clusters.end(); mc++) {
+      if (micro_clusters.occupied(mc)) {
+        summaries.push_back(summaryOf(mc));
+      }
+    }
+    return summaries;
+  }
+
+  void merge(const std::vector<Summary> &summaries) {
+    std::vector<double> mean(dimensions);
+    for (const auto &summary : summaries) {
+      double n = summary.weight;
+      for (int d = 0; d < dimensions; d++) {
+        mean[d] = summary.linear_sum[d] / n;
+      }
+
+      double closestDist;
+      u32 closest = findClosest(mean.data(), summary.timestamp, closestDist);
+      u32 mc = closest;
+      if (closestDist >= config.threshold) {
+        mc = newest = micro_clusters.allocate();
+      }
+      micro_clusters.add(mc, summary.linear_sum.data(),
+                         summary.squared_sum.data(), n);
+      stamp(mc, std::max(micro_clusters.time(mc), summary.timestamp));
+      if (micro_clusters.size() > config.max_micro_clusters) {
+        removeOldestMicroCluster();
+      }
+    }
+    PDSC_GAUGE(StateSize, micro_clusters.size());
+  }
+
+  // The newest micro-cluster is written last, so it is newest on restore.
+  void snapshot(SnapshotWriter &out) const {
+    out.write_header("clustream", dimensions);
+    out.write<u64>(micro_clusters.size());
+    for (u32 mc = 0; mc < micro_clusters.end(); mc++) {
+      if (micro_clusters.occupied(mc) && mc != newest) {
+        writeMicroCluster(out, mc);
+      }
+    }
+    if (newest != NO_SLOT) {
+      writeMicroCluster(out, newest);
+    }
+  }
+
+  void restore(SnapshotReader &in) {
+    in.expect_header("clustream", dimensions);
+    micro_clusters.clear();
+    newest = NO_SLOT;
+    u64 count = in.read_count();
+    for (u64 i = 0; i < count; i++) {
+      newest = micro_clusters.allocate();
+      micro_clusters.count(newest) = in.read<double>();
+      micro_clusters.time(newest) = in.read<double>();
+      in.read_array(micro_clusters.linear_sum(newest), dimensions);
+      in.read_array(micro_clusters.squared_sum(newest), dimensions);
+      micro_clusters.refresh(newest);
+    }
+    reorder();
   }
 
-  std::vector<Point> output_centers() {
-    std::vector<Point> centers;
-    for (const auto &mc : micro_clusters) {
-      if (mc.isWithinTimeWindow(micro_clusters.back().last_update_time)) {
-        Point center(mc.linear_sum);
-        center /= mc.n;
-        centers.push_back(center);
+  // Evicts the older half of the micro-clusters and keeps the cap there.
+  void shrink() {
+    std::vector<u32> order;
+    for (u32 mc = 0; mc < micro_clusters.end(); mc++) {
+      if (micro_clusters.occupied(mc)) {
+        order.push_back(mc);
       }
     }
-    return centers;
+    std::stable_sort(order.begin(), order.end(), [this](u32 a, u32 b) {
+      return micro_clusters.time(a) < micro_clusters.time(b);
+    });
+    size_t keep = order.size() / 2;
+    PDSC_COUNT_N(CluStreamEvictions, order.size() - keep);
+    for (size_t i = 0; i + keep < order.size(); i++) {
+      release(order[i]);
+    }
+    std::vector<u32> moved = micro_clusters.compact();
+    if (newest != NO_SLOT) {
+      newest = moved[newest];
+    }
+    reorder();
+    config.max_micro_clusters = std::max<int>(keep, 1);
+  }
+
+  // Centers of the micro-clusters within the time window of the newest one.
+  // Micro-clusters also leave the window without changing, so filed ones
+  // are queued by time and dropped once the window has passed them.
+  const std::vector<Point> &centers() {
+    double now = newest == NO_SLOT ? 0.0 : micro_clusters.time(newest);
+    if (now < filed_now) {
+      micro_clusters.invalidate_centers();
+    }
+    filed_now = now;
+    auto in_window = [&](u32 mc) {
+      return newest != NO_SLOT &&
+             now - micro_clusters.time(mc) <= config.time_window;
+    };
+    micro_clusters.sync_centers(filed, 0, [&](u32 mc) {
+      if (!in_window(mc)) {
+        return false;
+      }
+      leaving.emplace(micro_clusters.time(mc), mc);
+      return true;
+    });
+    while (!leaving.empty() &&
+           now - leaving.top().first > config.time_window) {
+      u32 mc = leaving.top().second;
+      leaving.pop();
+      if (mc >= micro_clusters.end() || !micro_clusters.occupied(mc) ||
+          !in_window(mc)) {
+        filed.erase(mc);
+      }
+    }
+    // Entries of refiled micro-clusters go stale; requeue the filed ones
+    // when they outnumber them.
+    if (leaving.size() > 2 * filed.size() + 64) {
+      leaving = {};
+      for (u64 mc : filed.filed_under()) {
+        leaving.emplace(micro_clusters.time(mc), mc);
+      }
+    }
+    return filed.view();
   }
 
 private:
+  using TimedSlot = std::pair<double, u32>;
+  // Later time first; among equal times the lower slot, as a scan finds it.
+  struct Recency {
+    bool operator()(const TimedSlot &a, const TimedSlot &b) const {
+      return a.first < b.first || (a.first == b.first && a.second > b.second);
+    }
+  };
+
   int dimensions;
-  std::vector<MicroCluster> micro_clusters;
-  const double threshold = 350.0; // Threshold for micro-cluster distance
-
-  void removeOldestMicroCluster(double current_time) {
-    int oldestIndex = -1;
-    double oldestTime = std::numeric_limits<double>::max();
-    for (int i = 0; i < micro_clusters.size(); i++) {
-      if (micro_clusters[i].last_update_time < oldestTime) {
-        oldestTime = micro_clusters[i].last_update_time;
-        oldestIndex = i;
+  CluStreamConfig config;
+  CFTable micro_clusters;
+  u32 newest = NO_SLOT; // Last created; its time stands for the present
+  CenterCache filed;     // Centers by slot
+  double filed_now = 0.0;
+  std::priority_queue<TimedSlot, std::vector<TimedSlot>, std::greater<>>
+      leaving; // Filed slots by their time when filed, oldest first
+  // Every (time, slot) a micro-cluster has had, oldest and newest first.
+  // Entries whose slot was freed or restamped since are skipped when they
+  // come up, and both are rebuilt once mostly stale.
+  std::priority_queue<TimedSlot, std::vector<TimedSlot>, std::greater<>>
+      by_age;
+  std::priority_queue<TimedSlot, std::vector<TimedSlot>, Recency> by_recency;
+
+  void stamp(u32 mc, double time) {
+    micro_clusters.time(mc) = time;
+    by_age.emplace(time, mc);
+    by_recency.emplace(time, mc);
+    if (by_age.size() + by_recency.size() > 4 * micro_clusters.size() + 64) {
+      reorder();
+    }
+  }
+
+  void reorder() {
+    by_age = {};
+    by_recency = {};
+    for (u32 mc = 0; mc < micro_clusters.end(); mc++) {
+      if (micro_clusters.occupied(mc)) {
+        by_age.emplace(micro_clusters.time(mc), mc);
+        by_recency.emplace(micro_clusters.time(mc), mc);
+      }
+    }
+  }
+
+  // Slot of the first live entry of a time order, or NO_SLOT.
+  template <typename Order> u32 first(Order &order) {
+    while (!order.empty()) {
+      auto [time, mc] = order.top();
+      if (mc < micro_clusters.end() && micro_clusters.occupied(mc) &&
+          micro_clusters.time(mc) == time) {
+        return mc;
       }
+      order.pop();
+    }
+    return NO_SLOT;
+  }
+
+  // Closest micro-cluster to x within the time window of `now`, or NO_SLOT.
+  u32 findClosest(const double *x, double now, double &closestDist) const {
+    return micro_clusters.nearest(x, closestDist, [&](u32 mc) {
+      return now - micro_clusters.time(mc) <= config.time_window;
+    });
+  }
+
+  Summary summaryOf(u32 mc) const {
+    return {{micro_clusters.linear_sum(mc),
+             micro_clusters.linear_sum(mc) + dimensions},
+            {micro_clusters.squared_sum(mc),
+             micro_clusters.squared_sum(mc) + dimensions},
+            micro_clusters.count(mc),
+            micro_clusters.time(mc)};
+  }
+
+  void writeMicroCluster(SnapshotWriter &out, u32 mc) const {
+    out.write<double>(micro_clusters.count(mc));
+    out.write<double>(micro_clusters.time(mc));
+    out.write_array(micro_clusters.linear_sum(mc), dimensions);
+    out.write_array(micro_clusters.squared_sum(mc), dimensions);
+  }
+
+  // Frees a micro-cluster; if it was the newest, the most recently updated
+  // one takes its place.
+  void release(u32 mc) {
+    micro_clusters.release(mc);
+    if (mc == newest) {
+      newest = first(by_recency);
     }
-    if (oldestIndex != -1) {
-      micro_clusters.erase(micro_clusters.begin() + oldestIndex);
+  }
+
+  void removeOldestMicroCluster() {
+    PDSC_COUNT(CluStreamEvictions);
+    u32 oldest = first(by_age);
+    if (oldest != NO_SLOT) {
+      release(oldest);
     }
   }
 };
@@ -18,11 +18,16 @@
 #define PDSC_COMMON_HPP
 
 #include <cmath>
+#include <limits>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 using u32 = uint32_t;
 using u64 = uint64_t;
+using i64 = int64_t;
 using f32 = float;
 using f64 = double;
 
@@ -34,4 +39,24 @@ const u64 BATCH_SIZE = 1000;   // Tunable batch size
 const double TIME_WINDOW = 1000.0; // used by CluStream and EDMStream
 const int K = 5;                   // used by SLKMeans.
 
+// Range check for a tuning knob set by name; throws std::invalid_argument
+// when `value` lies outside [low, high].
+inline double checked_param(const std::string &key, double value, double low,
+                            double high = HUGE_VAL) {
+  if (!(value >= low && value <= high)) {
+    std::ostringstream os;
+    os.precision(12);
+    os << key << "=" << value << " must be at least " << low;
+    if (high < HUGE_VAL) {
+      os << " and at most " << high;
+    }
+    throw std::invalid_argument(os.str());
+  }
+  return value;
+}
+
+inline int checked_count(const std::string &key, double value, int low) {
+  return checked_param(key, value, low, std::numeric_limits<int>::max());
+}
+
 #endif // PDSC_COMMON_HPP
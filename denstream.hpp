@@ -18,106 +18,198 @@
 #define DENSTREAM_HPP
 
 #include "algorithm.hpp"
+#include "cf_table.hpp"
 
+#include <algorithm>
 #include <cmath>
-#include <deque>
 #include <limits>
+#include <string>
 #include <vector>
 
 const double EPSILON = 500.0;
 const int MIN_POINTS = 5;
 
-struct DenStreamMicroCluster {
-  std::vector<double> linear_sum;
-  std::vector<double> squared_sum;
-  int n;
-  double weight;
-  double creation_time;
-
-  DenStreamMicroCluster(int dimensions)
-      : linear_sum(dimensions, 0.0), squared_sum(dimensions, 0.0), n(0),
-        weight(0.0), creation_time(0.0) {}
-
-  void addPoint(const Point &point, double timestamp) {
-    n++;
-    weight += 1;
-    for (int i = 0; i < point.features.size(); i++) {
-      linear_sum[i] += point.features[i];
-      squared_sum[i] += point.features[i] * point.features[i];
-    }
-    creation_time = timestamp;
-  }
-
-  double calcDistance(const Point &point) const {
-    double dist = 0.0;
-    for (int i = 0; i < point.features.size(); i++) {
-      double mean = linear_sum[i] / n;
-      dist += (point.features[i] - mean) * (point.features[i] - mean);
+struct DenStreamConfig {
+  double epsilon = EPSILON;
+  int min_points = MIN_POINTS;
+  double time_window = 10000.0;
+  IndexConfig index;
+
+  bool set(const std::string &key, double value) {
+    if (key == "epsilon") {
+      epsilon = checked_param(key, value, 0.0);
+    } else if (key == "min_points") {
+      min_points = checked_count(key, value, 1);
+    } else if (key == "time_window") {
+      time_window = checked_param(key, value, 0.0);
+    } else {
+      return index.set(key, value);
     }
-    return sqrt(dist);
+    return true;
   }
 };
 
+// Micro-clusters are CFTable slots: count is the number of points, weight
+// their weight and time the creation time, which every update moves forward.
 class DenStream : public Algorithm {
 public:
-  DenStream(int dimensions) : dimensions(dimensions) {}
+  DenStream(int dimensions, const DenStreamConfig &config = {})
+      : dimensions(dimensions), config(config), clusters(dimensions),
+        filed(dimensions) {
+    clusters.use_index(
+        make_cluster_index(config.index, dimensions, config.epsilon));
+  }
 
   void insert(const Point &point) {
     double timestamp = point.timestamp;
+    const double *x = point.features.data();
 
     // Remove outdated micro-clusters
-    for (auto it = clusters.begin(); it != clusters.end();) {
-      if (timestamp - it->creation_time > TIME_WINDOW) {
-        it = clusters.erase(it);
-      } else {
-        ++it;
+    if (timestamp - oldest > config.time_window) {
+      expire(timestamp);
+    }
+
+    // Find the closest micro-cluster, or create a new one
+    double closestDist;
+    u32 mc = clusters.nearest(x, closestDist);
+    if (closestDist >= config.epsilon) {
+      mc = clusters.allocate();
+      oldest = std::min(oldest, timestamp);
+    }
+    clusters.add_point(mc, x);
+    clusters.weight(mc) += 1;
+    clusters.time(mc) = timestamp;
+  }
+
+  void cluster(const std::vector<Point> &points) {
+    for (const auto &point : points) {
+      insert(point);
+    }
+    PDSC_GAUGE(StateSize, clusters.size());
+  }
+
+  std::vector<Summary> export_summaries() {
+    std::vector<Summary> summaries;
+    for (u32 mc = 0; mc < clusters.end(); mc++) {
+      if (clusters.occupied(mc)) {
+        summaries.push_back(
+            {{clusters.linear_sum(mc), clusters.linear_sum(mc) + dimensions},
+             {clusters.squared_sum(mc), clusters.squared_sum(mc) + dimensions},
+             clusters.weight(mc),
+             clusters.time(mc)});
       }
     }
+    return summaries;
+  }
 
-    // Find the closest micro-cluster
-    int closestIndex = -1;
-    double closestDist = std::numeric_limits<double>::max();
-    for (int i = 0; i < clusters.size(); i++) {
-      double dist = clusters[i].calcDistance(point);
-      if (dist < closestDist) {
-        closestDist = dist;
-        closestIndex = i;
+  void merge(const std::vector<Summary> &summaries) {
+    std::vector<double> mean(dimensions);
+    for (const auto &summary : summaries) {
+      double n = summary.weight;
+      for (int d = 0; d < dimensions; d++) {
+        mean[d] = summary.linear_sum[d] / n;
       }
+
+      double closestDist;
+      u32 mc = clusters.nearest(mean.data(), closestDist);
+      if (closestDist >= config.epsilon) {
+        mc = clusters.allocate();
+        oldest = std::min(oldest, summary.timestamp);
+      }
+      clusters.add(mc, summary.linear_sum.data(), summary.squared_sum.data(),
+                   n);
+      clusters.weight(mc) += summary.weight;
+      clusters.time(mc) = std::max(clusters.time(mc), summary.timestamp);
     }
+    PDSC_GAUGE(StateSize, clusters.size());
+  }
 
-    // Add the point to the closest micro-cluster
-    if (closestDist < EPSILON) {
-      clusters[closestIndex].addPoint(point, timestamp);
-    } else {
-      // Create a new micro-cluster
-      DenStreamMicroCluster newCluster(dimensions);
-      newCluster.addPoint(point, timestamp);
-      clusters.push_back(newCluster);
+  void snapshot(SnapshotWriter &out) const {
+    out.write_header("denstream", dimensions);
+    out.write<u64>(clusters.size());
+    for (u32 mc = 0; mc < clusters.end(); mc++) {
+      if (clusters.occupied(mc)) {
+        out.write<double>(clusters.count(mc));
+        out.write<double>(clusters.weight(mc));
+        out.write<double>(clusters.time(mc));
+        out.write_array(clusters.linear_sum(mc), dimensions);
+        out.write_array(clusters.squared_sum(mc), dimensions);
+      }
     }
   }
 
-  void cluster(const std::vector<Point> &points) {
-    for (const auto &point : points) {
-      insert(point);
+  void restore(SnapshotReader &in) {
+    in.expect_header("denstream", dimensions);
+    clusters.clear();
+    oldest = std::numeric_limits<double>::max();
+    u64 count = in.read_count();
+    for (u64 i = 0; i < count; i++) {
+      u32 mc = clusters.allocate();
+      clusters.count(mc) = in.read<double>();
+      clusters.weight(mc) = in.read<double>();
+      clusters.time(mc) = in.read<double>();
+      in.read_array(clusters.linear_sum(mc), dimensions);
+      in.read_array(clusters.squared_sum(mc), dimensions);
+      clusters.refresh(mc);
+      oldest = std::min(oldest, clusters.time(mc));
     }
   }
 
-  std::vector<Point> output_centers() {
-    std::vector<Point> centers;
-    for (const auto &cluster : clusters) {
-      if (cluster.weight >= MIN_POINTS) {
-        Point center(cluster.linear_sum);
-        center /= cluster.n;
-        centers.push_back(center);
+  // Drops the lighter half of the micro-clusters, outliers first.
+  void shrink() {
+    if (clusters.size() == 0) {
+      return;
+    }
+    std::vector<double> weights;
+    for (u32 mc = 0; mc < clusters.end(); mc++) {
+      if (clusters.occupied(mc)) {
+        weights.push_back(clusters.weight(mc));
       }
     }
-    return centers;
+    auto median = weights.begin() + weights.size() / 2;
+    std::nth_element(weights.begin(), median, weights.end());
+    size_t drop = clusters.size() - clusters.size() / 2;
+    for (u32 mc = 0; mc < clusters.end() && drop > 0; mc++) {
+      if (clusters.occupied(mc) && clusters.weight(mc) <= *median) {
+        PDSC_COUNT(DenStreamExpiries);
+        clusters.release(mc);
+        drop--;
+      }
+    }
+    clusters.compact();
+  }
+
+  // Weights only change along with the sums, so the journal covers them.
+  const std::vector<Point> &centers() {
+    clusters.sync_centers(filed, 0, [&](u32 mc) {
+      return clusters.weight(mc) >= config.min_points;
+    });
+    return filed.view();
   }
 
 private:
   int dimensions;
-  std::deque<DenStreamMicroCluster> clusters;
-  const double TIME_WINDOW = 10000.0;
+  DenStreamConfig config;
+  CFTable clusters;
+  CenterCache filed; // Centers by slot
+  // No micro-cluster is older, so expiry only scans once one may be due.
+  // Times only move forward, so it stays a lower bound between scans.
+  double oldest = std::numeric_limits<double>::max();
+
+  void expire(double timestamp) {
+    oldest = std::numeric_limits<double>::max();
+    for (u32 mc = 0; mc < clusters.end(); mc++) {
+      if (!clusters.occupied(mc)) {
+        continue;
+      }
+      if (timestamp - clusters.time(mc) > config.time_window) {
+        PDSC_COUNT(DenStreamExpiries);
+        clusters.release(mc);
+      } else {
+        oldest = std::min(oldest, clusters.time(mc));
+      }
+    }
+  }
 };
 
 #endif // DENSTREAM_HPP
@@ -18,26 +18,64 @@
 #define DSTREAM_HPP
 
 #include "algorithm.hpp"
+#include "center_cache.hpp"
+#include "memory.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <limits>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 const int CELL_SIZE = 1;
+const u32 NOT_JOURNALED = ~0u;
+
+struct DStreamConfig {
+  double cell_size = CELL_SIZE;
+  double time_window = 100.0;
+
+  bool set(const std::string &key, double value) {
+    if (key == "cell_size") {
+      if (!(value > 0.0)) {
+        throw std::invalid_argument("cell_size must be positive");
+      }
+      cell_size = value;
+    } else if (key == "time_window") {
+      time_window = checked_param(key, value, 0.0);
+    } else {
+      return false;
+    }
+    return true;
+  }
+};
+
+using CellKey = std::basic_string<
+    char, std::char_traits<char>,
+    TrackingAllocator<char, MemoryCategory::HashTables>>;
+
+struct CellKeyHash {
+  size_t operator()(const CellKey &key) const {
+    return std::hash<std::string_view>()(key);
+  }
+};
 
 struct Cell {
-  std::vector<double> coordinates;
+  tracked_vector<double, MemoryCategory::Summaries> coordinates;
   double density;
   double timestamp;
+  u64 serial = 0;                // Key of its center
+  u32 journaled = NOT_JOURNALED; // Position in the journal of changes
 
   Cell(int dimensions)
       : coordinates(dimensions, 0.0), density(0.0), timestamp(0.0) {}
 
   Cell(const std::vector<double> &coords, double density = 0.0,
        double timestamp = 0.0)
-      : coordinates(coords), density(density), timestamp(timestamp) {}
+      : coordinates(coords.begin(), coords.end()), density(density),
+        timestamp(timestamp) {}
 
   void addPoint(const Point &point) {
     density += 1;
@@ -56,32 +94,36 @@ struct Cell {
 
 class DStream : public Algorithm {
 public:
-  DStream(int dimensions) : dimensions(dimensions) {}
+  DStream(int dimensions, const DStreamConfig &config = {})
+      : dimensions(dimensions), config(config), filed(dimensions) {}
 
   void insert(const Point &point) {
     // Create cell coordinates for the point
     std::vector<double> cellCoordinates(dimensions);
     for (int i = 0; i < dimensions; ++i) {
-      cellCoordinates[i] = std::floor(point.features[i] / CELL_SIZE);
+      cellCoordinates[i] = std::floor(point.features[i] / config.cell_size);
     }
 
     // Generate the cell key
-    std::string cellKey = createCellKey(cellCoordinates);
+    CellKey cellKey = createCellKey(cellCoordinates);
 
     // Insert the cell or update the existing cell
     auto it = grid.find(cellKey);
     if (it != grid.end()) {
       it->second.addPoint(point);
+      touch(it->second);
     } else {
       Cell cell(cellCoordinates);
       cell.addPoint(point); // Initialize the cell density and timestamp
-      grid.emplace(cellKey, std::move(cell));
+      PDSC_COUNT(DStreamCellCreates);
+      add(cellKey, std::move(cell));
     }
 
     // Remove outdated cells
     for (auto it = grid.begin(); it != grid.end();) {
-      if (point.timestamp - it->second.timestamp > TIME_WINDOW) {
-        it = grid.erase(it);
+      if (point.timestamp - it->second.timestamp > config.time_window) {
+        PDSC_COUNT(DStreamCellExpiries);
+        it = erase(it);
       } else {
         ++it;
       }
@@ -92,29 +134,159 @@ public:
     for (const auto &point : points) {
       insert(point);
     }
+    PDSC_GAUGE(StateSize, grid.size());
   }
 
-  std::vector<Point> output_centers() {
-    std::vector<Point> centers;
+  std::vector<Summary> export_summaries() {
+    std::vector<Summary> summaries;
     for (const auto &cell : grid) {
-      if (cell.second.density > 0.0) {
-        Point center(cell.second.coordinates);
-        center /= cell.second.density;
-        centers.push_back(center);
+      const auto &coordinates = cell.second.coordinates;
+      summaries.push_back({{coordinates.begin(), coordinates.end()},
+                           {},
+                           cell.second.density,
+                           cell.second.timestamp});
+    }
+    return summaries;
+  }
+
+  void merge(const std::vector<Summary> &summaries) {
+    for (const auto &summary : summaries) {
+      CellKey cellKey = createCellKey(summary.linear_sum);
+      auto it = grid.find(cellKey);
+      if (it != grid.end()) {
+        it->second.density += summary.weight;
+        it->second.timestamp = std::max(it->second.timestamp, summary.timestamp);
+        touch(it->second);
+      } else {
+        PDSC_COUNT(DStreamCellCreates);
+        add(cellKey,
+            Cell(summary.linear_sum, summary.weight, summary.timestamp));
       }
     }
-    return centers;
+    PDSC_GAUGE(StateSize, grid.size());
+  }
+
+  void snapshot(SnapshotWriter &out) const {
+    out.write_header("dstream", dimensions);
+    out.write<u64>(grid.size());
+    for (const auto &cell : grid) {
+      out.write<double>(cell.second.density);
+      out.write<double>(cell.second.timestamp);
+      out.write_vector(cell.second.coordinates);
+    }
+  }
+
+  void restore(SnapshotReader &in) {
+    in.expect_header("dstream", dimensions);
+    grid.clear();
+    journal.clear();
+    filed.clear();
+    u64 num_cells = in.read_count();
+    grid.reserve(num_cells);
+    for (u64 i = 0; i < num_cells; i++) {
+      Cell cell(dimensions);
+      cell.density = in.read<double>();
+      cell.timestamp = in.read<double>();
+      in.read_array(cell.coordinates.data(), dimensions);
+      add(createCellKey(cell.coordinates), std::move(cell));
+    }
+  }
+
+  // Drops the sparser half of the cells.
+  void shrink() {
+    if (grid.empty()) {
+      return;
+    }
+    std::vector<double> densities;
+    for (const auto &cell : grid) {
+      densities.push_back(cell.second.density);
+    }
+    auto median = densities.begin() + densities.size() / 2;
+    std::nth_element(densities.begin(), median, densities.end());
+    size_t drop = grid.size() - grid.size() / 2;
+    for (auto it = grid.begin(); it != grid.end() && drop > 0;) {
+      if (it->second.density <= *median) {
+        PDSC_COUNT(DStreamCellExpiries);
+        it = erase(it);
+        drop--;
+      } else {
+        ++it;
+      }
+    }
+    grid.rehash(0);
+  }
+
+  // Refiles only the cells changed since the last call.
+  const std::vector<Point> &centers() {
+    for (Cell *cell : journal) {
+      if (!cell) {
+        continue;
+      }
+      cell->journaled = NOT_JOURNALED;
+      if (cell->density > 0.0) {
+        double *center = filed.put(cell->serial);
+        for (int d = 0; d < dimensions; d++) {
+          center[d] = cell->coordinates[d] / cell->density;
+        }
+      } else {
+        filed.erase(cell->serial);
+      }
+    }
+    journal.clear();
+    return filed.view();
   }
 
 private:
   int dimensions;
-  std::unordered_map<std::string, Cell> grid;
-  const double TIME_WINDOW = 100.0;
+  DStreamConfig config;
+  std::unordered_map<CellKey, Cell, CellKeyHash, std::equal_to<CellKey>,
+                     TrackingAllocator<std::pair<const CellKey, Cell>,
+                                       MemoryCategory::HashTables>>
+      grid;
+  u64 serials = 0;            // Cells made
+  std::vector<Cell *> journal; // Cells changed since centers(), or null
+  CenterCache filed;
+
+  // Map nodes stay put, so the journal can point at cells.
+  void touch(Cell &cell) {
+    if (cell.journaled == NOT_JOURNALED) {
+      cell.journaled = journal.size();
+      journal.push_back(&cell);
+    }
+  }
+
+  void add(const CellKey &key, Cell cell) {
+    cell.serial = serials++;
+    touch(grid.emplace(key, std::move(cell)).first->second);
+  }
+
+  // Erased cells leave holes in the journal; without queries in between
+  // it is packed once they outnumber the cells.
+  template <typename Iterator> Iterator erase(Iterator it) {
+    if (it->second.journaled != NOT_JOURNALED) {
+      journal[it->second.journaled] = nullptr;
+    }
+    filed.erase(it->second.serial);
+    it = grid.erase(it);
+    if (journal.size() > 2 * grid.size() + 64) {
+      u32 kept = 0;
+      for (Cell *cell : journal) {
+        if (cell) {
+          cell->journaled = kept;
+          journal[kept++] = cell;
+        }
+      }
+      journal.resize(kept);
+    }
+    return it;
+  }
 
-  std::string createCellKey(const std::vector<double> &coordinates) const {
-    std::string key;
+  template <typename Coordinates>
+  CellKey createCellKey(const Coordinates &coordinates) const {
+    CellKey key;
     for (const auto &coord : coordinates) {
-      key += std::to_string(static_cast<int>(coord)) + "_";
+      key += std::to_string(static_cast<int>(coord)).c_str();
+      key += '_';
     }
     return key;
   }
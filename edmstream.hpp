@@ -18,16 +18,47 @@
 #define PDSC_EDMSTREAM_HPP
 
 #include "algorithm.hpp"
+#include "center_cache.hpp"
+#include "cluster_index.hpp"
 #include "common.hpp"
+#include "memory.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 
 // const int MAX_CLUSTERS = 100;
 const double DECAY_RATE = 0.01;
 const double DENSITY_THRESHOLD = 0.9;
 
+struct EDMStreamConfig {
+  double decay_rate = DECAY_RATE;
+  double density_threshold = DENSITY_THRESHOLD;
+  double dependent_distance = 500000.0;
+  int decay_interval = 200; // Points between two decay passes
+  IndexConfig index;
+
+  bool set(const std::string &key, double value) {
+    if (key == "decay_rate") {
+      decay_rate = checked_param(key, value, 0.0);
+    } else if (key == "density_threshold") {
+      density_threshold = checked_param(key, value, 0.0);
+    } else if (key == "dependent_distance") {
+      dependent_distance = checked_param(key, value, 0.0);
+    } else if (key == "decay_interval") {
+      decay_interval = checked_count(key, value, 1);
+    } else {
+      return index.set(key, value);
+    }
+    return true;
+  }
+};
+
 struct ClusterCell {
   Point seed;
   double density = 0.0;
-  const double dependent_distance = 500000.0;
   double creation_time = 0.0;
 
   ClusterCell(int dimensions) : seed(dimensions) {}
@@ -40,9 +71,10 @@ struct ClusterCell {
     seed.timestamp = point.timestamp;
   }
 
-  void decayDensity() { density *= exp(-DECAY_RATE); }
+  void decayDensity(double decay_rate) { density *= exp(-decay_rate); }
 
   double calcDistance(const Point &point) const {
+    PDSC_COUNT(DistanceCalls);
     double dist = 0.0;
     for (int i = 0; i < point.features.size(); i++) {
       dist += (point.features[i] - seed.features[i]) *
@@ -52,38 +84,214 @@ struct ClusterCell {
   }
 };
 
-class DPNode {
+// The seed is a plain Point, so its features are charged by hand to the
+// tracker that was current when the node was made.
+class DPNode : public TrackedObject<MemoryCategory::TreeNodes> {
 public:
   ClusterCell cell;
-  std::vector<DPNode *> children;
+  tracked_vector<DPNode *, MemoryCategory::TreeNodes> children;
+  DPNode *parent = nullptr;
+  DPNode *jump = nullptr; // An ancestor, for logarithmic ancestor lookups
+  u32 depth = 0;
+  u32 id = 0; // In the tree's index, if it has one
+
+  DPNode(const ClusterCell &c) : cell(c), tracker(current_memory) {
+    tracker->charge(MemoryCategory::Summaries, seedBytes());
+  }
+  ~DPNode() { tracker->charge(MemoryCategory::Summaries, -seedBytes()); }
+  DPNode(const DPNode &) = delete;
+  DPNode &operator=(const DPNode &) = delete;
 
-  DPNode(const ClusterCell &c) : cell(c) {}
+private:
+  MemoryTracker *tracker;
+
+  i64 seedBytes() const {
+    return cell.seed.features.capacity() * sizeof(double);
+  }
 };
 
 class DPTree {
 public:
   DPNode *root;
+  u64 num_nodes = 0; // Nodes reachable from root, refreshed on each decay
+  // Changes since the last look: nodes added, or any densities changed and
+  // nodes freed, which empties `added`.
+  std::vector<DPNode *> added;
+  bool reshaped = false;
 
-  DPTree() : root(nullptr) {}
+  DPTree(const EDMStreamConfig &config, int dimensions)
+      : root(nullptr), config(config),
+        index(make_cluster_index(config.index, dimensions,
+                                 config.dependent_distance)) {}
+  ~DPTree() { deleteTree(root); }
+  DPTree(const DPTree &) = delete;
+  DPTree &operator=(const DPTree &) = delete;
 
   void addClusterCell(const ClusterCell &cell) {
     if (!root) {
-      root = new DPNode(cell);
+      root = attach(nullptr, cell);
+    } else if (index) {
+      addClusterCellIndexed(cell);
     } else {
       addClusterCellRecursive(root, cell);
     }
   }
 
   void decayClusters(double current_time) {
+    added.clear();
+    reshaped = true;
+    num_nodes = 0;
     decayClustersRecursive(root, current_time);
   }
 
+  // Raises the density a node needs to keep its subtree and prunes at once.
+  void raiseThreshold(double factor, double current_time) {
+    config.density_threshold *= factor;
+    decayClusters(current_time);
+  }
+
+  // Nodes in preorder, each followed by the preorder indices of its children.
+  void snapshot(SnapshotWriter &out) const {
+    std::vector<const DPNode *> nodes;
+    preorder(root, nodes);
+    std::unordered_map<const DPNode *, u32> index;
+    for (u32 i = 0; i < nodes.size(); i++) {
+      index[nodes[i]] = i;
+    }
+    out.write<u64>(num_nodes);
+    out.write<u64>(nodes.size());
+    std::vector<u32> children;
+    for (const DPNode *node : nodes) {
+      out.write<double>(node->cell.density);
+      out.write<double>(node->cell.creation_time);
+      out.write<u64>(node->cell.seed.timestamp);
+      out.write_vector(node->cell.seed.features);
+      children.clear();
+      for (const DPNode *child : node->children) {
+        children.push_back(index[child]);
+      }
+      out.write_vector(children);
+    }
+  }
+
+  void restore(SnapshotReader &in, int dimensions) {
+    u64 restored_nodes = in.read<u64>();
+    std::vector<std::unique_ptr<DPNode>> nodes(in.read_count());
+    std::vector<std::vector<u32>> children(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+      ClusterCell cell(dimensions);
+      cell.density = in.read<double>();
+      cell.creation_time = in.read<double>();
+      cell.seed.timestamp = in.read<u64>();
+      in.read_array(cell.seed.features.data(), dimensions);
+      nodes[i] = std::make_unique<DPNode>(cell);
+      in.read_vector(children[i]);
+    }
+    link_tree(nodes, children, "DP-tree");
+    deleteTree(root);
+    root = nodes.empty() ? nullptr : nodes[0].get();
+    num_nodes = restored_nodes;
+    added.clear();
+    reshaped = true;
+    if (root) {
+      link(root, nullptr);
+    }
+    for (auto &node : nodes) {
+      for (DPNode *child : node->children) {
+        link(child, node.get());
+      }
+      track(node.release());
+    }
+  }
+
 private:
+  EDMStreamConfig config;
+  std::unique_ptr<ClusterIndex> index; // nullptr descends the tree instead
+  tracked_vector<DPNode *, MemoryCategory::TreeNodes> by_id;
+  std::vector<u32> free_ids;
+  // Scratch of addClusterCellIndexed, stamped with the query's epoch.
+  std::vector<u32> candidates, near_depths;
+  std::vector<DPNode *> near_nodes;
+  tracked_vector<u32, MemoryCategory::TreeNodes> near;
+  u32 epoch = 0;
+
+  DPNode *attach(DPNode *parent, const ClusterCell &cell) {
+    DPNode *node = new DPNode(cell);
+    link(node, parent);
+    if (parent) {
+      parent->children.push_back(node);
+    }
+    added.push_back(node);
+    num_nodes++;
+    track(node);
+    return node;
+  }
+
+  // Jump pointers as in Myers' skew-binary lists: each node skips to an
+  // ancestor such that any ancestor is reached in O(log depth) steps.
+  static void link(DPNode *node, DPNode *parent) {
+    node->parent = parent;
+    if (!parent) {
+      node->depth = 0;
+      node->jump = node;
+      return;
+    }
+    DPNode *up = parent->jump;
+    node->depth = parent->depth + 1;
+    node->jump = parent->depth - up->depth == up->depth - up->jump->depth
+                     ? up->jump
+                     : parent;
+  }
+
+  static const DPNode *ancestorAt(const DPNode *node, u32 depth) {
+    while (node->depth > depth) {
+      node = node->jump->depth >= depth ? node->jump : node->parent;
+    }
+    return node;
+  }
+
+  void track(DPNode *node) {
+    if (!index) {
+      return;
+    }
+    if (free_ids.empty()) {
+      node->id = by_id.size();
+      by_id.push_back(node);
+    } else {
+      node->id = free_ids.back();
+      free_ids.pop_back();
+      by_id[node->id] = node;
+    }
+    index->insert(node->id, node->cell.seed.features.data());
+  }
+
+  void deleteTree(DPNode *node) {
+    if (!node)
+      return;
+    for (DPNode *child : node->children) {
+      deleteTree(child);
+    }
+    if (index) {
+      index->remove(node->id);
+      by_id[node->id] = nullptr;
+      free_ids.push_back(node->id);
+    }
+    delete node;
+  }
+
+  void preorder(const DPNode *node, std::vector<const DPNode *> &nodes) const {
+    if (!node)
+      return;
+    nodes.push_back(node);
+    for (const DPNode *child : node->children) {
+      preorder(child, nodes);
+    }
+  }
+
   void addClusterCellRecursive(DPNode *node, const ClusterCell &cell) {
     double dist = node->cell.calcDistance(cell.seed);
-    if (dist < node->cell.dependent_distance) {
-      DPNode *child = new DPNode(cell);
-      node->children.push_back(child);
+    if (dist < config.dependent_distance) {
+      attach(node, cell);
     } else {
       for (auto &child : node->children) {
         addClusterCellRecursive(child, cell);
@@ -91,11 +299,64 @@ private:
     }
   }
 
+  // The descent attaches the cell under every node within the dependent
+  // distance that has no such ancestor. Here the index proposes those
+  // nodes, and each is checked against the depths the near nodes sit at.
+  void addClusterCellIndexed(const ClusterCell &cell) {
+    const Point &seed = cell.seed;
+    if (root->cell.calcDistance(seed) < config.dependent_distance) {
+      attach(root, cell);
+      return;
+    }
+    epoch++;
+    near.resize(by_id.size());
+    candidates.clear();
+    index->candidates(seed.features.data(), candidates);
+    PDSC_COUNT_N(IndexCandidates, candidates.size());
+    near_nodes.clear();
+    near_depths.clear();
+    for (u32 id : candidates) {
+      DPNode *node = by_id[id];
+      if (node != root &&
+          node->cell.calcDistance(seed) < config.dependent_distance) {
+        near[id] = epoch;
+        near_nodes.push_back(node);
+        near_depths.push_back(node->depth);
+      }
+    }
+    std::sort(near_depths.begin(), near_depths.end());
+    near_depths.erase(std::unique(near_depths.begin(), near_depths.end()),
+                      near_depths.end());
+    for (DPNode *node : near_nodes) {
+      if (!nearAncestor(node)) {
+        attach(node, cell);
+      }
+    }
+  }
+
+  // Whether a proper ancestor of `node` was found near this epoch's cell.
+  bool nearAncestor(const DPNode *node) const {
+    for (u32 depth : near_depths) {
+      if (depth >= node->depth) {
+        break;
+      }
+      if (near[ancestorAt(node, depth)->id] == epoch) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   void decayClustersRecursive(DPNode *node, double current_time) {
     if (!node)
       return;
-    node->cell.decayDensity();
-    if (node->cell.density < DENSITY_THRESHOLD) {
+    PDSC_COUNT(EDMDecayVisits);
+    num_nodes++;
+    node->cell.decayDensity(config.decay_rate);
+    if (node->cell.density < config.density_threshold) {
+      for (DPNode *child : node->children) {
+        deleteTree(child);
+      }
       node->children.clear();
     }
     for (auto &child : node->children) {
@@ -106,12 +367,16 @@ private:
 
 class EDMStream : public Algorithm {
 public:
-  EDMStream(int dimensions) : dimensions(dimensions), dp_tree(new DPTree()) {}
+  EDMStream(int dimensions, const EDMStreamConfig &config = {})
+      : dimensions(dimensions), config(config),
+        dp_tree(new DPTree(config, dimensions)), filed(dimensions) {}
+  ~EDMStream() { delete dp_tree; }
   int point_count = 0;
   void insert(const Point &point) {
     // Decay existing clusters
     this->point_count++;
-    if (this->point_count % 200 == 0)
+    last_timestamp = point.timestamp;
+    if (this->point_count % config.decay_interval == 0)
       dp_tree->decayClusters(point.timestamp);
     // dp_tree->decayClusters(point.timestamp);
 
@@ -128,31 +393,93 @@ public:
     for (const auto &point : points) {
       insert(point);
     }
+    PDSC_GAUGE(StateSize, dp_tree->num_nodes);
   }
 
-  std::vector<Point> output_centers() {
-    std::vector<Point> centers;
-    output_centers_recursive(dp_tree->root, centers);
-    return centers;
+  // Between decay passes nodes are only added, so only those are filed; a
+  // pass changes every density and refiles the tree. Nodes are filed under
+  // their address, which is not reused before the next pass.
+  const std::vector<Point> &centers() {
+    if (dp_tree->reshaped) {
+      filed.clear();
+      fileRecursive(dp_tree->root);
+      dp_tree->reshaped = false;
+    } else {
+      for (DPNode *node : dp_tree->added) {
+        file(node);
+      }
+    }
+    dp_tree->added.clear();
+    return filed.view();
+  }
+
+  std::vector<Summary> export_summaries() {
+    std::vector<Summary> summaries;
+    export_recursive(dp_tree->root, summaries);
+    return summaries;
+  }
+
+  void merge(const std::vector<Summary> &summaries) {
+    for (const auto &summary : summaries) {
+      ClusterCell cell(dimensions);
+      cell.seed.features = summary.linear_sum;
+      cell.seed.timestamp = summary.timestamp;
+      cell.density = summary.weight;
+      cell.creation_time = summary.timestamp;
+      dp_tree->addClusterCell(cell);
+    }
+    PDSC_GAUGE(StateSize, dp_tree->num_nodes);
+  }
+
+  void snapshot(SnapshotWriter &out) const {
+    out.write_header("edmstream", dimensions);
+    out.write<int>(point_count);
+    dp_tree->snapshot(out);
+  }
+
+  // Doubles the density a cell needs to keep its dependents and prunes.
+  void shrink() {
+    config.density_threshold *= 2;
+    dp_tree->raiseThreshold(2, last_timestamp);
+  }
+
+  void restore(SnapshotReader &in) {
+    in.expect_header("edmstream", dimensions);
+    point_count = in.read<int>();
+    dp_tree->restore(in, dimensions);
   }
 
-  void output_centers_recursive(DPNode *node, std::vector<Point> &centers) {
+  void export_recursive(DPNode *node, std::vector<Summary> &summaries) {
     if (!node)
       return;
-    // if (node->cell.density > DENSITY_THRESHOLD * 10^(-29)) {
-    // std::cout << "density: " << node->cell.density << std::endl;
-    Point center(node->cell.seed.features);
-    center /= node->cell.density;
-    centers.push_back(center);
-    // }
-    // std::cout << "children size: " << node->children.size() << std::endl;
+    summaries.push_back({node->cell.seed.features, {}, node->cell.density,
+                         node->cell.creation_time});
     for (auto &child : node->children) {
-      output_centers_recursive(child, centers);
+      export_recursive(child, summaries);
+    }
+  }
+
+  void file(const DPNode *node) {
+    double *center = filed.put(reinterpret_cast<uintptr_t>(node));
+    for (int d = 0; d < dimensions; d++) {
+      center[d] = node->cell.seed.features[d] / node->cell.density;
+    }
+  }
+
+  void fileRecursive(const DPNode *node) {
+    if (!node)
+      return;
+    file(node);
+    for (const DPNode *child : node->children) {
+      fileRecursive(child);
     }
   }
 
 private:
   int dimensions;
+  EDMStreamConfig config;
   DPTree *dp_tree;
+  CenterCache filed;
+  double last_timestamp = 0.0;
 };
 #endif // PDSC_EDMSTREAM_HPP
\ No newline at end of file
@@ -17,11 +17,22 @@
 #ifndef PDSC_EVALUATION_HPP
 #define PDSC_EVALUATION_HPP
 
+#include "aligned_allocator.hpp"
+#include "kdtree.hpp"
 #include "point.hpp"
+#include "thread_pool.hpp"
 
-#include <map>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <unordered_map>
 
-std::vector<int> points_to_labels(const std::vector<Point> &points) {
+const size_t KDTREE_MIN_CENTERS = 256; // Below this a linear scan wins
+// Above this, decoding quantized points for an exact scan beats scoring
+// their codes.
+const size_t QUANTIZED_MAX_CENTERS = 24;
+
+inline std::vector<int> points_to_labels(const std::vector<Point> &points) {
   std::vector<int> labels(points.size());
   for (int i = 0; i < points.size(); i++) {
     labels[i] = points[i].true_clu_id;
@@ -29,46 +40,244 @@ std::vector<int> points_to_labels(const std::vector<Point> &points) {
   return labels;
 }
 
-std::vector<int> group_by_centers(const std::vector<Point> &points,
-                                  const std::vector<Point> &centers) {
-  std::vector<int> predicts(points.size());
-  for (int i = 0; i < points.size(); i++) {
-    double min_dist = std::numeric_limits<double>::max();
-    for (int j = 0; j < centers.size(); j++) {
-      double dist = points[i].l2_dist(centers[j]);
-      if (dist < min_dist) {
-        min_dist = dist;
-        predicts[i] = j + 1;
+// Exact nearest-center lookup over a fixed set of centers. Sets of
+// KDTREE_MIN_CENTERS or more are searched through a kd-tree, smaller ones by
+// a bounded linear scan.
+class CenterAssigner {
+public:
+  explicit CenterAssigner(const std::vector<Point> &centers)
+      : num_centers(centers.size()),
+        dimensions(centers.empty() ? 0 : centers[0].features.size()),
+        rows(num_centers * dimensions) {
+    for (size_t j = 0; j < num_centers; j++) {
+      std::copy(centers[j].features.begin(), centers[j].features.end(),
+                &rows[j * dimensions]);
+    }
+    if (num_centers >= KDTREE_MIN_CENTERS) {
+      tree = std::make_unique<KdTree>(rows.data(), num_centers, dimensions);
+    }
+  }
+
+  size_t size() const { return num_centers; }
+
+  // 0-based index of the center nearest to x, or -1 without centers.
+  int nearest(const double *x) const {
+    double dist2;
+    return nearest(x, dist2);
+  }
+
+  // As above; the squared distance to that center is stored in dist2.
+  int nearest(const double *x, double &dist2) const {
+    if (tree) {
+      return tree->nearest(x, dist2);
+    }
+    int best_center = -1;
+    dist2 = std::numeric_limits<double>::max();
+    for (size_t j = 0; j < num_centers; j++) {
+      double d = bounded_distance2(x, &rows[j * dimensions], dimensions, dist2);
+      if (d < dist2) {
+        dist2 = d;
+        best_center = j;
       }
     }
+    return best_center;
+  }
+
+private:
+  size_t num_centers;
+  int dimensions;
+  aligned_vector<double> rows;
+  std::unique_ptr<KdTree> tree;
+};
+
+// 1-based index of the nearest center of every point; points are split
+// across the pool when one is given.
+inline std::vector<int> group_by_centers(const std::vector<Point> &points,
+                                         const std::vector<Point> &centers,
+                                         ThreadPool *pool = nullptr) {
+  std::vector<int> predicts(points.size(), 0);
+  if (centers.empty()) {
+    return predicts;
+  }
+  CenterAssigner assigner(centers);
+  auto assign = [&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      predicts[i] = assigner.nearest(points[i].features.data()) + 1;
+    }
+  };
+  if (pool) {
+    pool->parallel_for(points.size(), assign);
+  } else {
+    assign(0, 0, points.size());
   }
   return predicts;
 }
 
-double evaluate_purity(const std::vector<int> &labels,
-                       const std::vector<int> &predicts, u32 num_true_clusters,
-                       u32 num_pred_clusters) {
-  if (num_true_clusters > num_pred_clusters) {
-    return evaluate_purity(predicts, labels, num_pred_clusters,
-                           num_true_clusters);
-  }
-  std::vector<std::vector<int>> confusion_matrix(
-      num_true_clusters + 1, std::vector<int>(num_pred_clusters + 1, 0));
-  for (int i = 0; i < labels.size(); i++) {
-    confusion_matrix[labels[i]][predicts[i]]++;
-  }
-  double total = 0.0;
-  for (int i = 1; i <= num_true_clusters; i++) {
-    double max = 0.0;
-    for (int j = 1; j < num_pred_clusters; j++) {
-      if (confusion_matrix[i][j] > max) {
-        max = confusion_matrix[i][j];
+// As above over a dataset. Quantized points are scored on their codes
+// against up to QUANTIZED_MAX_CENTERS centers, and decoded one at a time for
+// the exact lookup against more.
+inline std::vector<int> group_by_centers(const Dataset &dataset,
+                                         const std::vector<Point> &centers,
+                                         ThreadPool *pool = nullptr) {
+  if (!dataset.quantized()) {
+    return group_by_centers(dataset.points, centers, pool);
+  }
+  std::vector<int> predicts(dataset.size(), 0);
+  if (centers.empty()) {
+    return predicts;
+  }
+  std::unique_ptr<QuantizedAssigner> codes;
+  std::unique_ptr<CenterAssigner> exact;
+  if (centers.size() <= QUANTIZED_MAX_CENTERS &&
+      QuantizedAssigner::fits(dataset.packed)) {
+    std::vector<double> rows;
+    for (const auto &center : centers) {
+      rows.insert(rows.end(), center.features.begin(), center.features.end());
+    }
+    codes = std::make_unique<QuantizedAssigner>(dataset.packed, rows.data(),
+                                                centers.size());
+  } else {
+    exact = std::make_unique<CenterAssigner>(centers);
+  }
+  auto assign = [&](size_t, size_t begin, size_t end) {
+    QuantizedAssigner::Scratch scratch;
+    std::vector<double> x(dataset.dim);
+    for (size_t i = begin; i < end; i++) {
+      if (codes) {
+        predicts[i] = codes->nearest(i, scratch) + 1;
+      } else {
+        dataset.packed.decode(i, x.data());
+        predicts[i] = exact->nearest(x.data()) + 1;
       }
     }
-    total += max;
+  };
+  if (pool) {
+    pool->parallel_for(predicts.size(), assign);
+  } else {
+    assign(0, 0, predicts.size());
+  }
+  return predicts;
+}
+
+struct Quality {
+  double purity = std::nan("");
+  double nmi = std::nan(""); // Normalized by the arithmetic mean entropy
+  double ari = std::nan("");
+};
+
+// Sparse contingency table of (true label, predicted cluster) counts. Only
+// nonzero cells are stored, so its size is bounded by the number of points
+// rather than by labels x clusters.
+class Contingency {
+public:
+  // A negative count removes earlier additions; cells that drop to zero
+  // are erased.
+  void add(int label, int predict, i64 count = 1) {
+    bump(cells, key(label, predict), count);
+    bump(rows, label, count);
+    bump(cols, predict, count);
+    n += count;
+  }
+
+  // Adds (sign 1) or removes (sign -1) every count of another table.
+  void add(const Contingency &other, i64 sign = 1) {
+    for (const auto &[k, count] : other.cells) {
+      add(int(k >> 32), int(u32(k)), sign * count);
+    }
+  }
+
+  i64 total() const { return n; }
+
+  // Share of points that carry their predicted cluster's majority label.
+  double purity() const {
+    std::unordered_map<int, i64> majority;
+    for (const auto &[k, count] : cells) {
+      i64 &best = majority[int(u32(k))];
+      best = std::max(best, count);
+    }
+    double total = 0.0;
+    for (const auto &entry : majority) {
+      total += entry.second;
+    }
+    return n ? total / n : std::nan("");
+  }
+
+  double nmi() const {
+    if (!n) {
+      return std::nan("");
+    }
+    double h_rows = entropy(rows), h_cols = entropy(cols), mutual = 0.0;
+    for (const auto &[k, count] : cells) {
+      if (count > 0) {
+        double a = rows.at(int(k >> 32)), b = cols.at(int(u32(k)));
+        mutual += count / double(n) * std::log(double(n) * count / (a * b));
+      }
+    }
+    double norm = (h_rows + h_cols) / 2;
+    return norm > 0.0 ? mutual / norm : 1.0;
+  }
+
+  double ari() const {
+    if (!n) {
+      return std::nan("");
+    }
+    double index = 0.0, sum_rows = 0.0, sum_cols = 0.0;
+    for (const auto &cell : cells) {
+      index += pairs(cell.second);
+    }
+    for (const auto &row : rows) {
+      sum_rows += pairs(row.second);
+    }
+    for (const auto &col : cols) {
+      sum_cols += pairs(col.second);
+    }
+    double expected = sum_rows * sum_cols / std::max(1.0, pairs(n));
+    double max_index = (sum_rows + sum_cols) / 2;
+    return max_index > expected ? (index - expected) / (max_index - expected)
+                                : 1.0;
+  }
+
+  Quality quality() const { return {purity(), nmi(), ari()}; }
+
+private:
+  std::unordered_map<u64, i64> cells;
+  std::unordered_map<int, i64> rows, cols;
+  i64 n = 0;
+
+  static u64 key(int label, int predict) {
+    return (u64(u32(label)) << 32) | u32(predict);
+  }
+
+  template <typename Key>
+  static void bump(std::unordered_map<Key, i64> &map, Key k, i64 count) {
+    auto it = map.emplace(k, 0).first;
+    it->second += count;
+    if (it->second == 0) {
+      map.erase(it);
+    }
+  }
+
+  static double pairs(i64 count) { return count * (count - 1) / 2.0; }
+
+  double entropy(const std::unordered_map<int, i64> &margin) const {
+    double h = 0.0;
+    for (const auto &entry : margin) {
+      if (entry.second > 0) {
+        double p = entry.second / double(n);
+        h -= p * std::log(p);
+      }
+    }
+    return h;
+  }
+};
+
+inline Quality evaluate_quality(const std::vector<int> &labels,
+                                const std::vector<int> &predicts) {
+  Contingency table;
+  for (size_t i = 0; i < labels.size(); i++) {
+    table.add(labels[i], predicts[i]);
   }
-  // std::cout << "Total Purity: " << total << std::endl;
-  return total / (double)predicts.size();
+  return table.quality();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_KDTREE_HPP
+#define PDSC_KDTREE_HPP
+
+#include "aligned_allocator.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+const int KDTREE_LEAF_SIZE = 8;
+
+// Squared distance that gives up once it exceeds bound, checked every eight
+// dimensions. The fixed-width blocks keep the inner loop vectorizable.
+inline double bounded_distance2(const double *a, const double *b,
+                                int dimensions, double bound) {
+  double dist = 0.0;
+  int d = 0;
+  for (; d + 8 <= dimensions; d += 8) {
+    double block = 0.0;
+    for (int i = 0; i < 8; i++) {
+      double diff = a[d + i] - b[d + i];
+      block += diff * diff;
+    }
+    dist += block;
+    if (dist >= bound) {
+      return dist;
+    }
+  }
+  for (; d < dimensions; d++) {
+    double diff = a[d] - b[d];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+// Static kd-tree over a set of rows for exact nearest-neighbour queries.
+// Nodes split at the median of their widest dimension; leaf rows are copied
+// contiguously in tree order so a leaf scan is one sequential pass.
+class KdTree {
+public:
+  KdTree(const double *data, size_t n, int dimensions)
+      : dimensions(dimensions), ids(n), rows(n * dimensions) {
+    std::iota(ids.begin(), ids.end(), 0);
+    if (n > 0) {
+      build(data, 0, n);
+    }
+    for (size_t i = 0; i < n; i++) {
+      std::copy(data + ids[i] * dimensions, data + (ids[i] + 1) * dimensions,
+                &rows[i * dimensions]);
+    }
+  }
+
+  size_t size() const { return ids.size(); }
+
+  // Index of the row nearest to x; its squared distance is stored in dist2.
+  size_t nearest(const double *x, double &dist2) const {
+    size_t best = 0;
+    dist2 = std::numeric_limits<double>::max();
+    if (!nodes.empty()) {
+      search(0, x, best, dist2);
+    }
+    return ids[best];
+  }
+
+private:
+  struct Node {
+    size_t begin, end;
+    int split_dim;
+    double split;
+    int left, right; // -1 for leaves
+  };
+
+  int dimensions;
+  std::vector<size_t> ids; // Original row index of each tree-order row
+  aligned_vector<double> rows;
+  std::vector<Node> nodes;
+
+  int build(const double *data, size_t begin, size_t end) {
+    int node = nodes.size();
+    nodes.push_back({begin, end, -1, 0.0, -1, -1});
+    if (end - begin <= KDTREE_LEAF_SIZE) {
+      return node;
+    }
+    int split_dim = 0;
+    double widest = -1.0;
+    for (int d = 0; d < dimensions; d++) {
+      double lo = std::numeric_limits<double>::max(), hi = -lo;
+      for (size_t i = begin; i < end; i++) {
+        double v = data[ids[i] * dimensions + d];
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+      }
+      if (hi - lo > widest) {
+        widest = hi - lo;
+        split_dim = d;
+      }
+    }
+    if (widest <= 0.0) {
+      return node; // All rows coincide
+    }
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end,
+                     [&](size_t a, size_t b) {
+                       return data[a * dimensions + split_dim] <
+                              data[b * dimensions + split_dim];
+                     });
+    double split = data[ids[mid] * dimensions + split_dim];
+    int left = build(data, begin, mid);
+    int right = build(data, mid, end);
+    nodes[node].split_dim = split_dim;
+    nodes[node].split = split;
+    nodes[node].left = left;
+    nodes[node].right = right;
+    return node;
+  }
+
+  void search(int index, const double *x, size_t &best, double &dist2) const {
+    const Node &node = nodes[index];
+    if (node.left == -1) {
+      for (size_t i = node.begin; i < node.end; i++) {
+        double d = bounded_distance2(x, &rows[i * dimensions], dimensions,
+                                     dist2);
+        if (d < dist2) {
+          dist2 = d;
+          best = i;
+        }
+      }
+      return;
+    }
+    double diff = x[node.split_dim] - node.split;
+    int near = diff < 0.0 ? node.left : node.right;
+    int far = diff < 0.0 ? node.right : node.left;
+    search(near, x, best, dist2);
+    if (diff * diff < dist2) {
+      search(far, x, best, dist2);
+    }
+  }
+};
+
+#endif // PDSC_KDTREE_HPP
@@ -0,0 +1,397 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_KEYED_ENGINE_HPP
+#define PDSC_KEYED_ENGINE_HPP
+
+#include "algorithm.hpp"
+#include "common.hpp"
+#include "memory.hpp"
+#include "point.hpp"
+#include "runner.hpp"
+#include "snapshot.hpp"
+#include "work_stealing.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+const u32 KEY_STRIPES = 64; // Independently locked parts of the key table
+const int KEY_QUANTUM = 8;  // Jobs of one key run before its worker moves on
+const u64 EVICT_INTERVAL = 256; // Batches submitted between eviction passes
+
+struct KeyedStats {
+  u64 keys = 0, resident = 0; // Known keys, and those with a live instance
+  u64 evictions = 0, restores = 0;
+  u64 snapshot_bytes = 0; // Held by evicted keys
+  u64 steals = 0;
+  u64 failures = 0; // Jobs that threw
+  MemorySample memory;
+  u64 arena_bytes = 0; // Reserved by the worker arenas
+};
+
+// Clusters many independent keyed streams, one Algorithm instance per key.
+// Instances are made on a key's first batch and allocate their state from
+// the arena of the worker running them. The jobs of a key (batches and
+// queries) run in submission order, one at a time, on one worker: the key
+// stays on the worker that last ran it until another worker steals it.
+// Idle keys can be evicted to snapshots and are restored on their next job.
+class KeyedEngine {
+public:
+  using Factory =
+      std::function<std::unique_ptr<Algorithm>(const std::string &key)>;
+
+  KeyedEngine(Factory make, u32 workers)
+      : make(std::move(make)), arenas(std::max(1u, workers)),
+        stripes(KEY_STRIPES) {}
+
+  // Queued jobs finish before the instances and arenas go away.
+  ~KeyedEngine() { pool.reset(); }
+
+  KeyedEngine(const KeyedEngine &) = delete;
+  KeyedEngine &operator=(const KeyedEngine &) = delete;
+
+  void submit(const std::string &key, std::vector<Point> points) {
+    enqueue(key, [points = std::move(points)](Algorithm &algo) {
+      algo.cluster(points);
+    });
+  }
+
+  // Centers of a key once its earlier batches are clustered.
+  std::future<std::vector<Point>> centers(const std::string &key) {
+    auto task = std::make_shared<
+        std::packaged_task<std::vector<Point>(Algorithm &)>>(
+        [](Algorithm &algo) { return algo.output_centers(); });
+    auto future = task->get_future();
+    enqueue(key, [task](Algorithm &algo) { (*task)(algo); });
+    return future;
+  }
+
+  // Blocks until every submitted job has run.
+  void wait() {
+    std::unique_lock<std::mutex> lock(quiet_mutex);
+    quiet.wait(lock, [this] { return outstanding == 0; });
+  }
+
+  // Snapshots and frees the instances of keys with no queued work whose
+  // last job was submitted at least `idle` ago. Returns how many it evicted.
+  u64 evict_idle(std::chrono::nanoseconds idle) {
+    auto now = std::chrono::steady_clock::now();
+    u64 evicted = 0;
+    for (Stripe &stripe : stripes) {
+      std::lock_guard<std::mutex> table(stripe.mutex);
+      for (auto &[key, tenant] : stripe.tenants) {
+        std::lock_guard<std::mutex> lock(tenant->mutex);
+        if (!tenant->scheduled && tenant->algo &&
+            now - tenant->last_used >= idle) {
+          evict(*tenant);
+          evicted++;
+        }
+      }
+    }
+    return evicted;
+  }
+
+  KeyedStats stats() const {
+    KeyedStats stats;
+    for (const Stripe &stripe : stripes) {
+      std::lock_guard<std::mutex> table(stripe.mutex);
+      for (const auto &[key, tenant] : stripe.tenants) {
+        std::lock_guard<std::mutex> lock(tenant->mutex);
+        stats.keys++;
+        stats.resident += tenant->algo != nullptr;
+        stats.snapshot_bytes += tenant->image.size();
+      }
+    }
+    stats.evictions = evictions.load(std::memory_order_relaxed);
+    stats.restores = restores.load(std::memory_order_relaxed);
+    stats.failures = failures.load(std::memory_order_relaxed);
+    stats.steals = pool->steals();
+    stats.memory = memory.sample();
+    for (const Arena &arena : arenas) {
+      stats.arena_bytes += arena.reserved();
+    }
+    return stats;
+  }
+
+private:
+  using Job = std::function<void(Algorithm &)>;
+
+  struct Tenant {
+    std::string key;
+    std::mutex mutex; // Guards everything below but algo while scheduled
+    std::deque<Job> inbox;
+    bool scheduled = false; // A drain task is queued or running
+    u32 worker = 0;         // Where it last ran
+    std::chrono::steady_clock::time_point last_used;
+    std::unique_ptr<Algorithm> algo; // Null until first run and when evicted
+    std::string image;               // Snapshot while evicted
+  };
+
+  struct Stripe {
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<Tenant>> tenants;
+  };
+
+  Factory make;
+  std::vector<Arena> arenas; // One per worker; outlive every instance
+  MemoryTracker memory;
+  std::vector<Stripe> stripes;
+  std::unique_ptr<WorkStealingPool> pool =
+      std::make_unique<WorkStealingPool>(arenas.size());
+  std::atomic<u64> evictions{0}, restores{0}, failures{0};
+  std::mutex quiet_mutex;
+  std::condition_variable quiet;
+  u64 outstanding = 0; // Jobs submitted and not yet run
+
+  Tenant &tenant(const std::string &key) {
+    Stripe &stripe = stripes[std::hash<std::string>()(key) % stripes.size()];
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    auto &slot = stripe.tenants[key];
+    if (!slot) {
+      slot = std::make_unique<Tenant>();
+      slot->key = key;
+      slot->worker = std::hash<std::string>()(key) / stripes.size() %
+                     arenas.size();
+    }
+    return *slot;
+  }
+
+  void enqueue(const std::string &key, Job job) {
+    {
+      std::lock_guard<std::mutex> lock(quiet_mutex);
+      outstanding++;
+    }
+    Tenant &t = tenant(key);
+    bool start = false;
+    u32 worker;
+    {
+      std::lock_guard<std::mutex> lock(t.mutex);
+      t.inbox.push_back(std::move(job));
+      t.last_used = std::chrono::steady_clock::now();
+      start = !t.scheduled;
+      t.scheduled = true;
+      worker = t.worker;
+    }
+    if (start) {
+      pool->submit(worker, [this, &t](u32 w) { drain(t, w); });
+    }
+  }
+
+  // Runs up to KEY_QUANTUM jobs of a key, then requeues it behind the other
+  // keys of its worker if more are waiting.
+  void drain(Tenant &t, u32 worker) {
+    MemoryScope scope(&memory);
+    ArenaScope arena(&arenas[worker]);
+    for (int done = 0;; done++) {
+      Job job;
+      {
+        std::lock_guard<std::mutex> lock(t.mutex);
+        t.worker = worker;
+        if (t.inbox.empty()) {
+          t.scheduled = false;
+          return;
+        }
+        if (done == KEY_QUANTUM) {
+          pool->submit(worker, [this, &t](u32 w) { drain(t, w); });
+          return;
+        }
+        job = std::move(t.inbox.front());
+        t.inbox.pop_front();
+      }
+      try {
+        job(instance(t));
+      } catch (const std::exception &e) {
+        if (failures.fetch_add(1, std::memory_order_relaxed) == 0) {
+          std::cerr << "Keyed stream " << t.key << ": " << e.what()
+                    << std::endl;
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(quiet_mutex);
+        if (--outstanding == 0) {
+          quiet.notify_all();
+        }
+      }
+    }
+  }
+
+  // The key's instance, made or restored on the running worker. Only
+  // called while the key is scheduled, so eviction cannot interfere and the
+  // image is only read elsewhere. It is dropped once the restore succeeded;
+  // a failed restore leaves it for the next job instead of starting over.
+  Algorithm &instance(Tenant &t) {
+    if (!t.algo) {
+      std::unique_ptr<Algorithm> algo = make(t.key);
+      if (!t.image.empty()) {
+        SnapshotReader in(t.image.data(), t.image.size());
+        algo->restore(in);
+        restores.fetch_add(1, std::memory_order_relaxed);
+      }
+      std::lock_guard<std::mutex> lock(t.mutex);
+      std::string().swap(t.image);
+      t.algo = std::move(algo);
+    }
+    return *t.algo;
+  }
+
+  // Called with the key locked and not scheduled.
+  void evict(Tenant &t) {
+    std::string image;
+    SnapshotWriter out(image);
+    t.algo->snapshot(out);
+    image.shrink_to_fit();
+    t.image = std::move(image);
+    t.algo.reset();
+    evictions.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+struct KeyedConfig {
+  u32 keys = 1000;
+  u32 workers = std::max(1u, std::thread::hardware_concurrency());
+  u64 batch_size = 16; // Points per keyed batch
+  // Evict keys idle for this long every EVICT_INTERVAL batches; negative
+  // disables eviction.
+  std::chrono::nanoseconds idle{-1};
+};
+
+// Replays the dataset as config.keys interleaved streams, point i going to
+// key i mod keys, through a KeyedEngine and then through one instance per
+// key driven by a single loop, and compares time and final centers.
+inline void run_keyed(const std::vector<AlgorithmSpec> &specs,
+                      const Dataset &dataset, const KeyedConfig &config) {
+  const u32 keys = std::max(1u, config.keys);
+  std::vector<std::string> names(keys);
+  for (u32 k = 0; k < keys; k++) {
+    names[k] = "key" + std::to_string(k);
+  }
+  auto elapsed_ms = [](auto start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  for (const auto &spec : specs) {
+    print_header(spec);
+    std::cout << keys << " keys on " << config.workers << " workers, "
+              << config.batch_size << " points per batch" << std::endl;
+
+    std::vector<std::vector<Point>> pending(keys);
+    Point scratch(dataset.dim);
+    std::vector<std::vector<Point>> engine_centers(keys);
+    auto engine = std::make_unique<KeyedEngine>(
+        [&spec](const std::string &) { return spec.make(); }, config.workers);
+    u64 batches = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < dataset.size(); i++) {
+      u32 k = i % keys;
+      pending[k].push_back(dataset.at(i, scratch));
+      if (pending[k].size() < config.batch_size) {
+        continue;
+      }
+      engine->submit(names[k], std::move(pending[k]));
+      pending[k].clear();
+      if (config.idle.count() >= 0 && ++batches % EVICT_INTERVAL == 0) {
+        engine->evict_idle(config.idle);
+      }
+    }
+    std::vector<std::future<std::vector<Point>>> futures;
+    for (u32 k = 0; k < keys; k++) {
+      if (!pending[k].empty()) {
+        engine->submit(names[k], std::move(pending[k]));
+        pending[k].clear();
+      }
+      futures.push_back(engine->centers(names[k]));
+    }
+    for (u32 k = 0; k < keys; k++) {
+      try {
+        engine_centers[k] = futures[k].get();
+      } catch (const std::exception &) {
+      }
+    }
+    long engine_ms = elapsed_ms(start);
+    KeyedStats stats = engine->stats();
+    engine.reset();
+
+    // Baseline: an instance per key, made on its first batch like the
+    // engine's, and all driven by one loop.
+    std::vector<std::unique_ptr<Algorithm>> instances(keys);
+    auto instance = [&](u32 k) -> Algorithm & {
+      if (!instances[k]) {
+        instances[k] = spec.make();
+      }
+      return *instances[k];
+    };
+    start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < dataset.size(); i++) {
+      u32 k = i % keys;
+      pending[k].push_back(dataset.at(i, scratch));
+      if (pending[k].size() == config.batch_size) {
+        instance(k).cluster(pending[k]);
+        pending[k].clear();
+      }
+    }
+    u64 matching = 0, total_centers = 0;
+    for (u32 k = 0; k < keys; k++) {
+      if (!pending[k].empty()) {
+        instance(k).cluster(pending[k]);
+      }
+      std::vector<Point> centers = instance(k).output_centers();
+      total_centers += engine_centers[k].size();
+      bool same = centers.size() == engine_centers[k].size();
+      for (size_t c = 0; same && c < centers.size(); c++) {
+        same = centers[c].features == engine_centers[k][c].features;
+      }
+      matching += same;
+    }
+    long loop_ms = elapsed_ms(start);
+
+    std::cout << "Execution time: " << engine_ms << " ms" << std::endl;
+    std::cout << "Throughput: "
+              << dataset.size() * 1000 / std::max(1l, engine_ms)
+              << " points/s" << std::endl;
+    std::cout << "Keys: " << stats.keys << " (" << stats.resident
+              << " resident), " << total_centers << " centers" << std::endl;
+    std::cout << "Steals: " << stats.steals
+              << ", evictions: " << stats.evictions
+              << ", restores: " << stats.restores
+              << ", snapshots held: " << stats.snapshot_bytes / 1e6 << " MB"
+              << std::endl;
+    std::cout << "Memory (MB): live " << stats.memory.live / 1e6 << ", peak "
+              << stats.memory.peak / 1e6 << ", arenas "
+              << stats.arena_bytes / 1e6 << std::endl;
+    if (stats.failures > 0) {
+      std::cout << "Failed jobs: " << stats.failures << std::endl;
+    }
+    std::cout << "Single loop over all keys: " << loop_ms
+              << " ms, speedup: " << (double)loop_ms / std::max(1l, engine_ms)
+              << "x, keys with identical centers: " << matching << " / "
+              << keys << std::endl;
+  }
+}
+
+#endif // PDSC_KEYED_ENGINE_HPP
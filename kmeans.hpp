@@ -0,0 +1,321 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_KMEANS_HPP
+#define PDSC_KMEANS_HPP
+
+#include "common.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+// Runs with fewer than this many n * k * dim distance terms stay serial.
+const size_t KMEANS_PARALLEL_WORK = 1 << 18;
+
+// Weighted Lloyd k-means over a contiguous n x dim row-major array, with
+// Hamerly bounds to skip distance computations and optional parallel
+// assignment/accumulation on a ThreadPool. All buffers are owned by the
+// engine and only grow, so repeated runs (sliding windows, macro-clustering
+// passes) do not allocate.
+class KMeans {
+public:
+  KMeans(int dimensions, int k, ThreadPool *pool = nullptr)
+      : dimensions(dimensions), k(k), pool(pool),
+        centroids(k * dimensions, 0.0), sums(k * dimensions, 0.0),
+        counts(k, 0.0), separation(k, 0.0), shift(k, 0.0) {}
+
+  int num_clusters() const { return k; }
+  int last_iterations() const { return iterations; }
+
+  double *centroid(int j) { return &centroids[j * dimensions]; }
+  const double *centroid(int j) const { return &centroids[j * dimensions]; }
+  // Sum and total weight of the points assigned to cluster j by the last run.
+  const double *sum(int j) const { return &sums[j * dimensions]; }
+  double count(int j) const { return counts[j]; }
+  int label(size_t i) const { return labels[i]; }
+
+  void set_centroid(int j, const double *values) {
+    std::copy(values, values + dimensions, centroid(j));
+  }
+
+  void seed_random(const double *data, size_t n, std::mt19937 &gen) {
+    std::uniform_int_distribution<size_t> dis(0, n - 1);
+    for (int j = 0; j < k; j++) {
+      set_centroid(j, data + dis(gen) * dimensions);
+    }
+  }
+
+  // k-means++ seeding: each next center is drawn with probability
+  // proportional to weight * squared distance to the nearest chosen center.
+  void seed_plus_plus(const double *data, size_t n, const double *weights,
+                      std::mt19937 &gen) {
+    reserve(n);
+    PDSC_COUNT_N(DistanceCalls, n * k);
+    std::uniform_real_distribution<double> uni(0.0, 1.0);
+    double total = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      total += weights ? weights[i] : 1.0;
+    }
+    set_centroid(0, data + pick(weights, n, total * uni(gen)) * dimensions);
+    total = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      upper[i] = squaredDistance(data + i * dimensions, centroid(0)) *
+                 (weights ? weights[i] : 1.0);
+      total += upper[i];
+    }
+    for (int j = 1; j < k; j++) {
+      size_t chosen = 0;
+      if (total > 0.0) {
+        chosen = pick(upper.data(), n, total * uni(gen));
+      }
+      set_centroid(j, data + chosen * dimensions);
+      total = 0.0;
+      for (size_t i = 0; i < n; i++) {
+        double d = squaredDistance(data + i * dimensions, centroid(j)) *
+                   (weights ? weights[i] : 1.0);
+        upper[i] = std::min(upper[i], d);
+        total += upper[i];
+      }
+    }
+  }
+
+  // Nearest centroid of x; the Euclidean distance is stored in dist.
+  int nearest(const double *x, double &dist) const {
+    PDSC_COUNT_N(DistanceCalls, k);
+    int best = 0;
+    double best_dist = std::numeric_limits<double>::max();
+    for (int j = 0; j < k; j++) {
+      double d = squaredDistance(x, centroid(j));
+      if (d < best_dist) {
+        best_dist = d;
+        best = j;
+      }
+    }
+    dist = std::sqrt(best_dist);
+    return best;
+  }
+
+  // Lloyd iterations from the current centroids, at most max_iterations.
+  // On return every centroid with nonzero weight is the weighted mean of its
+  // assigned points. Returns the number of iterations performed.
+  int run(const double *data, size_t n, int max_iterations,
+          const double *weights = nullptr) {
+    reserve(n);
+    size_t chunks = 1;
+    if (pool && n * k * dimensions >= KMEANS_PARALLEL_WORK) {
+      chunks = std::min<size_t>(pool->size() + 1, n);
+    }
+    partial_sums.resize(chunks * k * dimensions);
+    partial_counts.resize(chunks * k);
+    partial_changed.resize(chunks);
+    partial_distances.resize(chunks);
+    partial_skips.resize(chunks);
+    PDSC_COUNT(KMeansRuns);
+    std::fill(shift.begin(), shift.end(), 0.0);
+    max_shift = second_shift = 0.0;
+    max_shift_index = -1;
+
+    for (iterations = 0; iterations < max_iterations; iterations++) {
+      updateSeparation();
+      bool exact = iterations == 0;
+      auto body = [&](size_t chunk, size_t begin, size_t end) {
+        assignAndAccumulate(data, weights, exact, chunk, begin, end);
+      };
+      if (chunks > 1) {
+        pool->parallel_for(n, body);
+      } else {
+        body(0, 0, n);
+      }
+      size_t changed = 0;
+      for (size_t c = 0; c < chunks; c++) {
+        changed += partial_changed[c];
+        PDSC_COUNT_N(DistanceCalls, partial_distances[c]);
+        PDSC_COUNT_N(KMeansSkips, partial_skips[c]);
+      }
+      PDSC_COUNT(KMeansIterations);
+      PDSC_COUNT_N(DistanceCalls, k * (k - 1)); // updateSeparation
+      if (!exact && changed == 0) {
+        break;
+      }
+      reduce(chunks);
+      moveCentroids();
+    }
+    return iterations;
+  }
+
+private:
+  int dimensions;
+  int k;
+  ThreadPool *pool;
+  int iterations = 0;
+  std::vector<double> centroids, sums, counts;
+  std::vector<double> separation; // Half distance to the closest centroid
+  std::vector<double> shift;      // Movement of each centroid last iteration
+  double max_shift = 0.0, second_shift = 0.0;
+  int max_shift_index = -1;
+  // Per-point state, sized to the largest input seen.
+  std::vector<int> labels;
+  std::vector<double> upper, lower;
+  // Per-chunk partial results, reduced after each pass.
+  std::vector<double> partial_sums, partial_counts;
+  std::vector<size_t> partial_changed;
+  std::vector<size_t> partial_distances, partial_skips;
+
+  void reserve(size_t n) {
+    if (labels.size() < n) {
+      labels.resize(n, 0);
+      upper.resize(n, 0.0);
+      lower.resize(n, 0.0);
+    }
+  }
+
+  size_t pick(const double *weights, size_t n, double target) const {
+    for (size_t i = 0; i < n; i++) {
+      target -= weights ? weights[i] : 1.0;
+      if (target <= 0.0) {
+        return i;
+      }
+    }
+    return n - 1;
+  }
+
+  double squaredDistance(const double *a, const double *b) const {
+    double dist = 0.0;
+    for (int d = 0; d < dimensions; d++) {
+      double diff = a[d] - b[d];
+      dist += diff * diff;
+    }
+    return dist;
+  }
+
+  void updateSeparation() {
+    for (int j = 0; j < k; j++) {
+      double closest = std::numeric_limits<double>::max();
+      for (int o = 0; o < k; o++) {
+        if (o != j) {
+          closest = std::min(closest, squaredDistance(centroid(j), centroid(o)));
+        }
+      }
+      separation[j] = 0.5 * std::sqrt(closest);
+    }
+  }
+
+  void assignAndAccumulate(const double *data, const double *weights,
+                           bool exact, size_t chunk, size_t begin, size_t end) {
+    double *chunk_sums = &partial_sums[chunk * k * dimensions];
+    double *chunk_counts = &partial_counts[chunk * k];
+    std::fill(chunk_sums, chunk_sums + k * dimensions, 0.0);
+    std::fill(chunk_counts, chunk_counts + k, 0.0);
+    size_t changed = 0, distances = 0, skips = 0;
+    for (size_t i = begin; i < end; i++) {
+      const double *x = data + i * dimensions;
+      int a = labels[i];
+      bool rescan = exact;
+      if (!exact) {
+        // Loosen the bounds by how far the centroids moved.
+        upper[i] += shift[a];
+        lower[i] -= a == max_shift_index ? second_shift : max_shift;
+        double bound = std::max(separation[a], lower[i]);
+        if (upper[i] > bound) {
+          upper[i] = std::sqrt(squaredDistance(x, centroid(a)));
+          distances++;
+          rescan = upper[i] > bound;
+        }
+        skips += !rescan;
+      }
+      if (rescan) {
+        int best = 0;
+        double d1 = std::numeric_limits<double>::max(), d2 = d1;
+        for (int j = 0; j < k; j++) {
+          double d = squaredDistance(x, centroid(j));
+          if (d < d1) {
+            d2 = d1;
+            d1 = d;
+            best = j;
+          } else if (d < d2) {
+            d2 = d;
+          }
+        }
+        distances += k;
+        upper[i] = std::sqrt(d1);
+        lower[i] = std::sqrt(d2);
+        if (best != a || exact) {
+          changed++;
+        }
+        labels[i] = a = best;
+      }
+      double w = weights ? weights[i] : 1.0;
+      double *s = chunk_sums + a * dimensions;
+      for (int d = 0; d < dimensions; d++) {
+        s[d] += w * x[d];
+      }
+      chunk_counts[a] += w;
+    }
+    partial_changed[chunk] = changed;
+    partial_distances[chunk] = distances;
+    partial_skips[chunk] = skips;
+  }
+
+  void reduce(size_t chunks) {
+    std::copy(partial_sums.begin(), partial_sums.begin() + k * dimensions,
+              sums.begin());
+    std::copy(partial_counts.begin(), partial_counts.begin() + k,
+              counts.begin());
+    for (size_t c = 1; c < chunks; c++) {
+      const double *chunk_sums = &partial_sums[c * k * dimensions];
+      for (int i = 0; i < k * dimensions; i++) {
+        sums[i] += chunk_sums[i];
+      }
+      for (int j = 0; j < k; j++) {
+        counts[j] += partial_counts[c * k + j];
+      }
+    }
+  }
+
+  void moveCentroids() {
+    max_shift = second_shift = 0.0;
+    max_shift_index = -1;
+    for (int j = 0; j < k; j++) {
+      shift[j] = 0.0;
+      if (counts[j] <= 0.0) {
+        continue; // Empty cluster keeps its centroid.
+      }
+      double *c = centroid(j);
+      const double *s = sum(j);
+      double moved = 0.0;
+      for (int d = 0; d < dimensions; d++) {
+        double next = s[d] / counts[j];
+        moved += (next - c[d]) * (next - c[d]);
+        c[d] = next;
+      }
+      shift[j] = std::sqrt(moved);
+      if (shift[j] > max_shift) {
+        second_shift = max_shift;
+        max_shift = shift[j];
+        max_shift_index = j;
+      } else if (shift[j] > second_shift) {
+        second_shift = shift[j];
+      }
+    }
+  }
+};
+
+#endif // PDSC_KMEANS_HPP
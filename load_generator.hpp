@@ -0,0 +1,286 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_LOAD_GENERATOR_HPP
+#define PDSC_LOAD_GENERATOR_HPP
+
+#include "algorithm.hpp"
+#include "common.hpp"
+#include "memory.hpp"
+#include "metrics.hpp"
+#include "point.hpp"
+#include "runner.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+const double LOAD_START_RATE = 1000.0; // Points/s of the first automatic step
+const int LOAD_MAX_STEPS = 24;         // Rate doublings of an automatic sweep
+const double LOAD_DURATION = 2.0;      // Seconds of arrivals offered per rate
+const double LOAD_SUSTAINED = 0.95;    // Share of the offered rate to keep up
+const u64 LOAD_QUEUEING_BOUND = 100000000; // p99 ns at a sustainable rate
+const u64 LOAD_SEED = 42;
+const auto LOAD_SPIN = std::chrono::microseconds(200); // Spin, don't sleep
+
+enum class ArrivalKind { Constant, Poisson, Trace };
+
+struct LoadConfig {
+  ArrivalKind kind = ArrivalKind::Poisson;
+  std::string trace;        // One arrival time in seconds per line
+  std::vector<double> rates; // Points/s; empty doubles until unsustainable
+  u64 batch_size = BATCH_SIZE;
+  double duration = LOAD_DURATION;
+  u64 queueing_bound = LOAD_QUEUEING_BOUND;
+  u64 seed = LOAD_SEED;
+};
+
+// Parses "const", "poisson" or "trace=file", optionally followed by
+// ":rate,rate,..." in points/s with an optional k or M suffix.
+inline LoadConfig parse_load(const std::string &spec) {
+  LoadConfig config;
+  size_t colon = spec.find(':');
+  std::string kind = spec.substr(0, colon);
+  if (kind == "const") {
+    config.kind = ArrivalKind::Constant;
+  } else if (kind == "poisson") {
+    config.kind = ArrivalKind::Poisson;
+  } else if (kind.compare(0, 6, "trace=") == 0 && kind.size() > 6) {
+    config.kind = ArrivalKind::Trace;
+    config.trace = kind.substr(6);
+  } else {
+    throw std::invalid_argument("unknown arrival schedule " + kind);
+  }
+  if (colon == std::string::npos) {
+    return config;
+  }
+  std::stringstream rates(spec.substr(colon + 1));
+  std::string token;
+  while (std::getline(rates, token, ',')) {
+    size_t used = 0;
+    double rate = 0.0;
+    try {
+      rate = std::stod(token, &used);
+    } catch (const std::exception &) {
+    }
+    if (used + 1 == token.size() && token.find_first_of("kM", used) == used) {
+      rate *= token[used] == 'k' ? 1e3 : 1e6;
+      used++;
+    }
+    if (!(rate > 0.0) || used != token.size()) {
+      throw std::invalid_argument("bad rate " + token + " in " + spec);
+    }
+    config.rates.push_back(rate);
+  }
+  return config;
+}
+
+// Gaps between the arrivals of a trace, in units of its mean gap.
+inline std::vector<double> read_trace(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    throw std::runtime_error("cannot read trace " + path);
+  }
+  std::vector<double> times, gaps;
+  double t;
+  while (file >> t) {
+    times.push_back(t);
+  }
+  for (size_t i = 1; i < times.size(); i++) {
+    gaps.push_back(std::max(0.0, times[i] - times[i - 1]));
+  }
+  double span = times.empty() ? 0.0 : times.back() - times.front();
+  if (!(span > 0.0)) {
+    throw std::runtime_error("trace " + path +
+                             " needs increasing arrival times");
+  }
+  for (double &gap : gaps) {
+    gap *= gaps.size() / span;
+  }
+  return gaps;
+}
+
+// Intended arrival time in ns after the start of each of `count` points
+// offered at `rate` points/s. A trace's gaps are replayed cyclically, scaled
+// so that they average `rate`.
+inline std::vector<u64> arrival_schedule(const LoadConfig &config,
+                                         const std::vector<double> &gaps,
+                                         double rate, u64 count) {
+  std::mt19937_64 rng(config.seed);
+  std::exponential_distribution<double> exponential(1.0);
+  std::vector<u64> schedule(count);
+  double mean_gap = 1e9 / rate, now = 0.0;
+  for (u64 i = 0; i < count; i++) {
+    schedule[i] = now;
+    switch (config.kind) {
+    case ArrivalKind::Constant:
+      now += mean_gap;
+      break;
+    case ArrivalKind::Poisson:
+      now += mean_gap * exponential(rng);
+      break;
+    case ArrivalKind::Trace:
+      now += mean_gap * gaps[i % gaps.size()];
+      break;
+    }
+  }
+  return schedule;
+}
+
+struct LoadResult {
+  double offered = 0.0;  // Points/s
+  double achieved = 0.0; // Points/s, over the arrival of the first point to
+                         // the clustering of the last
+  u64 points = 0;
+  LatencyHistogram latency;  // ns, intended arrival to its batch clustered
+  LatencyHistogram queueing; // ns, batch complete to batch clustered
+  bool sustainable = false;
+};
+
+// Offers the leading points of the dataset at `rate` points/s, open loop:
+// a batch is clustered once its last point is due, or at once if clustering
+// has fallen behind, so queueing delay counts against every point that
+// waited for it instead of slowing the arrivals down.
+inline LoadResult run_at_rate(const AlgorithmSpec &spec,
+                              const Dataset &dataset, const LoadConfig &config,
+                              const std::vector<double> &gaps, double rate) {
+  using Clock = std::chrono::steady_clock;
+  LoadResult result;
+  result.offered = rate;
+  result.points = std::min<u64>(dataset.size(),
+                                std::max(1.0, rate * config.duration));
+  std::vector<u64> schedule =
+      arrival_schedule(config, gaps, rate, result.points);
+
+  MemoryTracker memory;
+  MemoryScope scope(&memory);
+  auto algo = spec.make();
+  std::vector<Point> batch;
+  Clock::time_point start = Clock::now();
+  auto since_start = [start] {
+    return u64(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   Clock::now() - start)
+                   .count());
+  };
+  u64 now = 0;
+  for (u64 i = 0; i < result.points; i += config.batch_size) {
+    u64 end = std::min(i + config.batch_size, result.points);
+    u64 due = schedule[end - 1];
+    now = since_start();
+    if (now < due) {
+      auto wait = std::chrono::nanoseconds(due - now);
+      if (wait > LOAD_SPIN) {
+        std::this_thread::sleep_for(wait - LOAD_SPIN);
+      }
+      while ((now = since_start()) < due) {
+      }
+    }
+    dataset.slice(i, end, batch);
+    algo->cluster(batch);
+    now = since_start();
+    for (u64 j = i; j < end; j++) {
+      result.latency.record(now - schedule[j]);
+      result.queueing.record(now - due);
+    }
+  }
+  result.achieved = (result.points - 1) * 1e9 / std::max<u64>(1, now);
+  if (result.points == 1) {
+    result.achieved = rate;
+  }
+  result.sustainable = result.achieved >= LOAD_SUSTAINED * rate &&
+                       result.queueing.percentile(99) <= config.queueing_bound;
+  return result;
+}
+
+// Runs each algorithm at every configured rate, or at doubling rates from
+// LOAD_START_RATE until one is not sustained, and reports throughput against
+// latency and the highest rate sustained. A rate is sustained when the
+// algorithm keeps up with LOAD_SUSTAINED of it, and 99% of the points wait
+// at most the queueing bound once their batch is complete. The time spent
+// filling a batch is part of the latency but not of the queueing delay, so
+// low rates are not ruled out by the batch size alone.
+inline void run_load(const std::vector<AlgorithmSpec> &specs,
+                     const Dataset &dataset, const LoadConfig &config) {
+  static const char *kinds[] = {"constant", "poisson", "trace"};
+  std::vector<double> gaps;
+  if (config.kind == ArrivalKind::Trace) {
+    gaps = read_trace(config.trace);
+  }
+  for (const auto &spec : specs) {
+    print_header(spec);
+    std::cout << kinds[static_cast<int>(config.kind)] << " arrivals, "
+              << config.batch_size << " points per batch, up to "
+              << config.duration << " s per rate" << std::endl;
+    std::cout << std::setw(12) << "offered/s" << std::setw(13)
+              << "achieved/s";
+    for (const char *column : {"points", "p50(ms)", "p99(ms)", "p99.9(ms)",
+                               "max(ms)", "queue(ms)"}) {
+      std::cout << std::setw(10) << column;
+    }
+    std::cout << "  sustained" << std::endl;
+    std::ofstream csv(spec.name + ".load.csv");
+    csv << "offered,achieved,points,p50_ms,p99_ms,p999_ms,max_ms,"
+           "queue_p99_ms,sustained\n";
+    double max_sustained = 0.0;
+    bool automatic = config.rates.empty();
+    int steps = automatic ? LOAD_MAX_STEPS : config.rates.size();
+    for (int step = 0; step < steps; step++) {
+      double rate = automatic ? LOAD_START_RATE * (1ull << step)
+                              : config.rates[step];
+      LoadResult result = run_at_rate(spec, dataset, config, gaps, rate);
+      const LatencyHistogram &latency = result.latency;
+      double p50 = latency.percentile(50) / 1e6,
+             p99 = latency.percentile(99) / 1e6,
+             p999 = latency.percentile(99.9) / 1e6, max = latency.max() / 1e6,
+             queue = result.queueing.percentile(99) / 1e6;
+      std::ostringstream row;
+      row << std::fixed << std::setprecision(0) << std::setw(12) << rate
+          << std::setw(13) << result.achieved << std::setw(10)
+          << result.points << std::setprecision(3);
+      for (double ms : {p50, p99, p999, max, queue}) {
+        row << std::setw(10) << ms;
+      }
+      std::cout << row.str() << "  " << (result.sustainable ? "yes" : "no")
+                << std::endl;
+      csv << rate << "," << result.achieved << "," << result.points << ","
+          << p50 << "," << p99 << "," << p999 << "," << max << "," << queue
+          << "," << result.sustainable << "\n";
+      if (result.sustainable) {
+        max_sustained = std::max(max_sustained, rate);
+      } else if (automatic) {
+        break;
+      }
+    }
+    std::cout << "Max sustainable rate: ";
+    if (max_sustained > 0.0) {
+      std::cout << u64(max_sustained) << " points/s";
+    } else {
+      std::cout << "none of the offered rates";
+    }
+    std::cout << " (p99 queueing within " << config.queueing_bound / 1e6
+              << " ms)" << std::endl;
+  }
+}
+
+#endif // PDSC_LOAD_GENERATOR_HPP
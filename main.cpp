@@ -14,129 +14,400 @@
  * limitations under the License.
  */
 
-#include "birch.hpp"
-#include "clustream.hpp"
 #include "common.hpp"
-#include "denstream.hpp"
-#include "dstream.hpp"
-#include "edmstream.hpp"
 #include "evaluation.hpp"
+#include "keyed_engine.hpp"
+#include "load_generator.hpp"
 #include "point.hpp"
-#include "slkmeans.hpp"
+#include "projection.hpp"
+#include "registry.hpp"
+#include "runner.hpp"
+#include "server.hpp"
+#include "sharded.hpp"
+#include "sweep.hpp"
+#include "thread_pool.hpp"
 
 #include <cassert>
+#include <csignal>
 #include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <getopt.h>
 #include <iostream>
+#include <optional>
+#include <stdexcept>
 #include <vector>
 
 using namespace std;
 using namespace std::chrono_literals;
 
-void run(const string &name, const Dataset &dataset, Algorithm &algo) {
-  auto start = chrono::high_resolution_clock::now();
-  for (int i = 0; i < dataset.num_points; i += BATCH_SIZE) {
-    int end = min(i + BATCH_SIZE, dataset.num_points);
-    algo.cluster(vector<Point>(dataset.points.begin() + i,
-                               dataset.points.begin() + end));
-    cout << "Progress: [" << (i + BATCH_SIZE) << " / " << dataset.num_points
-         << "]\r";
+const char *USAGE =
+    "[-n num_points] [-b batch_size] [-c] [-p] [-e|-E] "
+    "[-S sweep_file] [-g grid_line] [-j threads] [-w shards] [-H] "
+    "[-C dir] [-R dir] [-q] [-Q threads] [-M megabytes] [-P rp|pca[:dims]] "
+    "[-K keys[:idle_ms]] [-L schedule[:rates]] [-Z 8|16] /path/to/dataset\n"
+    "       [-g grid_line] -D socket|-\n"
+    "  -c  run all algorithms concurrently on pinned cores\n"
+    "  -p  pipeline ingest and clustering on two cores\n"
+    "  -e  report hardware performance counters per run\n"
+    "  -E  ... and per batch\n"
+    "  -S  run the parameter grid in sweep_file instead of the benchmark\n"
+    "  -g  add one grid line, e.g. \"clustream threshold=100,350\"\n"
+    "  -j  configurations run in parallel by a sweep, or workers of -K\n"
+    "  -w  split every batch across this many shards and compare against\n"
+    "      the single-threaded run\n"
+    "  -H  partition shards by spatial hash instead of round-robin\n"
+    "  -C  checkpoint every algorithm's state into dir in the background\n"
+    "  -R  resume every algorithm from its checkpoint in dir\n"
+    "  -q  score every batch against the current centers before training\n"
+    "  -Q  label points from this many threads while ingestion runs\n"
+    "  -M  shrink an algorithm's state whenever it exceeds this budget\n"
+    "  -P  cluster a random projection or the principal components of every\n"
+    "      point and compare against clustering the full points\n"
+    "  -K  split the dataset into this many keyed streams, cluster them on a\n"
+    "      work-stealing pool, evicting keys idle for idle_ms, and compare\n"
+    "      against one loop over all keys\n"
+    "  -L  offer points open-loop at each rate (points/s, e.g. 5k,20k; by\n"
+    "      default doubling) on a const, poisson or trace=file schedule, and\n"
+    "      report latency from arrival and the maximum sustainable rate\n"
+    "  -D  run as a daemon clustering the batches sent to this Unix socket,\n"
+    "      or to stdin for -, with the one algorithm given by -g\n"
+    "  -Z  keep the dataset as 8- or 16-bit column codes, bit-packing 0/1\n"
+    "      columns, and report the memory saved and the error introduced";
+
+volatile sig_atomic_t stop_requested = 0;
+
+// Serves one algorithm over a Unix socket, or over stdin and stdout, until a
+// client shuts it down or a signal arrives. Logs go to stderr, since stdout
+// may carry replies.
+int run_daemon(const string &path, const vector<SweepConfig> &grid) {
+  if (grid.size() > 1) {
+    cerr << "A daemon runs one configuration, -g gave " << grid.size() << endl;
+    return EXIT_FAILURE;
   }
-  cout << endl;
-  auto end = chrono::high_resolution_clock::now();
-  auto elapsed = chrono::duration_cast<chrono::milliseconds>(end - start);
-  cout << "Execution time: " << elapsed.count() << " ms" << endl;
-  auto centers = algo.output_centers();
-  cout << "Number of clusters: " << centers.size() << endl;
-  // save centers to file
-  ofstream out(name + ".centers");
-  for (const auto &center : centers) {
-    for (int i = 0; i < center.features.size(); i++) {
-      out << center.features[i] << " ";
+  SweepConfig config = grid.empty() ? SweepConfig{"clustream"} : grid[0];
+  u32 k = config.k ? config.k : K;
+  try {
+    make_algorithm(config.algorithm, 1, k, config.params);
+  } catch (const std::invalid_argument &e) {
+    cerr << "Invalid configuration: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  ThreadPool pool(std::max(1u, thread::hardware_concurrency()) - 1);
+
+  struct sigaction action {};
+  action.sa_handler = [](int) { stop_requested = 1; };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  IngestServer server(
+      [&](u32 dims) {
+        cerr << "Clustering " << dims << "-dimensional points with "
+             << config.algorithm << " " << config.describe() << endl;
+        return make_algorithm(config.algorithm, dims, k, config.params, &pool);
+      },
+      &stop_requested);
+  auto start = chrono::steady_clock::now();
+  try {
+    if (path == "-") {
+      cerr << "Serving stdin ..." << endl;
+      server.serve(STDIN_FILENO, STDOUT_FILENO);
+    } else {
+      cerr << "Serving " << path << " ..." << endl;
+      server.serve_socket(path);
     }
-    out << endl;
+  } catch (const exception &e) {
+    cerr << "Daemon failed: " << e.what() << endl;
+    return EXIT_FAILURE;
   }
-  out.close();
-  if (centers.size() > 0 && centers.size() <= 1000) {
-    auto purity = evaluate_purity(points_to_labels(dataset.points),
-                                  group_by_centers(dataset.points, centers),
-                                  dataset.num_true_clusters, centers.size());
-    cout << "Purity: " << purity << endl;
-  } else {
-    cout << "Purity: N/A, please check code correctness" << endl;
+  double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  const ServerStats &stats = server.statistics();
+  cerr << "Served " << stats.connections << " connections, " << stats.batches
+       << " batches, " << stats.points << " points ("
+       << stats.points / std::max(seconds, 1e-9) << " points/s), "
+       << stats.queries << " queries, " << stats.bytes_in / 1e6 << " MB in, "
+       << stats.bytes_out / 1e6 << " MB out" << endl;
+  return 0;
+}
+
+// Reports how a quantized dataset is coded, its size against doubles and the
+// largest error it introduced.
+void print_quantization(const Dataset &dataset) {
+  const QuantizedPoints &packed = dataset.packed;
+  cout << "Quantized columns: " << packed.count(ColumnCoding::Bit) << " bit, "
+       << packed.count(ColumnCoding::Int8) << " 8-bit, "
+       << packed.count(ColumnCoding::Int16) << " 16-bit, "
+       << packed.count(ColumnCoding::Constant) << " constant; "
+       << packed.exact_columns() << " of " << packed.dimensions()
+       << " exact" << endl;
+  cout << "Point storage: " << dataset.bytes() / 1e6 << " MB, "
+       << dataset.unpacked_bytes() / 1e6 << " MB as doubles ("
+       << (double)dataset.unpacked_bytes() / std::max<u64>(1, dataset.bytes())
+       << "x smaller)" << endl;
+  u32 worst = 0;
+  double squares = 0.0;
+  for (u32 j = 0; j < packed.dimensions(); j++) {
+    if (packed.max_error(j) > packed.max_error(worst)) {
+      worst = j;
+    }
+    squares += packed.rms_error(j) * packed.rms_error(j);
+  }
+  if (packed.exact_columns() < packed.dimensions()) {
+    const ColumnCodec &codec = packed.columns()[worst];
+    i64 codes = codec.coding == ColumnCoding::Int8 ? INT8_CODES : INT16_CODES;
+    double span = codec.decode(codes) - codec.decode(-codes);
+    cout << "Quantization error: max " << packed.max_error(worst)
+         << " in column " << worst << " ("
+         << 100.0 * packed.max_error(worst) / span
+         << "% of its range), RMS over all values "
+         << sqrt(squares / packed.dimensions()) << endl;
   }
 }
 
 int main(int argc, char *argv[]) {
   Dataset dataset;
+  bool concurrent = false;
+  RunOptions options;
+  vector<SweepConfig> grid;
+  u32 sweep_threads = std::max(1u, thread::hardware_concurrency());
+  ShardingConfig sharding;
+  sharding.shards = 1;
+  optional<ProjectionConfig> projection;
+  optional<KeyedConfig> keyed;
+  optional<LoadConfig> load;
+  bool batch_size_set = false;
+  string daemon_path;
+  int quantize_bits = 0;
   {
-    cout << "Loading dataset ..." << endl;
     int flags, opt;
     int num_points = NUM_POINTS;
     bool num_points_set = false;
-    while ((opt = getopt(argc, argv, "n:")) != -1) {
+    const char *flags_spec = "n:b:cpeES:g:j:w:HC:R:qQ:M:P:K:D:L:Z:";
+    while ((opt = getopt(argc, argv, flags_spec)) != -1) {
       switch (opt) {
       case 'n':
         num_points = atoi(optarg);
         num_points_set = true;
         break;
+      case 'b':
+        options.batch_size = std::max(1, atoi(optarg));
+        batch_size_set = true;
+        break;
+      case 'c':
+        concurrent = true;
+        break;
+      case 'p':
+        options.pipelined = true;
+        break;
+      case 'e':
+        options.perf = true;
+        break;
+      case 'E':
+        options.perf = options.perf_per_batch = true;
+        break;
+      case 'S':
+      case 'g':
+        try {
+          auto configs = opt == 'S' ? load_sweep_file(optarg)
+                                    : parse_sweep_line(optarg);
+          grid.insert(grid.end(), configs.begin(), configs.end());
+        } catch (const exception &e) {
+          cerr << "Invalid sweep: " << e.what() << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'j':
+        sweep_threads = std::max(1, atoi(optarg));
+        break;
+      case 'w':
+        sharding.shards = std::max(1, atoi(optarg));
+        break;
+      case 'H':
+        sharding.partition = Partition::SpatialHash;
+        break;
+      case 'C':
+        options.checkpoint_dir = optarg;
+        try {
+          filesystem::create_directories(optarg);
+        } catch (const exception &e) {
+          cerr << "Invalid checkpoint directory: " << e.what() << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'R':
+        options.restore_dir = optarg;
+        break;
+      case 'q':
+        options.prequential = true;
+        break;
+      case 'Q':
+        options.query_threads = std::max(0, std::min(MAX_READERS, atoi(optarg)));
+        break;
+      case 'M':
+        options.memory_budget = std::max(0.0, atof(optarg)) * 1e6;
+        break;
+      case 'K': {
+        keyed.emplace();
+        keyed->keys = std::max(1, atoi(optarg));
+        const char *idle = strchr(optarg, ':');
+        if (idle) {
+          keyed->idle = chrono::milliseconds(std::max(0, atoi(idle + 1)));
+        }
+        break;
+      }
+      case 'P':
+        try {
+          projection = parse_projection(optarg);
+        } catch (const exception &e) {
+          cerr << "Invalid projection: " << e.what() << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'L':
+        try {
+          load = parse_load(optarg);
+        } catch (const exception &e) {
+          cerr << "Invalid load: " << e.what() << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'D':
+        daemon_path = optarg;
+        break;
+      case 'Z':
+        quantize_bits = atoi(optarg);
+        if (quantize_bits != 8 && quantize_bits != 16) {
+          cerr << "Invalid quantization: " << optarg << " bits" << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
       default: /* '?' */
-        cerr << "Usage: " << argv[0] << " [-n num_points] /path/to/dataset"
-             << endl;
+        cerr << "Usage: " << argv[0] << " " << USAGE << endl;
         exit(EXIT_FAILURE);
       }
     }
 
+    if (options.pipelined &&
+        !(options.checkpoint_dir.empty() && options.restore_dir.empty())) {
+      cerr << "Warning: -C and -R are ignored by pipelined runs" << endl;
+    }
+
+    if (!daemon_path.empty()) {
+      return run_daemon(daemon_path, grid);
+    }
+    cout << "Loading dataset ..." << endl;
     if (optind >= argc) {
-      cerr << "Usage: " << argv[0] << " [-n num_points] /path/to/dataset"
-           << endl;
+      cerr << "Usage: " << argv[0] << " " << USAGE << endl;
       cout << "Using random generated dataset, results may vary." << endl;
       dataset.gen(num_points, DIMENSIONS);
+      if (quantize_bits) {
+        dataset.quantize(quantize_bits);
+      }
     } else {
-      dataset.load(argv[optind]);
+      dataset.load(argv[optind], quantize_bits);
       if (num_points_set) {
         dataset.limit(num_points);
       }
     }
   }
   cout << dataset << endl;
+  if (dataset.quantized()) {
+    print_quantization(dataset);
+  }
+  ThreadPool pool(std::max(1u, thread::hardware_concurrency()) - 1);
+  options.pool = &pool;
 
-  // Benchmark BIRCH
-  cout << "==============================" << endl;
-  cout << "Running BIRCH ..." << endl;
-  BIRCH birch(dataset.dim);
-  run("birch", dataset, birch);
-
-  // Benchmark CluStream
-  cout << "==============================" << endl;
-  cout << "Running CluStream ..." << endl;
-  CluStream clustream(dataset.dim);
-  run("clustream", dataset, clustream);
-
-  // Benchmark EDMStream
-  cout << "==============================" << endl;
-  cout << "Running EDMStream ..." << endl;
-  EDMStream edm(dataset.dim);
-  run("edmstream", dataset, edm);
-
-  // Benchmark DStream
-  cout << "==============================" << endl;
-  cout << "Running DStream ..." << endl;
-  DStream dstream(dataset.dim);
-  run("dstream", dataset, dstream);
+  if (!grid.empty()) {
+    cout << "Sweeping " << grid.size() << " configurations on "
+         << sweep_threads << " threads ..." << endl;
+    try {
+      print_sweep(run_sweep(grid, dataset, pool, sweep_threads));
+    } catch (const exception &e) {
+      cerr << "Invalid sweep: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+    return 0;
+  }
 
-  // Benchmark DenStream
-  cout << "==============================" << endl;
-  cout << "Running DenStream ..." << endl;
-  DenStream denstream(dataset.dim);
-  run("denstream", dataset, denstream);
+  u32 k = dataset.num_true_clusters, dim = dataset.dim;
+  vector<AlgorithmSpec> specs;
+  for (const auto &[name, title] : ALGORITHMS) {
+    specs.push_back({name, title, [name = name, dim, k, &pool] {
+                       return make_algorithm(name, dim, k, {}, &pool);
+                     }});
+  }
 
-  // Benchmark SLKMeans
+  auto start = chrono::high_resolution_clock::now();
+  if (load) {
+    load->batch_size = options.batch_size;
+    try {
+      run_load(specs, dataset, *load);
+    } catch (const exception &e) {
+      cerr << "Invalid load: " << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+  } else if (keyed) {
+    if (batch_size_set) {
+      keyed->batch_size = options.batch_size;
+    }
+    keyed->workers = sweep_threads;
+    // Keys are the unit of parallelism, so instances run single-threaded.
+    for (auto &spec : specs) {
+      spec.make = [name = spec.name, dim, k] {
+        return make_algorithm(name, dim, k);
+      };
+    }
+    run_keyed(specs, dataset, *keyed);
+  } else if (projection && projection->dims >= dim) {
+    cerr << "Invalid projection: " << dim << " dimensions cannot be reduced to "
+         << projection->dims << endl;
+    return EXIT_FAILURE;
+  } else if (projection) {
+    string suffix = projection_name(*projection);
+    string label = suffix == "rp" ? " RP" : " PCA";
+    vector<AlgorithmSpec> projected;
+    for (const auto &[name, title] : ALGORITHMS) {
+      ProjectedAlgorithm::Factory make = [name = name, k, &pool](u32 dims) {
+        return make_algorithm(name, dims, k, {}, &pool);
+      };
+      if (sharding.shards > 1) {
+        make = [make, sharding](u32 dims) -> unique_ptr<Algorithm> {
+          return make_unique<ShardedAlgorithm>(
+              [make, dims] { return make(dims); }, sharding);
+        };
+      }
+      projected.push_back(
+          {name + "." + suffix,
+           title + label + to_string(projection->dims),
+           [make, dim, config = *projection, &pool] {
+             return make_unique<ProjectedAlgorithm>(make, dim, config, &pool);
+           }});
+    }
+    run_against_baseline(specs, projected, dataset, options);
+  } else if (sharding.shards > 1) {
+    vector<AlgorithmSpec> sharded;
+    for (const auto &spec : specs) {
+      sharded.push_back({spec.name + ".sharded",
+                         spec.title + " x" + to_string(sharding.shards),
+                         [make = spec.make, sharding] {
+                           return make_unique<ShardedAlgorithm>(make, sharding);
+                         }});
+    }
+    run_against_baseline(specs, sharded, dataset, options);
+  } else if (concurrent) {
+    run_concurrent(specs, dataset, options);
+  } else {
+    run_serial(specs, dataset, options);
+  }
+  auto end = chrono::high_resolution_clock::now();
   cout << "==============================" << endl;
-  cout << "Running SLKMeans ..." << endl;
-  SLKMeans slkmeans(dataset.dim, dataset.num_true_clusters);
-  run("slkmeans", dataset, slkmeans);
+  cout << "Total benchmark time: "
+       << chrono::duration_cast<chrono::milliseconds>(end - start).count()
+       << " ms" << endl;
 
   return 0;
 }
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_MEMORY_HPP
+#define PDSC_MEMORY_HPP
+
+#include "common.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+enum class MemoryCategory : int {
+  Points,     // Raw or weighted points held in windows and buckets
+  Summaries,  // CF vectors, micro-clusters, cells, centroids
+  TreeNodes,  // BIRCH CF nodes and EDMStream DP-tree nodes
+  HashTables, // Buckets and keys of hashed grids
+  Count
+};
+
+const int NUM_MEMORY_CATEGORIES = static_cast<int>(MemoryCategory::Count);
+
+inline const char *MEMORY_CATEGORY_NAMES[NUM_MEMORY_CATEGORIES] = {
+    "points", "summaries", "tree_nodes", "hash_tables"};
+
+struct MemorySample {
+  i64 live = 0, peak = 0;
+  i64 categories[NUM_MEMORY_CATEGORIES] = {}; // Live bytes
+  u64 rss = 0; // Resident set of the whole process
+};
+
+// Resident set size of the process in bytes, or 0 where /proc is missing.
+inline u64 process_rss_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  u64 pages = 0, resident = 0;
+  if (!(statm >> pages >> resident)) {
+    return 0;
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Live and peak bytes of one owner, by category. Allocations made while a
+// MemoryScope for the tracker is active on a thread are charged to it; each
+// allocation remembers its tracker, so it is credited back to the same one
+// wherever it is freed. Trackers must outlive what they track.
+class MemoryTracker {
+public:
+  void charge(MemoryCategory category, i64 bytes) {
+    live[static_cast<int>(category)].fetch_add(bytes,
+                                               std::memory_order_relaxed);
+    i64 now = total.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    i64 seen = peak.load(std::memory_order_relaxed);
+    while (now > seen &&
+           !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {
+    }
+  }
+
+  i64 bytes(MemoryCategory category) const {
+    return live[static_cast<int>(category)].load(std::memory_order_relaxed);
+  }
+  i64 bytes() const { return total.load(std::memory_order_relaxed); }
+  i64 peak_bytes() const { return peak.load(std::memory_order_relaxed); }
+
+  MemorySample sample() const {
+    MemorySample sample;
+    sample.live = bytes();
+    sample.peak = peak_bytes();
+    for (int i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+      sample.categories[i] = live[i].load(std::memory_order_relaxed);
+    }
+    sample.rss = process_rss_bytes();
+    return sample;
+  }
+
+private:
+  std::atomic<i64> live[NUM_MEMORY_CATEGORIES] = {};
+  std::atomic<i64> total{0}, peak{0};
+};
+
+// Charged when no MemoryScope is active.
+inline MemoryTracker untracked_memory;
+inline thread_local MemoryTracker *current_memory = &untracked_memory;
+
+// Charges the calling thread's tracked allocations to `tracker` until it
+// goes out of scope.
+class MemoryScope {
+public:
+  explicit MemoryScope(MemoryTracker *tracker) : saved(current_memory) {
+    current_memory = tracker ? tracker : &untracked_memory;
+  }
+  ~MemoryScope() { current_memory = saved; }
+  MemoryScope(const MemoryScope &) = delete;
+  MemoryScope &operator=(const MemoryScope &) = delete;
+
+private:
+  MemoryTracker *saved;
+};
+
+const size_t ARENA_CHUNK = 1 << 20;
+const size_t ARENA_MIN_BLOCK = 64; // Also the alignment of every block
+const int ARENA_CLASSES = 11;      // Power-of-two blocks up to 64 KiB
+
+class Arena;
+inline thread_local Arena *current_arena = nullptr;
+
+// Size-class free lists carved from large chunks, for the thread that has
+// it as current_arena. Blocks may be freed on any thread: those freed
+// elsewhere go onto a lock-free stack per class, which the owner takes over
+// whole once its own list runs dry. Chunks are only returned when the arena
+// is destroyed, so it must outlive its blocks.
+class Arena {
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  ~Arena() {
+    for (void *chunk : chunks) {
+      ::operator delete(chunk, std::align_val_t(ARENA_MIN_BLOCK));
+    }
+  }
+
+  // Class of a block of at least `bytes`; ARENA_CLASSES if none is large
+  // enough.
+  static int size_class(size_t bytes) {
+    int c = 0;
+    for (size_t block = ARENA_MIN_BLOCK; block < bytes && c < ARENA_CLASSES;
+         block <<= 1) {
+      c++;
+    }
+    return c;
+  }
+
+  void *allocate(int c) {
+    Block *block = local[c];
+    if (!block) {
+      block = remote[c].exchange(nullptr, std::memory_order_acquire);
+    }
+    if (block) {
+      local[c] = block->next;
+      return block;
+    }
+    return carve(ARENA_MIN_BLOCK << c);
+  }
+
+  void deallocate(void *ptr, int c) noexcept {
+    Block *block = static_cast<Block *>(ptr);
+    if (current_arena == this) {
+      block->next = local[c];
+      local[c] = block;
+      return;
+    }
+    block->next = remote[c].load(std::memory_order_relaxed);
+    while (!remote[c].compare_exchange_weak(block->next, block,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+    }
+  }
+
+  // Bytes held in chunks, whether handed out or free.
+  u64 reserved() const {
+    return reserved_bytes.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Block {
+    Block *next;
+  };
+
+  Block *local[ARENA_CLASSES] = {};
+  std::atomic<Block *> remote[ARENA_CLASSES] = {};
+  std::vector<void *> chunks;
+  char *bump = nullptr, *limit = nullptr;
+  std::atomic<u64> reserved_bytes{0};
+
+  void *carve(size_t bytes) {
+    if (bump == nullptr || size_t(limit - bump) < bytes) {
+      size_t size = std::max(ARENA_CHUNK, bytes);
+      bump = static_cast<char *>(
+          ::operator new(size, std::align_val_t(ARENA_MIN_BLOCK)));
+      limit = bump + size;
+      chunks.push_back(bump);
+      reserved_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    void *block = bump;
+    bump += bytes;
+    return block;
+  }
+};
+
+// Serves the calling thread's tracked allocations from `arena` until it
+// goes out of scope.
+class ArenaScope {
+public:
+  explicit ArenaScope(Arena *arena) : saved(current_arena) {
+    current_arena = arena;
+  }
+  ~ArenaScope() { current_arena = saved; }
+  ArenaScope(const ArenaScope &) = delete;
+  ArenaScope &operator=(const ArenaScope &) = delete;
+
+private:
+  Arena *saved;
+};
+
+struct AllocationHeader {
+  MemoryTracker *tracker;
+  Arena *arena; // Null for blocks from the global heap
+};
+
+// Raw tracked allocation: a header in front of the block holds the tracker
+// it was charged to and the arena it came from, if any.
+template <size_t Align>
+void *tracked_allocate(size_t bytes, MemoryCategory category) {
+  constexpr size_t header = std::max(Align, sizeof(AllocationHeader));
+  Arena *arena = Align <= ARENA_MIN_BLOCK ? current_arena : nullptr;
+  void *raw;
+  int c;
+  if (arena && (c = Arena::size_class(bytes + header)) < ARENA_CLASSES) {
+    raw = arena->allocate(c);
+  } else {
+    arena = nullptr;
+    raw = ::operator new(bytes + header, std::align_val_t(Align));
+  }
+  MemoryTracker *tracker = current_memory;
+  *static_cast<AllocationHeader *>(raw) = {tracker, arena};
+  tracker->charge(category, bytes);
+  return static_cast<char *>(raw) + header;
+}
+
+template <size_t Align>
+void tracked_deallocate(void *ptr, size_t bytes,
+                        MemoryCategory category) noexcept {
+  constexpr size_t header = std::max(Align, sizeof(AllocationHeader));
+  void *raw = static_cast<char *>(ptr) - header;
+  AllocationHeader *block = static_cast<AllocationHeader *>(raw);
+  block->tracker->charge(category, -i64(bytes));
+  if (block->arena) {
+    block->arena->deallocate(raw, Arena::size_class(bytes + header));
+  } else {
+    ::operator delete(raw, std::align_val_t(Align));
+  }
+}
+
+// Stateless allocator charging the current tracker under a fixed category.
+template <typename T, MemoryCategory Category,
+          size_t Align = alignof(std::max_align_t)>
+struct TrackingAllocator {
+  using value_type = T;
+  template <typename U> struct rebind {
+    using other = TrackingAllocator<U, Category, Align>;
+  };
+
+  TrackingAllocator() = default;
+  template <typename U>
+  TrackingAllocator(const TrackingAllocator<U, Category, Align> &) noexcept {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(tracked_allocate<Align>(n * sizeof(T), Category));
+  }
+  void deallocate(T *ptr, size_t n) noexcept {
+    tracked_deallocate<Align>(ptr, n * sizeof(T), Category);
+  }
+
+  template <typename U>
+  bool operator==(const TrackingAllocator<U, Category, Align> &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const TrackingAllocator<U, Category, Align> &) const {
+    return false;
+  }
+};
+
+template <typename T, MemoryCategory Category,
+          size_t Align = alignof(std::max_align_t)>
+using tracked_vector = std::vector<T, TrackingAllocator<T, Category, Align>>;
+
+// Base for heap-allocated nodes: new and delete go through the tracker.
+template <MemoryCategory Category> struct TrackedObject {
+  static void *operator new(size_t bytes) {
+    return tracked_allocate<alignof(std::max_align_t)>(bytes, Category);
+  }
+  static void operator delete(void *ptr, size_t bytes) noexcept {
+    tracked_deallocate<alignof(std::max_align_t)>(ptr, bytes, Category);
+  }
+};
+
+#endif // PDSC_MEMORY_HPP
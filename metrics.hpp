@@ -0,0 +1,179 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_METRICS_HPP
+#define PDSC_METRICS_HPP
+
+#include "common.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ostream>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+const int HISTOGRAM_SUB_BITS = 5;       // 32 sub-buckets per octave, < 3.2%
+const u64 THROUGHPUT_WINDOW = 10000;    // Points per throughput sample
+
+// Low-overhead timestamp source: the TSC where available, calibrated once
+// against steady_clock; steady_clock nanoseconds elsewhere.
+struct CycleClock {
+  static u64 now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  static double ns_per_cycle() {
+    static const double ratio = calibrate();
+    return ratio;
+  }
+
+  static u64 to_ns(u64 cycles) { return cycles * ns_per_cycle(); }
+
+private:
+  static double calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+    auto wall_start = std::chrono::steady_clock::now();
+    u64 start = now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    u64 cycles = now() - start;
+    auto wall = std::chrono::steady_clock::now() - wall_start;
+    return std::chrono::duration<double, std::nano>(wall).count() /
+           std::max<u64>(1, cycles);
+#else
+    return 1.0;
+#endif
+  }
+};
+
+// Log-linear histogram in the style of HdrHistogram: values below
+// 2^SUB_BITS are exact, larger values land in one of 2^SUB_BITS linear
+// sub-buckets of their power of two.
+class LatencyHistogram {
+public:
+  LatencyHistogram() : counts((65 - HISTOGRAM_SUB_BITS) << HISTOGRAM_SUB_BITS) {}
+
+  void record(u64 value) {
+    counts[index(value)]++;
+    total++;
+    sum += value;
+    max_value = std::max(max_value, value);
+  }
+
+  void merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < counts.size(); i++) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    max_value = std::max(max_value, other.max_value);
+  }
+
+  u64 count() const { return total; }
+  u64 max() const { return max_value; }
+  double mean() const { return total ? (double)sum / total : 0.0; }
+
+  // Highest value equivalent to the bucket holding the p-th percentile.
+  u64 percentile(double p) const {
+    u64 target = std::max<u64>(1, std::ceil(p / 100.0 * total));
+    u64 seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= target) {
+        return std::min(upper(i), max_value);
+      }
+    }
+    return max_value;
+  }
+
+  // Non-empty buckets as "[[upper, count], ...]".
+  void write_buckets(std::ostream &os) const {
+    os << "[";
+    bool first = true;
+    for (size_t i = 0; i < counts.size(); i++) {
+      if (counts[i]) {
+        os << (first ? "" : ", ") << "[" << upper(i) << ", " << counts[i]
+           << "]";
+        first = false;
+      }
+    }
+    os << "]";
+  }
+
+private:
+  std::vector<u64> counts;
+  u64 total = 0, sum = 0, max_value = 0;
+
+  static size_t index(u64 value) {
+    const u64 sub = 1ull << HISTOGRAM_SUB_BITS;
+    if (value < sub) {
+      return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (size_t)shift * sub + (value >> shift);
+  }
+
+  static u64 upper(size_t index) {
+    const u64 sub = 1ull << HISTOGRAM_SUB_BITS;
+    if (index < 2 * sub) {
+      return index;
+    }
+    u64 shift = index / sub - 1;
+    u64 top = index - shift * sub;
+    return ((top + 1) << shift) - 1;
+  }
+};
+
+// Throughput sampled once every THROUGHPUT_WINDOW points, to show drift as
+// an algorithm's state grows.
+class ThroughputTimeline {
+public:
+  struct Sample {
+    u64 points;     // Points processed so far
+    u64 elapsed_ns; // Clustering time spent so far
+    double points_per_sec; // Over this window only
+  };
+
+  // Call after every batch; force closes a final, partial window.
+  void record(u64 points, u64 elapsed_ns, bool force = false) {
+    u64 prev_points = samples.empty() ? 0 : samples.back().points;
+    if (points < next_boundary && !(force && points > prev_points)) {
+      return;
+    }
+    u64 prev_ns = samples.empty() ? 0 : samples.back().elapsed_ns;
+    double rate = (points - prev_points) * 1e9 /
+                  std::max<u64>(1, elapsed_ns - prev_ns);
+    samples.push_back({points, elapsed_ns, rate});
+    next_boundary = (points / THROUGHPUT_WINDOW + 1) * THROUGHPUT_WINDOW;
+  }
+
+  const std::vector<Sample> &get() const { return samples; }
+
+private:
+  std::vector<Sample> samples;
+  u64 next_boundary = THROUGHPUT_WINDOW;
+};
+
+#endif // PDSC_METRICS_HPP
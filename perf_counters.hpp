@@ -0,0 +1,166 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_PERF_COUNTERS_HPP
+#define PDSC_PERF_COUNTERS_HPP
+
+#include "common.hpp"
+
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Counters for the calling thread, read through perf_event_open. Hardware
+// events that fail to open are skipped; if none open (no PMU, containers,
+// perf_event_paranoid) it falls back to software perf events, and if those
+// are refused too, to getrusage(RUSAGE_THREAD). Threads other than the
+// caller (e.g. a ThreadPool created earlier) are not counted.
+class PerfCounters {
+public:
+  PerfCounters() {
+    const struct {
+      const char *name;
+      u32 type;
+      u64 config;
+    } hardware_events[] = {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {"dtlb_misses", PERF_TYPE_HW_CACHE,
+         PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+    const struct {
+      const char *name;
+      u32 type;
+      u64 config;
+    } software_events[] = {
+        {"task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+        {"context_switches", PERF_TYPE_SOFTWARE,
+         PERF_COUNT_SW_CONTEXT_SWITCHES},
+        {"cpu_migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    };
+    for (const auto &event : hardware_events) {
+      open(event.name, event.type, event.config, true);
+    }
+    kind = "hardware";
+    if (fds.empty()) {
+      for (const auto &event : software_events) {
+        open(event.name, event.type, event.config, false);
+      }
+      kind = "software";
+    }
+    if (fds.empty()) {
+      names = {"user_ms",         "sys_ms",           "minor_faults",
+               "major_faults",    "voluntary_switches",
+               "involuntary_switches"};
+      kind = "rusage";
+    }
+    baseline.assign(names.size(), 0.0);
+  }
+
+  ~PerfCounters() {
+    for (int fd : fds) {
+      close(fd);
+    }
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  // "hardware", "software" or "rusage".
+  const std::string &source() const { return kind; }
+  const std::vector<std::string> &events() const { return names; }
+
+  void start() {
+    for (int fd : fds) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if (fds.empty()) {
+      baseline = rusage();
+    }
+  }
+
+  void stop() {
+    for (int fd : fds) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+
+  // Values since start(), in events() order. Multiplexed hardware counters
+  // are scaled by their enabled / running time.
+  std::vector<double> read() const {
+    if (fds.empty()) {
+      std::vector<double> now = rusage();
+      for (size_t i = 0; i < now.size(); i++) {
+        now[i] -= baseline[i];
+      }
+      return now;
+    }
+    std::vector<double> values(fds.size(), 0.0);
+    for (size_t i = 0; i < fds.size(); i++) {
+      u64 buf[3] = {0, 0, 0}; // value, time enabled, time running
+      if (::read(fds[i], buf, sizeof(buf)) == sizeof(buf)) {
+        values[i] = buf[2] ? (double)buf[0] * buf[1] / buf[2] : buf[0];
+      }
+    }
+    return values;
+  }
+
+private:
+  std::vector<int> fds;
+  std::vector<std::string> names;
+  std::vector<double> baseline;
+  std::string kind;
+
+  void open(const char *name, u32 type, u64 config, bool user_only) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0) {
+      fds.push_back(fd);
+      names.push_back(name);
+    }
+  }
+
+  static std::vector<double> rusage() {
+    struct rusage usage {};
+    getrusage(RUSAGE_THREAD, &usage);
+    return {usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3,
+            usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3,
+            (double)usage.ru_minflt,
+            (double)usage.ru_majflt,
+            (double)usage.ru_nvcsw,
+            (double)usage.ru_nivcsw};
+  }
+};
+
+#endif // PDSC_PERF_COUNTERS_HPP
@@ -51,21 +51,23 @@ std::ostream &operator<<(std::ostream &os, const Dataset &dataset) {
   os << "\t# Points: " << dataset.num_points << "\n";
   os << "\t# Dimensions: " << dataset.dim << "\n";
   os << "\t# True Clusters: " << dataset.num_true_clusters << "\n";
-  if (dataset.points.size() <= 10) {
-    for (int i = 0; i < dataset.points.size(); i++) {
-      os << '\t' << dataset.points[i];
-      if (i < dataset.points.size() - 1) {
+  Point scratch;
+  u64 size = dataset.size();
+  if (size <= 10) {
+    for (u64 i = 0; i < size; i++) {
+      os << '\t' << dataset.at(i, scratch);
+      if (i < size - 1) {
         os << ", \n";
       }
     }
   } else {
-    for (int i = 0; i < 5; i++) {
-      os << '\t' << dataset.points[i] << ", \n";
+    for (u64 i = 0; i < 5; i++) {
+      os << '\t' << dataset.at(i, scratch) << ", \n";
     }
     os << "\t..., \n";
-    for (int i = dataset.points.size() - 5; i < dataset.points.size(); i++) {
-      os << '\t' << dataset.points[i];
-      if (i < dataset.points.size() - 1) {
+    for (u64 i = size - 5; i < size; i++) {
+      os << '\t' << dataset.at(i, scratch);
+      if (i < size - 1) {
         os << ", \n";
       }
     }
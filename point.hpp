@@ -18,6 +18,7 @@
 #define PDSC_POINT_HPP
 
 #include "common.hpp"
+#include "quantized.hpp"
 
 #include <cstdlib>
 #include <ctime>
@@ -54,6 +55,8 @@ struct Dataset {
   u64 num_points = 0;
   u32 dim = 0, num_true_clusters = 0;
   std::vector<Point> points;
+  QuantizedPoints packed; // Holds the points instead when quantized()
+
   void gen(u64 num_points, u32 dim) {
     this->num_points = num_points;
     this->dim = dim;
@@ -69,19 +72,115 @@ struct Dataset {
       points[i].true_clu_id = i % num_true_clusters + 1;
     }
   }
-  void load(const std::string &filename) {
+  // With quantize_bits of 8 or 16 the file is read twice, once for the
+  // column ranges and once to encode the points into `packed`, so their
+  // doubles are never resident.
+  void load(const std::string &filename, int quantize_bits = 0) {
+    if (!quantize_bits) {
+      read(filename, [this](const Point &point) { points.push_back(point); });
+      return;
+    }
+    std::vector<ColumnStats> stats;
+    read(filename, [&](const Point &point) {
+      stats.resize(dim);
+      for (u32 j = 0; j < dim; j++) {
+        stats[j].add(point.features[j]);
+      }
+    });
+    stats.resize(dim);
+    packed = QuantizedPoints(stats, quantize_bits);
+    packed.reserve(num_points);
+    read(filename, [this](const Point &point) {
+      packed.append(point.features.data(), point.true_clu_id);
+    });
+  }
+  // Encodes the points into `packed` and releases them.
+  void quantize(int bits) {
+    std::vector<ColumnStats> stats(dim);
+    for (const auto &point : points) {
+      for (u32 j = 0; j < dim; j++) {
+        stats[j].add(point.features[j]);
+      }
+    }
+    packed = QuantizedPoints(stats, bits);
+    packed.reserve(points.size());
+    for (const auto &point : points) {
+      packed.append(point.features.data(), point.true_clu_id);
+    }
+    std::vector<Point>().swap(points);
+  }
+  void limit(u64 num_points) {
+    if (num_points && num_points < size()) {
+      points.resize(std::min<u64>(points.size(), num_points));
+      packed.truncate(num_points);
+      this->num_points = num_points;
+    }
+  }
+
+  bool quantized() const { return packed.dimensions() > 0; }
+  u64 size() const { return quantized() ? packed.size() : points.size(); }
+
+  // Point i, decoded into `scratch` when quantized.
+  const Point &at(u64 i, Point &scratch) const {
+    if (!quantized()) {
+      return points[i];
+    }
+    scratch.features.resize(dim);
+    packed.decode(i, scratch.features.data());
+    scratch.timestamp = i + 1;
+    scratch.true_clu_id = packed.label(i);
+    return scratch;
+  }
+  // Copies or decodes points [begin, end) into `batch`, reusing its storage.
+  void slice(u64 begin, u64 end, std::vector<Point> &batch) const {
+    batch.resize(end - begin, Point(dim));
+    for (u64 i = begin; i < end; i++) {
+      Point &point = batch[i - begin];
+      if (quantized()) {
+        at(i, point);
+      } else {
+        point = points[i];
+      }
+    }
+  }
+  std::vector<int> labels() const {
+    std::vector<int> labels(size());
+    for (u64 i = 0; i < labels.size(); i++) {
+      labels[i] = quantized() ? packed.label(i) : points[i].true_clu_id;
+    }
+    return labels;
+  }
+
+  // Bytes held by the points, and what they would take as doubles.
+  u64 bytes() const {
+    if (quantized()) {
+      return packed.bytes();
+    }
+    u64 bytes = points.capacity() * sizeof(Point);
+    for (const auto &point : points) {
+      bytes += point.features.capacity() * sizeof(f64);
+    }
+    return bytes;
+  }
+  u64 unpacked_bytes() const {
+    return size() * (sizeof(Point) + dim * sizeof(f64));
+  }
+
+private:
+  // Reads the header line "# dataset_name num_points dim num_true_clusters",
+  // then hands every point to `sink`.
+  template <typename Sink> void read(const std::string &filename, Sink sink) {
     std::ifstream file(filename);
     if (file.is_open()) {
       {
-        // read header line: "# dataset_name num_points dim num_true_clusters"
         std::string header;
         std::getline(file, header);
         std::stringstream ss(header);
         std::string token;
         ss >> token >> name >> num_points >> dim >> num_true_clusters;
       }
+      Point point(dim);
       for (int i = 0; i < num_points; ++i) {
-        Point point(dim);
         std::string line;
         std::getline(file, line);
         std::stringstream ss(line);
@@ -93,17 +192,11 @@ struct Dataset {
         std::getline(ss, token, ',');
         point.true_clu_id = std::stoull(token);
         point.timestamp = i + 1; // Example timestamp, could be any sequence
-        points.push_back(point);
+        sink(point);
       }
       file.close();
     }
   }
-  void limit(u64 num_points) {
-    if (num_points && num_points < points.size()) {
-      points.resize((size_t)num_points);
-      this->num_points = num_points;
-    }
-  }
 };
 
 std::ostream &operator<<(std::ostream &os, const Point &point);
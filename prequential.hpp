@@ -0,0 +1,141 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_PREQUENTIAL_HPP
+#define PDSC_PREQUENTIAL_HPP
+
+#include "algorithm.hpp"
+#include "common.hpp"
+#include "evaluation.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+
+const int PREQUENTIAL_WINDOW = 10;     // Batches in the sliding quality window
+const double PREQUENTIAL_BUDGET = 0.1; // Evaluation time / clustering time
+const u32 PREQUENTIAL_MAX_SKIP = 64;   // Cap on stride and refresh interval
+
+struct PrequentialSample {
+  u64 position;    // Stream points seen before the batch
+  u64 scored;      // Points of the batch that were scored
+  Quality quality; // Mean over the batches of the sliding window
+  u64 eval_ns;     // Center refresh plus scoring of this batch
+  u32 stride, refresh_interval;
+};
+
+// Test-then-train evaluation: every batch is scored against the centers the
+// algorithm has before it trains on the batch. Each batch is scored in its
+// own confusion table, and the windowed quality is the mean over the last
+// `window` scored batches. Cluster ids are positions in the centers() view,
+// which do not persist from one snapshot to the next, so tables of batches
+// scored against different snapshots are never pooled.
+//
+// Center snapshots come from the centers() view and are reused for
+// refresh_interval batches. Evaluation time is kept within
+// `budget` of clustering time: once over it, the dearer of refreshing and
+// scoring backs off (refresh interval or point stride grows by the
+// overshoot); after `window` batches well under it, one step is undone.
+class PrequentialEvaluator {
+public:
+  // position is the stream offset of the first batch.
+  PrequentialEvaluator(u64 position = 0, int window = PREQUENTIAL_WINDOW,
+                       double budget = PREQUENTIAL_BUDGET)
+      : window(window), budget(budget), position(position) {}
+
+  void test(Algorithm &algo, const std::vector<Point> &batch) {
+    u64 start = CycleClock::now();
+    u64 refresh_ns = 0;
+    if (!assigner || assigner->size() == 0 ||
+        ++since_refresh >= refresh_interval) {
+      assigner = std::make_unique<CenterAssigner>(algo.centers());
+      since_refresh = 0;
+      refresh_ns = CycleClock::to_ns(CycleClock::now() - start);
+    }
+
+    Contingency table;
+    u64 scored = 0;
+    for (size_t i = 0; assigner->size() && i < batch.size(); i += stride) {
+      const Point &point = batch[i];
+      table.add(point.true_clu_id, assigner->nearest(point.features.data()));
+      scored++;
+    }
+    if (scored) {
+      recent.push_back(table.quality());
+      if (recent.size() > window) {
+        recent.pop_front();
+      }
+    }
+    Quality quality{0.0, 0.0, 0.0};
+    for (const Quality &batch_quality : recent) {
+      quality.purity += batch_quality.purity / recent.size();
+      quality.nmi += batch_quality.nmi / recent.size();
+      quality.ari += batch_quality.ari / recent.size();
+    }
+
+    u64 ns = CycleClock::to_ns(CycleClock::now() - start);
+    if (!recent.empty()) {
+      history.push_back(
+          {position, scored, quality, ns, stride, refresh_interval});
+    }
+    position += batch.size();
+    total += ns;
+    eval_since += ns;
+    refresh_since += refresh_ns;
+  }
+
+  // Clustering time of the batch just tested, for the overhead budget.
+  void account(u64 cluster_ns) {
+    cluster_since += cluster_ns;
+    double limit = budget * cluster_since;
+    if (eval_since > limit) {
+      // Back off by the overshoot, rounded up to a power of two.
+      u32 factor = 2;
+      while (factor < PREQUENTIAL_MAX_SKIP && factor * limit < eval_since) {
+        factor *= 2;
+      }
+      u32 &knob = 2 * refresh_since > eval_since ? refresh_interval : stride;
+      knob = std::min(knob * factor, PREQUENTIAL_MAX_SKIP);
+    } else if (++batches_since < window) {
+      return;
+    } else if (eval_since < limit / 4) {
+      u32 &knob = stride > 1 ? stride : refresh_interval;
+      knob = std::max(knob / 2, 1u);
+    }
+    eval_since = refresh_since = cluster_since = 0;
+    batches_since = 0;
+  }
+
+  const std::vector<PrequentialSample> &samples() const { return history; }
+  u64 total_ns() const { return total; }
+
+private:
+  size_t window;
+  double budget;
+  u64 position;
+  std::unique_ptr<CenterAssigner> assigner;
+  u32 since_refresh = 0, refresh_interval = 1, stride = 1;
+  std::deque<Quality> recent; // Of the last `window` scored batches
+  std::vector<PrequentialSample> history;
+  u64 total = 0;
+  // Since the last budget check
+  u64 eval_since = 0, refresh_since = 0, cluster_since = 0;
+  size_t batches_since = 0;
+};
+
+#endif // PDSC_PREQUENTIAL_HPP
@@ -0,0 +1,378 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_PROJECTION_HPP
+#define PDSC_PROJECTION_HPP
+
+#include "aligned_allocator.hpp"
+#include "algorithm.hpp"
+#include "common.hpp"
+#include "memory.hpp"
+#include "thread_pool.hpp"
+
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+const u32 PROJECTION_DIMS = 16;
+const u32 PROJECTION_FIT_POINTS = 1000; // Points a PCA sketch is learned from
+const int PCA_ITERATIONS = 100;         // Subspace iterations of a PCA fit
+const u64 PROJECTION_SEED = 42;
+
+enum class ProjectionKind {
+  Random, // Orthonormalized Johnson-Lindenstrauss matrix (Achlioptas)
+  PCA,    // Top principal components of the first points
+};
+
+struct ProjectionConfig {
+  ProjectionKind kind = ProjectionKind::Random;
+  u32 dims = PROJECTION_DIMS; // Target dimensionality
+  u32 fit_points = PROJECTION_FIT_POINTS;
+  u64 seed = PROJECTION_SEED;
+};
+
+// Parses "rp:16" or "pca:8"; the dimensionality defaults to PROJECTION_DIMS.
+inline ProjectionConfig parse_projection(const std::string &spec) {
+  ProjectionConfig config;
+  size_t colon = spec.find(':');
+  std::string kind = spec.substr(0, colon);
+  if (kind == "rp") {
+    config.kind = ProjectionKind::Random;
+  } else if (kind == "pca") {
+    config.kind = ProjectionKind::PCA;
+  } else {
+    throw std::invalid_argument("unknown projection " + kind);
+  }
+  if (colon != std::string::npos) {
+    size_t used = 0;
+    int dims = 0;
+    try {
+      dims = std::stoi(spec.substr(colon + 1), &used);
+    } catch (const std::exception &) {
+    }
+    if (dims <= 0 || used != spec.size() - colon - 1) {
+      throw std::invalid_argument("bad projection dimensionality in " + spec);
+    }
+    config.dims = dims;
+  }
+  return config;
+}
+
+inline std::string projection_name(const ProjectionConfig &config) {
+  return config.kind == ProjectionKind::Random ? "rp" : "pca";
+}
+
+// Linear map y = W (x - offset) to fewer dimensions, with a back-map
+// x = offset + B y. Both matrices are stored one input dimension per row,
+// so each apply is a sequence of axpys over contiguous rows that vectorize
+// without reordering any sum.
+class Projection {
+public:
+  Projection(u32 input_dims, u32 output_dims)
+      : input(input_dims), output(output_dims), forward_rows(input * output),
+        back_rows(input * output), offset(input, 0.0) {}
+
+  // Achlioptas draw with entries {+1, 0, -1} at probabilities 1/6, 2/3,
+  // 1/6, its rows made orthonormal and scaled by c = sqrt(in / out) so that
+  // distances are preserved in expectation. As W W^T = c^2 I, the back-map
+  // B = W^T / c^2 puts a point's distance to each mapped center at its
+  // projected distance over c^2 plus a term shared by all centers, so
+  // nearest-center assignment matches the inner algorithm's.
+  static Projection random(u32 input_dims, u32 output_dims, u64 seed) {
+    Projection p(input_dims, output_dims);
+    std::mt19937_64 gen(seed);
+    std::uniform_int_distribution<int> die(0, 5);
+    for (double &w : p.forward_rows) {
+      int roll = die(gen);
+      w = roll == 0 ? 1.0 : roll == 1 ? -1.0 : 0.0;
+    }
+    p.orthonormalize();
+    double scale = std::sqrt(double(input_dims) / output_dims);
+    for (u32 i = 0; i < input_dims; i++) {
+      for (u32 j = 0; j < output_dims; j++) {
+        double &w = p.forward_rows[i * output_dims + j];
+        p.back_rows[j * input_dims + i] = w / scale;
+        w *= scale;
+      }
+    }
+    return p;
+  }
+
+  // Principal components of n rows by subspace iteration on their
+  // covariance. The components are orthonormal, so B = W^T.
+  static Projection pca(const std::vector<const double *> &rows,
+                        u32 input_dims, u32 output_dims, u64 seed) {
+    Projection p(input_dims, output_dims);
+    u32 input = input_dims, output = output_dims;
+    size_t n = rows.size();
+    for (const double *x : rows) {
+      for (u32 i = 0; i < input; i++) {
+        p.offset[i] += x[i] / n;
+      }
+    }
+    std::vector<double> cov(input * input, 0.0), centered(input);
+    for (const double *x : rows) {
+      for (u32 i = 0; i < input; i++) {
+        centered[i] = x[i] - p.offset[i];
+      }
+      for (u32 i = 0; i < input; i++) {
+        for (u32 j = 0; j < input; j++) {
+          cov[i * input + j] += centered[i] * centered[j] / n;
+        }
+      }
+    }
+
+    // V (in x out) lives in forward_rows; each pass sets V = orth(C V).
+    std::mt19937_64 gen(seed);
+    std::normal_distribution<double> normal;
+    for (double &v : p.forward_rows) {
+      v = normal(gen);
+    }
+    p.orthonormalize();
+    std::vector<double> next(input * output);
+    for (int it = 0; it < PCA_ITERATIONS; it++) {
+      std::fill(next.begin(), next.end(), 0.0);
+      for (u32 i = 0; i < input; i++) {
+        for (u32 l = 0; l < input; l++) {
+          double c = cov[i * input + l];
+          const double *v = &p.forward_rows[l * output];
+          for (u32 j = 0; j < output; j++) {
+            next[i * output + j] += c * v[j];
+          }
+        }
+      }
+      std::copy(next.begin(), next.end(), p.forward_rows.begin());
+      p.orthonormalize();
+    }
+    for (u32 i = 0; i < input; i++) {
+      for (u32 j = 0; j < output; j++) {
+        p.back_rows[j * input + i] = p.forward_rows[i * output + j];
+      }
+    }
+    return p;
+  }
+
+  u32 input_dims() const { return input; }
+  u32 output_dims() const { return output; }
+
+  void forward(const double *x, double *y) const {
+    std::fill_n(y, output, 0.0);
+    for (u32 i = 0; i < input; i++) {
+      double xi = x[i] - offset[i];
+      const double *w = &forward_rows[i * output];
+      for (u32 j = 0; j < output; j++) {
+        y[j] += w[j] * xi;
+      }
+    }
+  }
+
+  void backward(const double *y, double *x) const {
+    std::copy(offset.begin(), offset.end(), x);
+    for (u32 j = 0; j < output; j++) {
+      const double *b = &back_rows[j * input];
+      for (u32 i = 0; i < input; i++) {
+        x[i] += b[i] * y[j];
+      }
+    }
+  }
+
+  void snapshot(SnapshotWriter &out) const {
+    out.write_vector(forward_rows);
+    out.write_vector(back_rows);
+    out.write_vector(offset);
+  }
+
+  void restore(SnapshotReader &in) {
+    in.read_array(forward_rows.data(), forward_rows.size());
+    in.read_array(back_rows.data(), back_rows.size());
+    in.read_array(offset.data(), offset.size());
+  }
+
+private:
+  using Matrix = tracked_vector<double, MemoryCategory::Summaries, CACHE_LINE>;
+
+  u32 input, output;
+  Matrix forward_rows; // in x out: row i is column i of W
+  Matrix back_rows;    // out x in: row j is column j of B
+  Matrix offset;
+
+  // Gram-Schmidt over the columns of V = forward_rows (in x out). A column
+  // that is numerically dependent on the previous ones is zeroed.
+  void orthonormalize() {
+    for (u32 j = 0; j < output; j++) {
+      for (u32 l = 0; l < j; l++) {
+        double dot = 0.0;
+        for (u32 i = 0; i < input; i++) {
+          dot += forward_rows[i * output + j] * forward_rows[i * output + l];
+        }
+        for (u32 i = 0; i < input; i++) {
+          forward_rows[i * output + j] -= dot * forward_rows[i * output + l];
+        }
+      }
+      double norm = 0.0;
+      for (u32 i = 0; i < input; i++) {
+        norm += forward_rows[i * output + j] * forward_rows[i * output + j];
+      }
+      norm = std::sqrt(norm);
+      for (u32 i = 0; i < input; i++) {
+        forward_rows[i * output + j] =
+            norm > 1e-12 ? forward_rows[i * output + j] / norm : 0.0;
+      }
+    }
+  }
+};
+
+// Preprocessing stage: every batch is projected to config.dims dimensions,
+// in parallel over its points, before the wrapped algorithm sees it, and
+// centers are mapped back to the input space. A PCA sketch is learned from
+// the first fit_points points, which are held back until then. Summaries are
+// exchanged in the projected space, between instances of one projection.
+class ProjectedAlgorithm : public Algorithm {
+public:
+  using Factory = std::function<std::unique_ptr<Algorithm>(u32 dims)>;
+
+  ProjectedAlgorithm(const Factory &make, u32 input_dims,
+                     const ProjectionConfig &config, ThreadPool *pool = nullptr)
+      : input_dims(input_dims), config(config), pool(pool) {
+    if (config.dims == 0 || config.dims >= input_dims) {
+      throw std::invalid_argument(
+          "projection must reduce the dimensionality, " +
+          std::to_string(input_dims) + " to " + std::to_string(config.dims));
+    }
+    inner = make(config.dims);
+    if (config.kind == ProjectionKind::Random) {
+      projection = std::make_unique<Projection>(
+          Projection::random(input_dims, config.dims, config.seed));
+    }
+  }
+
+  void cluster(const std::vector<Point> &points) {
+    if (projection) {
+      clusterProjected(points);
+      return;
+    }
+    pending.insert(pending.end(), points.begin(), points.end());
+    if (pending.size() < config.fit_points) {
+      PDSC_GAUGE(StateSize, pending.size());
+      return;
+    }
+    fit();
+    clusterProjected(pending);
+    pending.clear();
+    pending.shrink_to_fit();
+  }
+
+  // The inner view does not tell what changed, so every center is mapped
+  // back again, into reused buffers.
+  const std::vector<Point> &centers() {
+    const std::vector<Point> &inner_centers = inner->centers();
+    if (!projection) {
+      return inner_centers;
+    }
+    mapped.resize(inner_centers.size(), Point(input_dims));
+    for (size_t c = 0; c < inner_centers.size(); c++) {
+      projection->backward(inner_centers[c].features.data(),
+                           mapped[c].features.data());
+    }
+    return mapped;
+  }
+
+  std::vector<Summary> export_summaries() { return inner->export_summaries(); }
+  void merge(const std::vector<Summary> &summaries) { inner->merge(summaries); }
+  void shrink() { inner->shrink(); }
+
+  void snapshot(SnapshotWriter &out) const {
+    out.write_string("projected");
+    out.write<u32>(input_dims);
+    out.write<u32>(config.dims);
+    out.write<bool>(projection != nullptr);
+    if (projection) {
+      projection->snapshot(out);
+    } else {
+      out.write<u64>(pending.size());
+      for (const auto &point : pending) {
+        out.write<u64>(point.timestamp);
+        out.write<u64>(point.true_clu_id);
+        out.write_vector(point.features);
+      }
+    }
+    inner->snapshot(out);
+  }
+
+  void restore(SnapshotReader &in) {
+    if (in.read_string() != "projected" || in.read<u32>() != input_dims ||
+        in.read<u32>() != config.dims) {
+      throw std::runtime_error("snapshot has a different projection");
+    }
+    pending.clear();
+    if (in.read<bool>()) {
+      projection = std::make_unique<Projection>(input_dims, config.dims);
+      projection->restore(in);
+    } else {
+      projection.reset();
+      pending.resize(in.read_count(), Point(input_dims));
+      for (auto &point : pending) {
+        point.timestamp = in.read<u64>();
+        point.true_clu_id = in.read<u64>();
+        in.read_array(point.features.data(), input_dims);
+      }
+    }
+    inner->restore(in);
+  }
+
+private:
+  u32 input_dims;
+  ProjectionConfig config;
+  ThreadPool *pool;
+  std::unique_ptr<Algorithm> inner;
+  std::unique_ptr<Projection> projection;
+  std::vector<Point> pending;   // Held back until the PCA sketch is fitted
+  std::vector<Point> projected; // Reused batch buffer
+  std::vector<Point> mapped;    // Centers in the input space
+
+  void fit() {
+    std::vector<const double *> rows;
+    for (const auto &point : pending) {
+      rows.push_back(point.features.data());
+    }
+    projection = std::make_unique<Projection>(
+        Projection::pca(rows, input_dims, config.dims, config.seed));
+  }
+
+  void clusterProjected(const std::vector<Point> &points) {
+    projected.resize(points.size(), Point(config.dims));
+    auto project = [&](size_t, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        projection->forward(points[i].features.data(),
+                            projected[i].features.data());
+        projected[i].timestamp = points[i].timestamp;
+        projected[i].true_clu_id = points[i].true_clu_id;
+      }
+    };
+    if (pool) {
+      pool->parallel_for(points.size(), project);
+    } else {
+      project(0, 0, points.size());
+    }
+    inner->cluster(projected);
+  }
+};
+
+#endif // PDSC_PROJECTION_HPP
@@ -0,0 +1,448 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_QUANTIZED_HPP
+#define PDSC_QUANTIZED_HPP
+
+#include "common.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+const int QUANTIZE_MAX_DECIMALS = 3; // Decimal places a column is kept exact at
+const double DECIMAL_SCALES[] = {1.0, 10.0, 100.0, 1000.0};
+const i64 INT8_CODES = 127;    // Codes of an 8-bit column are within +-this
+const i64 INT16_CODES = 32767; // ... and of a 16-bit column
+const double QUANTIZE_ROUNDING = 1e-9; // Relative slack for rounding in scores
+const u32 DOT_LANES = 8; // 16-bit codes per vector register
+// Products of a byte and a 16-bit weight summed in 32 bits without overflow.
+const u32 DOT_MAX_TERMS = 256;
+
+enum class ColumnCoding : uint8_t { Constant, Bit, Int8, Int16 };
+
+// Range and decimal precision of one column, gathered before encoding it.
+struct ColumnStats {
+  double min = std::numeric_limits<double>::max();
+  double max = std::numeric_limits<double>::lowest();
+  int decimals = 0; // Above QUANTIZE_MAX_DECIMALS when a value needs more
+
+  void add(double x) {
+    min = std::min(min, x);
+    max = std::max(max, x);
+    while (decimals <= QUANTIZE_MAX_DECIMALS &&
+           !whole(x * DECIMAL_SCALES[decimals])) {
+      decimals++;
+    }
+  }
+
+private:
+  static bool whole(double v) {
+    return std::abs(v) < 0x1p52 &&
+           std::abs(v - std::nearbyint(v)) <= 1e-9 * std::max(1.0, std::abs(v));
+  }
+};
+
+// How one column maps to codes: a value is (offset + scale * code) / divisor.
+// A column whose values are decimals with a range that fits the code width
+// is stored as exact integers in units of its last decimal place; any other
+// column is spread evenly over the codes, losing up to half a step.
+struct ColumnCodec {
+  ColumnCoding coding = ColumnCoding::Constant;
+  u32 slot = 0; // Position among the columns of the same coding
+  double offset = 0.0, scale = 1.0, divisor = 1.0;
+
+  // `bits` (8 or 16) is the widest code; narrower codes are used where they
+  // keep a column exact.
+  static ColumnCodec choose(const ColumnStats &stats, int bits) {
+    ColumnCodec codec;
+    if (!(stats.min < stats.max)) {
+      codec.offset = stats.min <= stats.max ? stats.min : 0.0;
+      codec.scale = 0.0;
+      return codec;
+    }
+    if (stats.decimals == 0 && stats.min >= 0.0 && stats.max <= 1.0) {
+      codec.coding = ColumnCoding::Bit;
+      return codec;
+    }
+    if (stats.decimals <= QUANTIZE_MAX_DECIMALS) {
+      double divisor = DECIMAL_SCALES[stats.decimals];
+      double low = std::nearbyint(stats.min * divisor);
+      double range = std::nearbyint(stats.max * divisor) - low;
+      if (range <= 2 * INT8_CODES || (bits > 8 && range <= 2 * INT16_CODES)) {
+        codec.coding =
+            range <= 2 * INT8_CODES ? ColumnCoding::Int8 : ColumnCoding::Int16;
+        codec.offset = low + std::floor(range / 2);
+        codec.divisor = divisor;
+        return codec;
+      }
+    }
+    codec.coding = bits > 8 ? ColumnCoding::Int16 : ColumnCoding::Int8;
+    double codes = bits > 8 ? INT16_CODES : INT8_CODES;
+    codec.offset = stats.min / 2 + stats.max / 2;
+    codec.scale = (stats.max - stats.min) / (2 * codes);
+    return codec;
+  }
+
+  i64 encode(double x) const {
+    i64 limit = coding == ColumnCoding::Int8 ? INT8_CODES : INT16_CODES;
+    double code = std::nearbyint((x * divisor - offset) / scale);
+    return std::max<double>(-limit, std::min<double>(limit, code));
+  }
+  double decode(i64 code) const { return (offset + scale * code) / divisor; }
+};
+
+// Points stored column-coded: each column is a constant, a bit, or an 8- or
+// 16-bit signed code. Codes of a row are kept together per width, so a
+// distance kernel streams through 8-bit codes, 16-bit codes and 64-column
+// bit words of one row at a time. Labels are kept alongside; timestamps are
+// implied by the row, as in Dataset::load.
+class QuantizedPoints {
+public:
+  QuantizedPoints() = default;
+  QuantizedPoints(const std::vector<ColumnStats> &stats, int bits)
+      : max_errors(stats.size()), squared_errors(stats.size()) {
+    for (const auto &column : stats) {
+      ColumnCodec codec = ColumnCodec::choose(column, bits);
+      std::vector<u32> &slots = columns_of(codec.coding);
+      codec.slot = slots.size();
+      slots.push_back(codecs.size());
+      codecs.push_back(codec);
+    }
+    bit_words = (bit_columns.size() + 63) / 64;
+  }
+
+  u64 size() const { return labels.size(); }
+  u32 dimensions() const { return codecs.size(); }
+  const std::vector<ColumnCodec> &columns() const { return codecs; }
+  u32 count(ColumnCoding coding) const {
+    switch (coding) {
+    case ColumnCoding::Bit:
+      return bit_columns.size();
+    case ColumnCoding::Int8:
+      return narrow_columns.size();
+    case ColumnCoding::Int16:
+      return wide_columns.size();
+    default:
+      return constant_columns.size();
+    }
+  }
+  u32 words() const { return bit_words; }
+
+  void reserve(u64 rows) {
+    narrow.reserve(rows * narrow_columns.size());
+    wide.reserve(rows * wide_columns.size());
+    bits.reserve(rows * bit_words);
+    labels.reserve(rows);
+  }
+
+  // Encodes one point of dimensions() features, recording the error of
+  // every column against its decoded value.
+  void append(const double *x, u32 label) {
+    for (u32 column : narrow_columns) {
+      narrow.push_back(codecs[column].encode(x[column]));
+    }
+    for (u32 column : wide_columns) {
+      wide.push_back(codecs[column].encode(x[column]));
+    }
+    bits.resize(bits.size() + bit_words, 0);
+    u64 *word = &bits[bits.size() - bit_words];
+    for (u32 slot = 0; slot < bit_columns.size(); slot++) {
+      if (x[bit_columns[slot]] > 0.5) {
+        word[slot / 64] |= u64(1) << (slot % 64);
+      }
+    }
+    labels.push_back(label);
+    appended++;
+    std::vector<double> &decoded = scratch;
+    decoded.resize(codecs.size());
+    decode(size() - 1, decoded.data());
+    for (u32 column = 0; column < codecs.size(); column++) {
+      double error = std::abs(decoded[column] - x[column]);
+      max_errors[column] = std::max(max_errors[column], error);
+      squared_errors[column] += error * error;
+    }
+  }
+
+  void decode(u64 row, double *x) const {
+    const int8_t *q8 = narrow_row(row);
+    for (u32 slot = 0; slot < narrow_columns.size(); slot++) {
+      x[narrow_columns[slot]] = codecs[narrow_columns[slot]].decode(q8[slot]);
+    }
+    const int16_t *q16 = wide_row(row);
+    for (u32 slot = 0; slot < wide_columns.size(); slot++) {
+      x[wide_columns[slot]] = codecs[wide_columns[slot]].decode(q16[slot]);
+    }
+    const u64 *word = bit_row(row);
+    for (u32 slot = 0; slot < bit_columns.size(); slot++) {
+      x[bit_columns[slot]] = (word[slot / 64] >> (slot % 64)) & 1;
+    }
+    for (u32 column : constant_columns) {
+      x[column] = codecs[column].offset;
+    }
+  }
+
+  u32 label(u64 row) const { return labels[row]; }
+  const int8_t *narrow_row(u64 row) const {
+    return narrow.data() + row * narrow_columns.size();
+  }
+  const int16_t *wide_row(u64 row) const {
+    return wide.data() + row * wide_columns.size();
+  }
+  const u64 *bit_row(u64 row) const { return bits.data() + row * bit_words; }
+
+  void truncate(u64 rows) {
+    if (rows < size()) {
+      narrow.resize(rows * narrow_columns.size());
+      wide.resize(rows * wide_columns.size());
+      bits.resize(rows * bit_words);
+      labels.resize(rows);
+      narrow.shrink_to_fit();
+      wide.shrink_to_fit();
+      bits.shrink_to_fit();
+      labels.shrink_to_fit();
+    }
+  }
+
+  // Bytes allocated for codes and labels.
+  u64 bytes() const {
+    return narrow.capacity() * sizeof(int8_t) +
+           wide.capacity() * sizeof(int16_t) + bits.capacity() * sizeof(u64) +
+           labels.capacity() * sizeof(u32);
+  }
+
+  // Largest and root mean square error of a column over the rows appended,
+  // and the number of columns reproduced exactly.
+  double max_error(u32 column) const { return max_errors[column]; }
+  double rms_error(u32 column) const {
+    return std::sqrt(squared_errors[column] / std::max<u64>(1, appended));
+  }
+  u32 exact_columns() const {
+    return std::count(max_errors.begin(), max_errors.end(), 0.0);
+  }
+
+private:
+  std::vector<ColumnCodec> codecs;
+  // Column index of every slot, per coding.
+  std::vector<u32> narrow_columns, wide_columns, bit_columns, constant_columns;
+  u32 bit_words = 0;
+  std::vector<int8_t> narrow; // Row-major 8-bit codes
+  std::vector<int16_t> wide;  // Row-major 16-bit codes
+  std::vector<u64> bits;      // Row-major bit words
+  std::vector<u32> labels;
+  std::vector<double> max_errors, squared_errors;
+  u64 appended = 0; // Rows the errors cover, truncated ones included
+  std::vector<double> scratch;
+
+  std::vector<u32> &columns_of(ColumnCoding coding) {
+    switch (coding) {
+    case ColumnCoding::Bit:
+      return bit_columns;
+    case ColumnCoding::Int8:
+      return narrow_columns;
+    case ColumnCoding::Int16:
+      return wide_columns;
+    default:
+      return constant_columns;
+    }
+  }
+};
+
+// Sum of n products of 16-bit values of at most 8 significant bits with
+// 16-bit weights; n is a multiple of DOT_LANES and at most DOT_MAX_TERMS, so
+// the 32-bit sum cannot overflow and the loop vectorizes as a widening
+// multiply-add.
+inline int32_t dot_codes(const int16_t *codes, const int16_t *weights,
+                         u32 n) {
+  int32_t sum = 0;
+  for (u32 j = 0; j < n; j++) {
+    sum += int32_t(codes[j]) * weights[j];
+  }
+  return sum;
+}
+
+// Nearest of a fixed set of centers to quantized rows, computed on the
+// codes. For a row x with codes q, |x - c|^2 - |x|^2 is affine in q:
+// bias_c - 2 sum_j q_j w_cj with w_cj = c_j * scale_j / divisor_j. Rounding
+// each center's weights to 16-bit integers turns its score into an integer
+// dot product, off by at most factor_c * sum_j |q_j|. When another center
+// scores within those bounds of the best, the row is decoded and only those
+// candidates are compared exactly, so the result is the nearest center to
+// the decoded point, the lowest index on ties.
+//
+// A row is first spread into one vector of small codes: the signed high
+// bytes of its 16-bit codes, then their unsigned low bytes, its 8-bit codes
+// and its bits, each part padded to DOT_LANES. Every center then costs two
+// dot products against its weights, the first one scaled by 256.
+class QuantizedAssigner {
+public:
+  struct Scratch {
+    std::vector<int16_t> codes;
+    std::vector<double> score, slack, x;
+  };
+
+  // `centers` holds count rows of points.dimensions() features.
+  QuantizedAssigner(const QuantizedPoints &points, const double *centers,
+                    size_t count)
+      : points(points), num_centers(count), dims(points.dimensions()),
+        n16(points.count(ColumnCoding::Int16)),
+        n8(points.count(ColumnCoding::Int8)),
+        nbits(points.count(ColumnCoding::Bit)), high(padded(n16)),
+        width(high + padded(n16 + n8 + nbits)),
+        rows(centers, centers + count * dims), bias(count), factor(count),
+        margin(count), weights(count * width) {
+    const auto &codecs = points.columns();
+    double norm_bound = 0.0; // Bounds |x|^2 over every codable row
+    for (const ColumnCodec &codec : codecs) {
+      i64 limit = codec.coding == ColumnCoding::Int8    ? INT8_CODES
+                  : codec.coding == ColumnCoding::Int16 ? INT16_CODES
+                                                        : 1;
+      double bound = std::max(std::abs(codec.decode(-limit)),
+                              std::abs(codec.decode(limit)));
+      norm_bound += bound * bound;
+    }
+    std::vector<double> exact(dims);
+    for (size_t c = 0; c < count; c++) {
+      const double *center = &rows[c * dims];
+      double largest = 0.0, norm = 0.0;
+      for (u32 j = 0; j < dims; j++) {
+        const ColumnCodec &codec = codecs[j];
+        exact[j] = center[j] * codec.scale / codec.divisor;
+        bias[c] -= 2 * codec.offset / codec.divisor * center[j];
+        norm += center[j] * center[j];
+        largest = std::max(largest, std::abs(exact[j]));
+      }
+      bias[c] += norm;
+      factor[c] = largest > 0.0 ? largest / INT16_CODES : 1.0;
+      margin[c] = QUANTIZE_ROUNDING * (norm_bound + norm);
+      int16_t *weight = &weights[c * width];
+      for (u32 j = 0; j < dims; j++) {
+        const ColumnCodec &codec = codecs[j];
+        int16_t w = std::nearbyint(exact[j] / factor[c]);
+        switch (codec.coding) {
+        case ColumnCoding::Int16:
+          weight[codec.slot] = weight[high + codec.slot] = w;
+          break;
+        case ColumnCoding::Int8:
+          weight[high + n16 + codec.slot] = w;
+          break;
+        case ColumnCoding::Bit:
+          weight[high + n16 + n8 + codec.slot] = w;
+          break;
+        default:
+          break;
+        }
+      }
+    }
+  }
+
+  size_t size() const { return num_centers; }
+
+  // Whether a row of these points can be scored without overflow.
+  static bool fits(const QuantizedPoints &points) {
+    return padded(points.dimensions() -
+                  points.count(ColumnCoding::Constant)) <= DOT_MAX_TERMS;
+  }
+
+  // 0-based index of the center nearest to the row, or -1 without centers.
+  int nearest(u64 row, Scratch &scratch) const {
+    if (!num_centers) {
+      return -1;
+    }
+    scratch.codes.assign(width, 0);
+    int16_t *codes = scratch.codes.data();
+    i64 magnitude = 0;
+    const int16_t *q16 = points.wide_row(row);
+    for (u32 s = 0; s < n16; s++) {
+      codes[s] = q16[s] >> 8;
+      codes[high + s] = q16[s] & 255;
+      magnitude += std::abs(q16[s]);
+    }
+    const int8_t *q8 = points.narrow_row(row);
+    for (u32 s = 0; s < n8; s++) {
+      codes[high + n16 + s] = q8[s];
+      magnitude += std::abs(q8[s]);
+    }
+    const u64 *words = points.bit_row(row);
+    for (u32 s = 0; s < nbits; s++) {
+      codes[high + n16 + n8 + s] = (words[s / 64] >> (s % 64)) & 1;
+      magnitude += codes[high + n16 + n8 + s];
+    }
+
+    scratch.score.resize(num_centers);
+    scratch.slack.resize(num_centers);
+    double *score = scratch.score.data(), *slack = scratch.slack.data();
+    double best = std::numeric_limits<double>::max();
+    size_t best_center = 0;
+    for (size_t c = 0; c < num_centers; c++) {
+      const int16_t *weight = &weights[c * width];
+      i64 dot = i64(dot_codes(codes, weight, high)) * 256 +
+                dot_codes(codes + high, weight + high, width - high);
+      score[c] = bias[c] - 2 * factor[c] * dot;
+      slack[c] = factor[c] * magnitude + margin[c];
+      if (score[c] + slack[c] < best) {
+        best = score[c] + slack[c];
+        best_center = c;
+      }
+    }
+    size_t candidates = 0;
+    for (size_t c = 0; c < num_centers && candidates < 2; c++) {
+      candidates += score[c] - slack[c] <= best;
+    }
+    if (candidates < 2) {
+      return best_center;
+    }
+
+    scratch.x.resize(dims);
+    points.decode(row, scratch.x.data());
+    double best_dist = std::numeric_limits<double>::max();
+    int nearest_center = -1;
+    for (size_t c = 0; c < num_centers; c++) {
+      if (score[c] - slack[c] > best) {
+        continue;
+      }
+      const double *center = &rows[c * dims];
+      double dist = 0.0;
+      for (u32 j = 0; j < dims; j++) {
+        double diff = scratch.x[j] - center[j];
+        dist += diff * diff;
+      }
+      if (dist < best_dist) {
+        best_dist = dist;
+        nearest_center = c;
+      }
+    }
+    return nearest_center;
+  }
+
+private:
+  const QuantizedPoints &points;
+  size_t num_centers;
+  u32 dims, n16, n8, nbits;
+  u32 high, width; // Codes of the high bytes, and of the whole padded row
+  std::vector<double> rows; // Exact centers, for candidates within the bounds
+  std::vector<double> bias, factor, margin;
+  std::vector<int16_t> weights; // One padded row per center
+
+  static u32 padded(u32 n) {
+    return (n + DOT_LANES - 1) / DOT_LANES * DOT_LANES;
+  }
+};
+
+#endif // PDSC_QUANTIZED_HPP
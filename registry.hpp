@@ -0,0 +1,90 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_REGISTRY_HPP
+#define PDSC_REGISTRY_HPP
+
+#include "algorithm.hpp"
+#include "birch.hpp"
+#include "clustream.hpp"
+#include "common.hpp"
+#include "denstream.hpp"
+#include "dstream.hpp"
+#include "edmstream.hpp"
+#include "slkmeans.hpp"
+#include "streamkm.hpp"
+#include "thread_pool.hpp"
+
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using Params = std::map<std::string, double>;
+
+// (name, title) of every algorithm, in benchmark order.
+inline const std::vector<std::pair<std::string, std::string>> ALGORITHMS = {
+    {"birch", "BIRCH"},         {"clustream", "CluStream"},
+    {"edmstream", "EDMStream"}, {"dstream", "DStream"},
+    {"denstream", "DenStream"}, {"slkmeans", "SLKMeans"},
+    {"streamkm", "StreamKM++"},
+};
+
+template <typename Config>
+Config make_config(const std::string &name, const Params &params) {
+  Config config;
+  for (const auto &[key, value] : params) {
+    if (!config.set(key, value)) {
+      throw std::invalid_argument("unknown parameter " + name + "." + key);
+    }
+  }
+  return config;
+}
+
+// Builds an algorithm by name with the given parameter overrides. k is used
+// by the k-means based algorithms only. Throws std::invalid_argument for an
+// unknown algorithm or parameter.
+inline std::unique_ptr<Algorithm> make_algorithm(const std::string &name,
+                                                 u32 dim, u32 k,
+                                                 const Params &params = {},
+                                                 ThreadPool *pool = nullptr) {
+  if (name == "birch") {
+    return std::make_unique<BIRCH>(dim, make_config<BIRCHConfig>(name, params));
+  } else if (name == "clustream") {
+    return std::make_unique<CluStream>(
+        dim, make_config<CluStreamConfig>(name, params));
+  } else if (name == "edmstream") {
+    return std::make_unique<EDMStream>(
+        dim, make_config<EDMStreamConfig>(name, params));
+  } else if (name == "dstream") {
+    return std::make_unique<DStream>(dim,
+                                     make_config<DStreamConfig>(name, params));
+  } else if (name == "denstream") {
+    return std::make_unique<DenStream>(
+        dim, make_config<DenStreamConfig>(name, params));
+  } else if (name == "slkmeans") {
+    return std::make_unique<SLKMeans>(
+        dim, k, make_config<SLKMeansConfig>(name, params), pool);
+  } else if (name == "streamkm") {
+    return std::make_unique<StreamKM>(
+        dim, k, make_config<StreamKMConfig>(name, params), pool);
+  }
+  throw std::invalid_argument("unknown algorithm " + name);
+}
+
+#endif // PDSC_REGISTRY_HPP
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_RING_WINDOW_HPP
+#define PDSC_RING_WINDOW_HPP
+
+#include "aligned_allocator.hpp"
+#include "common.hpp"
+#include "memory.hpp"
+#include "snapshot.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+// Fixed-capacity sliding window of feature rows in one aligned
+// capacity x dim array. Rows are written in place, so sliding never
+// allocates. Slots fill from 0 and are only recycled once the window is
+// full, so the occupied slots are always [0, size()): kernels that do not
+// care about age order scan data() as a single contiguous slab.
+class RingWindow {
+public:
+  RingWindow(size_t capacity, int dimensions)
+      : dimensions(dimensions), cap(capacity), rows(capacity * dimensions) {}
+
+  size_t size() const { return count; }
+  size_t capacity() const { return cap; }
+  bool full() const { return count == cap; }
+
+  // Slot of the oldest row, i.e. the one the next push() replaces when full.
+  size_t oldest() const { return full() ? head : 0; }
+
+  const double *data() const { return rows.data(); }
+  const double *row(size_t slot) const { return &rows[slot * dimensions]; }
+
+  // Appends a row, overwriting the oldest one when full. Returns its slot.
+  size_t push(const double *values) {
+    size_t slot = head;
+    std::copy(values, values + dimensions, &rows[slot * dimensions]);
+    head = head + 1 == cap ? 0 : head + 1;
+    count = std::min(count + 1, cap);
+    return slot;
+  }
+
+  // Drops to a smaller capacity, keeping the newest rows in age order.
+  void shrink(size_t capacity) {
+    if (capacity >= cap) {
+      return;
+    }
+    size_t n = std::min(count, capacity);
+    size_t first = (oldest() + count - n) % cap;
+    Rows kept(capacity * dimensions);
+    for (size_t i = 0; i < n; i++) {
+      const double *src = row((first + i) % cap);
+      std::copy(src, src + dimensions, &kept[i * dimensions]);
+    }
+    rows.swap(kept);
+    cap = capacity;
+    count = n;
+    head = n == cap ? 0 : n;
+  }
+
+  // Only the occupied slab is written; slot positions are preserved.
+  void snapshot(SnapshotWriter &out) const {
+    out.write<u64>(head);
+    out.write_array(rows.data(), count * dimensions);
+  }
+
+  void restore(SnapshotReader &in) {
+    head = in.read<u64>();
+    size_t n = in.read_bounded(rows.data(), cap * dimensions);
+    if (head >= cap || n % dimensions != 0) {
+      throw std::runtime_error("snapshot does not fit the window");
+    }
+    count = n / dimensions;
+  }
+
+private:
+  using Rows = tracked_vector<double, MemoryCategory::Points, CACHE_LINE>;
+
+  int dimensions;
+  size_t cap;
+  size_t head = 0; // Next slot to write
+  size_t count = 0;
+  Rows rows;
+};
+
+#endif // PDSC_RING_WINDOW_HPP
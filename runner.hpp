@@ -0,0 +1,843 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_RUNNER_HPP
+#define PDSC_RUNNER_HPP
+
+#include "algorithm.hpp"
+#include "center_publisher.hpp"
+#include "checkpoint.hpp"
+#include "common.hpp"
+#include "evaluation.hpp"
+#include "memory.hpp"
+#include "metrics.hpp"
+#include "perf_counters.hpp"
+#include "point.hpp"
+#include "prequential.hpp"
+#include "spsc_queue.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+const size_t PIPELINE_DEPTH = 8; // Batch buffers in flight between stages
+const u64 CHECKPOINT_INTERVAL = 10; // Batches between two checkpoints
+const size_t QUERY_STRIDE = 7919;   // Dataset points skipped between queries
+const int MAX_SHRINKS = 8; // shrink() calls per batch before giving up
+
+struct RunOptions {
+  u64 batch_size = BATCH_SIZE;
+  bool pipelined = false;      // Source and clustering on separate threads
+  bool perf = false;           // Hardware counters around the whole run
+  bool perf_per_batch = false; // ... and around every batch
+  std::string checkpoint_dir;  // Non-empty: checkpoint into this directory
+  u64 checkpoint_interval = CHECKPOINT_INTERVAL;
+  std::string restore_dir; // Non-empty: resume from a checkpoint in here
+  ThreadPool *pool = nullptr; // Parallelizes the final evaluation
+  bool prequential = false;    // Score each batch before clustering it
+  u32 query_threads = 0;       // Threads issuing assign() during ingestion
+  u64 memory_budget = 0; // Bytes of tracked state; 0 for no budget
+};
+
+// Checkpoint file of one algorithm inside a checkpoint directory.
+inline std::string snapshot_path(const std::string &dir,
+                                 const std::string &name) {
+  return dir + "/" + name + ".snapshot";
+}
+
+struct AlgorithmSpec {
+  std::string name;  // Used for output files, e.g. "birch"
+  std::string title; // Used for console output, e.g. "BIRCH"
+  std::function<std::unique_ptr<Algorithm>()> make;
+};
+
+struct RunResult {
+  std::string name, title;
+  std::chrono::milliseconds elapsed{0}; // Clustering time, see Recorder
+  u64 wall_ns = 0; // Start to end of the stream, evaluation included
+  std::vector<Point> centers;
+  u64 num_points = 0;
+  u64 batch_size = 0;
+  bool pipelined = false;
+  u64 source_stalls = 0; // Backpressure: no free buffer for the source
+  u64 cluster_stalls = 0; // Starvation: no ready batch for clustering
+  LatencyHistogram latency; // Nanoseconds per cluster() call
+  ThroughputTimeline timeline;
+  StatsBlock counters;                   // Totals, with final gauges
+  std::vector<StatsBlock> batch_counters; // Per-batch deltas
+  std::string perf_source; // Empty when perf counters were not requested
+  std::vector<std::string> perf_events;
+  std::vector<double> perf_totals;
+  std::vector<std::vector<double>> perf_batches;
+  u64 restored_from = 0; // Stream position of the restored checkpoint
+  u64 restore_bytes = 0;
+  u64 restore_ns = 0;
+  u64 checkpoints = 0, checkpoint_skips = 0;
+  u64 checkpoint_bytes = 0; // Size of the last checkpoint
+  u64 checkpoint_ns = 0;    // Serialization time on the ingest thread
+  std::vector<PrequentialSample> prequential;
+  u64 prequential_ns = 0; // Not part of the batch latencies
+  u64 snapshots = 0;        // Center snapshots published for queries
+  u64 publish_ns = 0;       // Ingest time spent publishing them
+  LatencyHistogram query_latency; // Nanoseconds per assign()
+  MemorySample memory;                      // At the end of the stream
+  std::vector<MemorySample> memory_timeline; // One per timeline sample
+  u64 shrinks = 0;
+  u64 shrink_ns = 0; // Not part of the batch latencies
+};
+
+// Measurement state of one run, living on the thread that calls cluster().
+class Recorder {
+public:
+  Recorder(RunResult &result, const RunOptions &options,
+           const MemoryTracker &memory)
+      : result(result), options(options), memory(memory) {
+    CycleClock::ns_per_cycle(); // Calibrate outside the timed loop
+    if (options.perf || options.perf_per_batch) {
+      perf = std::make_unique<PerfCounters>();
+      result.perf_source = perf->source();
+      result.perf_events = perf->events();
+    }
+    if (options.prequential) {
+      prequential =
+          std::make_unique<PrequentialEvaluator>(result.restored_from);
+    }
+  }
+
+  ~Recorder() { stopQueries(); }
+
+  // Starts options.query_threads threads that label dataset points through
+  // the latest published centers until end(). Centers are published after
+  // every batch.
+  void serve(const Dataset &dataset) {
+    if (!options.query_threads || !dataset.size()) {
+      return;
+    }
+    publisher = std::make_unique<CenterPublisher>();
+    query_latencies.resize(options.query_threads);
+    for (u32 t = 0; t < options.query_threads; t++) {
+      queries.emplace_back([this, &dataset, t] {
+        auto reader = publisher->reader();
+        LatencyHistogram &latency = query_latencies[t];
+        Point scratch(dataset.dim);
+        size_t i = t;
+        while (!stop.load(std::memory_order_relaxed)) {
+          const Point &point = dataset.at(i % dataset.size(), scratch);
+          u64 start = CycleClock::now();
+          Assignment assignment = reader.assign(point);
+          latency.record(CycleClock::to_ns(CycleClock::now() - start));
+          sink += assignment.cluster;
+          i += QUERY_STRIDE;
+        }
+      });
+    }
+  }
+
+  void begin() {
+    wall_start = std::chrono::high_resolution_clock::now();
+    run_start = CycleClock::now();
+    if (perf) {
+      perf->start();
+    }
+  }
+
+  // Times one cluster() call into the histogram, timeline and counters.
+  // Prequential scoring, publishing and shrinking run on the same thread
+  // but are kept out of all three and out of the elapsed time.
+  void cluster(Algorithm &algo, const std::vector<Point> &batch) {
+    if (prequential) {
+      StatsBlock saved = thread_stats;
+      u64 test_start = CycleClock::now();
+      prequential->test(algo, batch);
+      excluded += CycleClock::now() - test_start;
+      thread_stats = saved;
+    }
+    StatsBlock before = thread_stats;
+    std::vector<double> perf_before;
+    if (options.perf_per_batch) {
+      perf_before = perf->read();
+    }
+    u64 start = CycleClock::now();
+    algo.cluster(batch);
+    u64 end = CycleClock::now();
+    points_done += batch.size();
+    result.latency.record(CycleClock::to_ns(end - start));
+    result.timeline.record(points_done,
+                           CycleClock::to_ns(end - run_start - excluded),
+                           points_done == result.num_points);
+    if (options.perf_per_batch) {
+      std::vector<double> delta = perf->read();
+      for (size_t i = 0; i < delta.size(); i++) {
+        delta[i] -= perf_before[i];
+      }
+      result.perf_batches.push_back(std::move(delta));
+    }
+#if PDSC_STATS
+    StatsBlock delta = thread_stats.since(before);
+    result.counters.add(delta);
+    result.batch_counters.push_back(delta);
+#endif
+    if (prequential) {
+      prequential->account(CycleClock::to_ns(end - start));
+    }
+    if (options.memory_budget) {
+      enforceBudget(algo);
+    }
+    if (publisher) {
+      StatsBlock saved = thread_stats;
+      u64 publish_start = CycleClock::now();
+      publisher->publish(algo.output_centers());
+      result.publish_ns += CycleClock::to_ns(CycleClock::now() - publish_start);
+      thread_stats = saved;
+    }
+    if (result.timeline.get().size() > result.memory_timeline.size()) {
+      result.memory_timeline.push_back(memory.sample());
+    }
+    excluded += CycleClock::now() - end;
+  }
+
+  // Keeps other work on the clustering thread, such as checkpointing, out of
+  // the elapsed time.
+  void exclude(u64 cycles) { excluded += cycles; }
+
+  void end() {
+    if (perf) {
+      perf->stop();
+      result.perf_totals = perf->read();
+    }
+    if (prequential) {
+      result.prequential = prequential->samples();
+      result.prequential_ns = prequential->total_ns();
+    }
+    stopQueries();
+    for (const auto &latency : query_latencies) {
+      result.query_latency.merge(latency);
+    }
+    if (publisher) {
+      result.snapshots = publisher->published();
+    }
+    result.memory = memory.sample();
+    result.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::high_resolution_clock::now() - wall_start)
+                         .count();
+    u64 excluded_ns = std::min(result.wall_ns, CycleClock::to_ns(excluded));
+    result.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::nanoseconds(result.wall_ns - excluded_ns));
+  }
+
+private:
+  RunResult &result;
+  const RunOptions &options;
+  const MemoryTracker &memory;
+  std::unique_ptr<PerfCounters> perf;
+  std::unique_ptr<PrequentialEvaluator> prequential;
+  std::unique_ptr<CenterPublisher> publisher;
+  std::vector<std::thread> queries;
+  std::vector<LatencyHistogram> query_latencies; // One per query thread
+  std::atomic<bool> stop{false};
+  std::atomic<u64> sink{0}; // Keeps query results observable
+  std::chrono::high_resolution_clock::time_point wall_start;
+  u64 run_start = 0;
+  u64 excluded = 0; // Cycles on this thread that are not clustering
+  u64 points_done = 0;
+
+  // Lets the algorithm shrink until its state fits the budget again. Its
+  // counters are kept, but the time is not charged to the batch.
+  void enforceBudget(Algorithm &algo) {
+    u64 start = CycleClock::now();
+    i64 live = memory.bytes();
+    for (int i = 0; i < MAX_SHRINKS && live > i64(options.memory_budget);
+         i++) {
+      algo.shrink();
+      result.shrinks++;
+      i64 now = memory.bytes();
+      if (now >= live) {
+        break; // Nothing left to give up
+      }
+      live = now;
+    }
+    result.shrink_ns += CycleClock::to_ns(CycleClock::now() - start);
+  }
+
+  void stopQueries() {
+    stop = true;
+    for (auto &thread : queries) {
+      thread.join();
+    }
+    queries.clear();
+  }
+};
+
+// CPUs the process may run on, in ascending order; pinning to the i-th of
+// them stays inside a taskset or cpuset mask.
+inline std::vector<u32> allowed_cores() {
+  cpu_set_t set;
+  std::vector<u32> cores;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (u32 core = 0; core < CPU_SETSIZE; core++) {
+      if (CPU_ISSET(core, &set)) {
+        cores.push_back(core);
+      }
+    }
+  }
+  if (cores.empty()) {
+    u32 count = std::max(1u, std::thread::hardware_concurrency());
+    for (u32 core = 0; core < count; core++) {
+      cores.push_back(core);
+    }
+  }
+  return cores;
+}
+
+// Pins the calling thread to one core; returns false if the platform refused.
+inline bool pin_to_core(u32 core) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Pins the calling thread to one core for the lifetime of the object and
+// then restores the affinity it had. A negative core leaves it unpinned.
+class CorePin {
+public:
+  explicit CorePin(int core) {
+    pinned = core >= 0 &&
+             pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) ==
+                 0 &&
+             pin_to_core(core);
+  }
+  ~CorePin() {
+    if (pinned) {
+      pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    }
+  }
+  CorePin(const CorePin &) = delete;
+  CorePin &operator=(const CorePin &) = delete;
+
+private:
+  cpu_set_t saved;
+  bool pinned = false;
+};
+
+inline RunResult run(const AlgorithmSpec &spec, const Dataset &dataset,
+                     const RunOptions &options, bool show_progress) {
+  RunResult result{spec.name, spec.title};
+  result.batch_size = options.batch_size;
+  // Everything the algorithm allocates, including on restore and in its
+  // destructor, is charged to this run's tracker.
+  MemoryTracker memory;
+  MemoryScope scope(&memory);
+  auto algo = spec.make();
+  if (!options.restore_dir.empty()) {
+    try {
+      std::string buffer =
+          read_file(snapshot_path(options.restore_dir, spec.name));
+      u64 start = CycleClock::now();
+      result.restored_from =
+          std::min(restore_snapshot(*algo, buffer), dataset.num_points);
+      result.restore_ns = CycleClock::to_ns(CycleClock::now() - start);
+      result.restore_bytes = buffer.size();
+    } catch (const std::exception &e) {
+      std::cout << "Cannot restore " << spec.name << ": " << e.what()
+                << ", starting from the beginning" << std::endl;
+      algo = spec.make();
+    }
+  }
+  std::unique_ptr<Checkpointer> checkpointer;
+  if (!options.checkpoint_dir.empty()) {
+    checkpointer = std::make_unique<Checkpointer>(
+        snapshot_path(options.checkpoint_dir, spec.name));
+  }
+  result.num_points = dataset.num_points - result.restored_from;
+  Recorder recorder(result, options, memory);
+  recorder.serve(dataset);
+  recorder.begin();
+  u64 batches = 0;
+  std::vector<Point> batch;
+  for (u64 i = result.restored_from; i < dataset.num_points;
+       i += options.batch_size) {
+    u64 end = std::min(i + options.batch_size, dataset.num_points);
+    dataset.slice(i, end, batch);
+    recorder.cluster(*algo, batch);
+    if (checkpointer && ++batches % options.checkpoint_interval == 0) {
+      u64 start = CycleClock::now();
+      checkpointer->checkpoint(*algo, end);
+      recorder.exclude(CycleClock::now() - start);
+    }
+    if (show_progress) {
+      std::cout << "Progress: [" << (i + options.batch_size) << " / "
+                << dataset.num_points << "]\r";
+    }
+  }
+  if (show_progress) {
+    std::cout << std::endl;
+  }
+  recorder.end();
+  if (checkpointer) {
+    // A final checkpoint at the end of the stream, waited for.
+    checkpointer->wait();
+    checkpointer->checkpoint(*algo, dataset.num_points);
+    checkpointer->wait();
+    result.checkpoints = checkpointer->taken;
+    result.checkpoint_skips = checkpointer->skipped;
+    result.checkpoint_bytes = checkpointer->bytes;
+    result.checkpoint_ns = checkpointer->serialize_ns;
+    if (checkpointer->failed) {
+      std::cout << "Checkpoint failed: " << checkpointer->error << std::endl;
+    }
+  }
+  result.centers = algo->output_centers();
+  return result;
+}
+
+// Two-stage pipeline: a source thread copies the stream into recycled batch
+// buffers and hands them over a lock-free SPSC ring to the calling thread,
+// which clusters them. When all PIPELINE_DEPTH buffers are in flight the
+// source waits for clustering to return one, so a slow algorithm applies
+// backpressure instead of growing a queue. A core index < 0 leaves that
+// stage unpinned; the calling thread gets its own affinity back on return.
+inline RunResult run_pipelined(const AlgorithmSpec &spec,
+                               const Dataset &dataset,
+                               const RunOptions &options, int source_core,
+                               int cluster_core) {
+  RunResult result{spec.name, spec.title};
+  result.num_points = dataset.num_points;
+  result.batch_size = options.batch_size;
+  result.pipelined = true;
+  std::vector<std::vector<Point>> buffers(
+      PIPELINE_DEPTH,
+      std::vector<Point>(options.batch_size, Point(dataset.dim)));
+  SpscQueue<std::vector<Point> *> ready(PIPELINE_DEPTH + 1);
+  SpscQueue<std::vector<Point> *> recycled(PIPELINE_DEPTH);
+  for (auto &buffer : buffers) {
+    recycled.try_push(&buffer);
+  }
+  MemoryTracker memory;
+  MemoryScope scope(&memory);
+  auto algo = spec.make();
+  Recorder recorder(result, options, memory);
+
+  recorder.serve(dataset);
+  recorder.begin();
+  std::thread source([&] {
+    if (source_core >= 0) {
+      pin_to_core(source_core);
+    }
+    for (u64 i = 0; i < dataset.num_points; i += options.batch_size) {
+      u64 end = std::min(i + options.batch_size, dataset.num_points);
+      std::vector<Point> *batch;
+      if (!recycled.try_pop(batch)) {
+        result.source_stalls++;
+        while (!recycled.try_pop(batch)) {
+          std::this_thread::yield();
+        }
+      }
+      // Copying or decoding into the recycled Points reuses their storage.
+      dataset.slice(i, end, *batch);
+      while (!ready.try_push(batch)) {
+        std::this_thread::yield();
+      }
+    }
+    while (!ready.try_push(nullptr)) {
+      std::this_thread::yield();
+    }
+  });
+
+  // Pinned only now, so that the source and query threads do not inherit
+  // the cluster core.
+  CorePin pin(cluster_core);
+  while (true) {
+    std::vector<Point> *batch;
+    if (!ready.try_pop(batch)) {
+      result.cluster_stalls++;
+      while (!ready.try_pop(batch)) {
+        std::this_thread::yield();
+      }
+    }
+    if (!batch) {
+      break;
+    }
+    recorder.cluster(*algo, *batch);
+    while (!recycled.try_push(batch)) {
+      std::this_thread::yield();
+    }
+  }
+  recorder.end();
+  source.join();
+  result.centers = algo->output_centers();
+  return result;
+}
+
+// Writes <name>.latency.json (batch latency histogram) and
+// <name>.timeline.csv (throughput and memory per THROUGHPUT_WINDOW points).
+inline void write_metrics(const RunResult &result) {
+  const auto &latency = result.latency;
+  std::ofstream json(result.name + ".latency.json");
+  json << "{\n";
+  json << "  \"algorithm\": \"" << result.name << "\",\n";
+  json << "  \"points\": " << result.num_points << ",\n";
+  json << "  \"elapsed_ms\": " << result.elapsed.count() << ",\n";
+  json << "  \"batch_size\": " << result.batch_size << ",\n";
+  json << "  \"batch_latency_ns\": {\n";
+  json << "    \"count\": " << latency.count() << ",\n";
+  json << "    \"mean\": " << latency.mean() << ",\n";
+  json << "    \"p50\": " << latency.percentile(50) << ",\n";
+  json << "    \"p99\": " << latency.percentile(99) << ",\n";
+  json << "    \"p999\": " << latency.percentile(99.9) << ",\n";
+  json << "    \"max\": " << latency.max() << ",\n";
+  json << "    \"buckets\": ";
+  latency.write_buckets(json);
+  json << "\n  }";
+#if PDSC_STATS
+  json << ",\n  \"counters\": {\n";
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    json << "    \"" << COUNTER_NAMES[i]
+         << "\": " << result.counters.counters[i] << ",\n";
+  }
+  for (int i = 0; i < NUM_GAUGES; i++) {
+    json << "    \"" << GAUGE_NAMES[i] << "\": " << result.counters.gauges[i]
+         << (i + 1 < NUM_GAUGES ? ",\n" : "\n");
+  }
+  json << "  }";
+
+  // <name>.counters.csv: one row of counter deltas and gauges per batch.
+  std::ofstream counters(result.name + ".counters.csv");
+  counters << "batch";
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    counters << "," << COUNTER_NAMES[i];
+  }
+  for (int i = 0; i < NUM_GAUGES; i++) {
+    counters << "," << GAUGE_NAMES[i];
+  }
+  counters << "\n";
+  for (size_t b = 0; b < result.batch_counters.size(); b++) {
+    counters << b;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+      counters << "," << result.batch_counters[b].counters[i];
+    }
+    for (int i = 0; i < NUM_GAUGES; i++) {
+      counters << "," << result.batch_counters[b].gauges[i];
+    }
+    counters << "\n";
+  }
+#endif
+  if (!result.perf_source.empty()) {
+    json << ",\n  \"perf\": {\n";
+    json << "    \"source\": \"" << result.perf_source << "\"";
+    for (size_t i = 0; i < result.perf_events.size(); i++) {
+      json << ",\n    \"" << result.perf_events[i]
+           << "\": " << (u64)result.perf_totals[i];
+    }
+    json << "\n  }";
+  }
+  json << "\n}\n";
+
+  if (!result.perf_batches.empty()) {
+    std::ofstream perf(result.name + ".perf.csv");
+    perf << "batch";
+    for (const auto &event : result.perf_events) {
+      perf << "," << event;
+    }
+    perf << "\n";
+    for (size_t b = 0; b < result.perf_batches.size(); b++) {
+      perf << b;
+      for (double value : result.perf_batches[b]) {
+        perf << "," << (u64)value;
+      }
+      perf << "\n";
+    }
+  }
+
+  // Memory columns are bytes: the tracked state live at the sample, its
+  // peak so far, the live bytes by category and the process RSS.
+  std::ofstream csv(result.name + ".timeline.csv");
+  csv << "points,elapsed_ms,points_per_sec,live_bytes,peak_bytes";
+  for (int i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+    csv << "," << MEMORY_CATEGORY_NAMES[i] << "_bytes";
+  }
+  csv << ",rss_bytes\n";
+  const auto &timeline = result.timeline.get();
+  for (size_t t = 0; t < timeline.size(); t++) {
+    const auto &sample = timeline[t];
+    const auto &memory = result.memory_timeline[t];
+    csv << sample.points << "," << sample.elapsed_ns / 1e6 << ","
+        << sample.points_per_sec << "," << memory.live << "," << memory.peak;
+    for (int i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+      csv << "," << memory.categories[i];
+    }
+    csv << "," << memory.rss << "\n";
+  }
+
+  if (!result.prequential.empty()) {
+    std::ofstream prequential(result.name + ".prequential.csv");
+    prequential << "position,scored,purity,nmi,ari,eval_us,stride,"
+                   "refresh_interval\n";
+    for (const auto &sample : result.prequential) {
+      prequential << sample.position << "," << sample.scored << ","
+                  << sample.quality.purity << "," << sample.quality.nmi << ","
+                  << sample.quality.ari << "," << sample.eval_ns / 1e3 << ","
+                  << sample.stride << "," << sample.refresh_interval << "\n";
+    }
+  }
+}
+
+// Quality of the dataset grouped by `centers`; NaN scores without centers.
+inline Quality compute_quality(const Dataset &dataset,
+                               const std::vector<Point> &centers,
+                               ThreadPool *pool = nullptr) {
+  if (centers.empty()) {
+    return {};
+  }
+  return evaluate_quality(dataset.labels(),
+                          group_by_centers(dataset, centers, pool));
+}
+
+inline void report(const RunResult &result, const Dataset &dataset,
+                   ThreadPool *pool = nullptr) {
+  std::cout << "Execution time: " << result.elapsed.count() << " ms"
+            << std::endl;
+  std::cout << "Throughput: "
+            << result.num_points * 1000.0 /
+                   std::max<long>(1, result.elapsed.count())
+            << " points/s" << std::endl;
+  if (result.pipelined) {
+    std::cout << "Pipeline stalls: source " << result.source_stalls
+              << ", cluster " << result.cluster_stalls << std::endl;
+  }
+  if (result.restore_bytes) {
+    std::cout << "Restored at point " << result.restored_from << ": "
+              << result.restore_bytes << " bytes in "
+              << result.restore_ns / 1e6 << " ms ("
+              << result.restore_bytes / std::max<double>(1, result.restore_ns)
+              << " GB/s)" << std::endl;
+  }
+  if (result.checkpoints) {
+    std::cout << "Checkpoints: " << result.checkpoints << " of "
+              << result.checkpoint_bytes << " bytes, serialization "
+              << result.checkpoint_ns / 1e6 << " ms in total, "
+              << result.checkpoint_skips << " skipped while writing"
+              << std::endl;
+  }
+  if (!result.prequential.empty()) {
+    Quality mean{0.0, 0.0, 0.0};
+    for (const auto &sample : result.prequential) {
+      mean.purity += sample.quality.purity;
+      mean.nmi += sample.quality.nmi;
+      mean.ari += sample.quality.ari;
+    }
+    double n = result.prequential.size();
+    double cluster_ns = result.latency.mean() * result.latency.count();
+    std::cout << "Prequential (windowed mean over " << n
+              << " batches): purity " << mean.purity / n << ", NMI "
+              << mean.nmi / n << ", ARI " << mean.ari / n << std::endl;
+    std::cout << "Prequential overhead: " << result.prequential_ns / 1e6
+              << " ms, " << 100.0 * result.prequential_ns /
+                                std::max(1.0, cluster_ns)
+              << "% of clustering time" << std::endl;
+  }
+  if (result.query_latency.count()) {
+    const auto &queries = result.query_latency;
+    std::cout << "Queries: " << queries.count() << " ("
+              << queries.count() * 1e9 / std::max<u64>(1, result.wall_ns)
+              << " per second), latency (ns): p50 " << queries.percentile(50)
+              << ", p99 " << queries.percentile(99) << ", max "
+              << queries.max() << std::endl;
+    std::cout << "Center snapshots: " << result.snapshots << ", publishing "
+              << result.publish_ns / 1e6 << " ms" << std::endl;
+  }
+  const auto &memory = result.memory;
+  std::cout << "Memory (MB): live " << memory.live / 1e6 << " (";
+  for (int i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+    std::cout << (i ? ", " : "") << MEMORY_CATEGORY_NAMES[i] << " "
+              << memory.categories[i] / 1e6;
+  }
+  std::cout << "), peak " << memory.peak / 1e6 << ", process RSS "
+            << memory.rss / 1e6 << std::endl;
+  if (result.shrinks) {
+    std::cout << "Shrinks to fit the memory budget: " << result.shrinks
+              << ", " << result.shrink_ns / 1e6 << " ms" << std::endl;
+  }
+  const auto &latency = result.latency;
+  std::cout << "Batch latency (us): p50 " << latency.percentile(50) / 1e3
+            << ", p99 " << latency.percentile(99) / 1e3 << ", p99.9 "
+            << latency.percentile(99.9) / 1e3 << ", max "
+            << latency.max() / 1e3 << std::endl;
+#if PDSC_STATS
+  std::cout << "Counters:";
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (result.counters.counters[i]) {
+      std::cout << " " << COUNTER_NAMES[i] << "="
+                << result.counters.counters[i];
+    }
+  }
+  std::cout << " state_size=" << result.counters[Gauge::StateSize]
+            << std::endl;
+  std::cout << "Distance calls per point: "
+            << (double)result.counters[Counter::DistanceCalls] /
+                   std::max<u64>(1, result.num_points)
+            << std::endl;
+#endif
+  if (!result.perf_source.empty()) {
+    std::cout << "Perf counters (" << result.perf_source << "):";
+    double cycles = 0, instructions = 0;
+    for (size_t i = 0; i < result.perf_events.size(); i++) {
+      std::cout << " " << result.perf_events[i] << "="
+                << (u64)result.perf_totals[i];
+      if (result.perf_events[i] == "cycles") {
+        cycles = result.perf_totals[i];
+      } else if (result.perf_events[i] == "instructions") {
+        instructions = result.perf_totals[i];
+      }
+    }
+    std::cout << std::endl;
+    if (cycles > 0) {
+      std::cout << "IPC: " << instructions / cycles << ", cycles per point: "
+                << cycles / std::max<u64>(1, result.num_points) << std::endl;
+    }
+  }
+  write_metrics(result);
+  const auto &centers = result.centers;
+  std::cout << "Number of clusters: " << centers.size() << std::endl;
+  // save centers to file
+  std::ofstream out(result.name + ".centers");
+  for (const auto &center : centers) {
+    for (int i = 0; i < center.features.size(); i++) {
+      out << center.features[i] << " ";
+    }
+    out << std::endl;
+  }
+  out.close();
+  auto eval_start = std::chrono::high_resolution_clock::now();
+  Quality quality = compute_quality(dataset, centers, pool);
+  auto eval_end = std::chrono::high_resolution_clock::now();
+  if (!std::isnan(quality.purity)) {
+    std::cout << "Purity: " << quality.purity << ", NMI: " << quality.nmi
+              << ", ARI: " << quality.ari << " (evaluated in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     eval_end - eval_start)
+                     .count()
+              << " ms)" << std::endl;
+  } else {
+    std::cout << "Purity: N/A, please check code correctness" << std::endl;
+  }
+}
+
+inline void print_header(const AlgorithmSpec &spec) {
+  std::cout << "==============================" << std::endl;
+  std::cout << "Running " << spec.title << " ..." << std::endl;
+}
+
+// Runs the algorithms one after another, so each timing is free of
+// interference from the others.
+inline void run_serial(const std::vector<AlgorithmSpec> &specs,
+                       const Dataset &dataset, const RunOptions &options) {
+  std::vector<u32> cores = allowed_cores();
+  for (const auto &spec : specs) {
+    print_header(spec);
+    if (options.pipelined) {
+      report(run_pipelined(spec, dataset, options, cores[1 % cores.size()],
+                           cores[0]),
+             dataset, options.pool);
+    } else {
+      report(run(spec, dataset, options, true), dataset, options.pool);
+    }
+  }
+}
+
+// Runs every algorithm on its own thread pinned to its own core over the
+// shared, read-only dataset. Each run is timed on its own thread; results
+// are reported in spec order once all have finished.
+inline void run_concurrent(const std::vector<AlgorithmSpec> &specs,
+                           const Dataset &dataset, const RunOptions &options) {
+  std::vector<u32> cores = allowed_cores();
+  u32 needed = specs.size() * (options.pipelined ? 2 : 1);
+  if (cores.size() < needed) {
+    std::cout << "Warning: " << needed << " threads share " << cores.size()
+              << " cores, timings will interfere" << std::endl;
+  }
+  std::vector<RunResult> results(specs.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < specs.size(); i++) {
+    threads.emplace_back([&, i] {
+      if (options.pipelined) {
+        results[i] = run_pipelined(specs[i], dataset, options,
+                                   cores[(2 * i + 1) % cores.size()],
+                                   cores[(2 * i) % cores.size()]);
+      } else {
+        pin_to_core(cores[i % cores.size()]);
+        results[i] = run(specs[i], dataset, options, false);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < specs.size(); i++) {
+    print_header(specs[i]);
+    report(results[i], dataset, options.pool);
+  }
+}
+
+// Runs each spec and its parallel variant one after another, reporting the
+// variant in full and its speedup and purity change against the spec.
+inline void run_against_baseline(const std::vector<AlgorithmSpec> &baselines,
+                                 const std::vector<AlgorithmSpec> &variants,
+                                 const Dataset &dataset,
+                                 const RunOptions &options) {
+  for (size_t i = 0; i < variants.size(); i++) {
+    print_header(variants[i]);
+    RunResult baseline = run(baselines[i], dataset, options, false);
+    RunResult result = run(variants[i], dataset, options, true);
+    report(result, dataset, options.pool);
+    double base_purity =
+        compute_quality(dataset, baseline.centers, options.pool).purity;
+    double purity =
+        compute_quality(dataset, result.centers, options.pool).purity;
+    std::cout << "Baseline " << baselines[i].title << ": "
+              << baseline.elapsed.count() << " ms, "
+              << baseline.centers.size() << " clusters, purity ";
+    if (std::isnan(base_purity)) {
+      std::cout << "N/A";
+    } else {
+      std::cout << base_purity;
+    }
+    std::cout << std::endl;
+    std::cout << "Speedup: "
+              << (double)baseline.elapsed.count() /
+                     std::max<long>(1, result.elapsed.count())
+              << "x, purity delta: ";
+    if (std::isnan(base_purity) || std::isnan(purity)) {
+      std::cout << "N/A";
+    } else {
+      std::cout << purity - base_purity;
+    }
+    std::cout << std::endl;
+  }
+}
+
+#endif // PDSC_RUNNER_HPP
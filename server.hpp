@@ -0,0 +1,515 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_SERVER_HPP
+#define PDSC_SERVER_HPP
+
+#include "algorithm.hpp"
+#include "center_publisher.hpp"
+#include "common.hpp"
+#include "point.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <limits.h>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// Wire protocol, host-endian like snapshots since both ends share a machine.
+// Every frame is a u32 length of what follows, a u8 kind and a payload:
+//   Batch     u32 count, u32 dims, count x {u64 timestamp, f64 x[dims]}
+//   Centers   (empty)
+//   Assign    u32 count, u32 dims, count x f64 x[dims]
+//   Shutdown  (empty)
+// Batches are not answered. Centers is answered by a Centers frame of
+// u32 count, u32 dims, count x f64 x[dims]; Assign by an Assign frame of
+// u32 count, count x i32 center (-1 without centers), count x f64 distance.
+// A malformed frame is answered by an Error frame holding a message, and
+// the connection is closed.
+enum class FrameKind : uint8_t {
+  Batch = 1,
+  Centers,
+  Assign,
+  Shutdown,
+  Error = 255
+};
+
+const u32 MAX_FRAME_POINTS = 1 << 20; // Points in one batch or assign frame
+const u32 MAX_FRAME_DIMS = 1 << 16;
+
+// Blocking I/O on a file descriptor that retries short transfers, and
+// retries EINTR unless `stop` has been set by a signal handler. Reads
+// return false on end of input before the first byte.
+class FrameChannel {
+public:
+  FrameChannel(int in_fd, int out_fd,
+               const volatile sig_atomic_t *stop = nullptr)
+      : in_fd(in_fd), out_fd(out_fd), stop(stop) {}
+
+  bool read(void *data, size_t n) {
+    iovec iov{data, n};
+    return readv(&iov, 1);
+  }
+
+  template <typename T> bool read(T &value) { return read(&value, sizeof(T)); }
+
+  // Scatters the input straight into the given buffers.
+  bool readv(iovec *iov, int count) {
+    bool started = false;
+    while (count > 0) {
+      ssize_t got = ::readv(in_fd, iov, std::min(count, IOV_MAX));
+      if (got < 0 && errno == EINTR && !stopped()) {
+        continue;
+      }
+      if (got < 0) {
+        throw std::runtime_error(std::string("read: ") + std::strerror(errno));
+      }
+      if (got == 0) {
+        if (started) {
+          throw std::runtime_error("connection closed inside a frame");
+        }
+        return false;
+      }
+      started = true;
+      bytes_in += got;
+      advance(iov, count, got);
+    }
+    return true;
+  }
+
+  void write(const void *data, size_t n) {
+    iovec iov{const_cast<void *>(data), n};
+    writev(&iov, 1);
+  }
+
+  template <typename T> void write(const T &value) {
+    write(&value, sizeof(T));
+  }
+
+  void writev(iovec *iov, int count) {
+    while (count > 0) {
+      ssize_t put = ::writev(out_fd, iov, std::min(count, IOV_MAX));
+      if (put < 0 && errno == EINTR && !stopped()) {
+        continue;
+      }
+      if (put < 0) {
+        throw std::runtime_error(std::string("write: ") +
+                                 std::strerror(errno));
+      }
+      bytes_out += put;
+      advance(iov, count, put);
+    }
+  }
+
+  // Opens a frame of `length` payload bytes.
+  void begin_frame(FrameKind kind, u64 length) {
+    if (length + 1 > std::numeric_limits<u32>::max()) {
+      throw std::runtime_error("frame too large");
+    }
+    write<u32>(length + 1);
+    write(kind);
+  }
+
+  u64 bytes_in = 0, bytes_out = 0;
+
+private:
+  int in_fd, out_fd;
+  const volatile sig_atomic_t *stop;
+
+  bool stopped() const { return stop && *stop; }
+
+  static void advance(iovec *&iov, int &count, size_t n) {
+    while (count > 0 && n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+};
+
+struct ServerStats {
+  u64 connections = 0, batches = 0, points = 0, queries = 0;
+  u64 bytes_in = 0, bytes_out = 0;
+};
+
+// Feeds batches from a stream of frames to one algorithm and answers
+// center and assignment queries in between, in arrival order. The
+// algorithm is made on the first batch, once the dimensionality is known.
+// Batch records are read straight into the features of a recycled batch,
+// so steady-state ingestion copies nothing and allocates nothing.
+class IngestServer {
+public:
+  using Factory = std::function<std::unique_ptr<Algorithm>(u32 dims)>;
+
+  // A signal handler setting `stop` ends serving at the next frame.
+  explicit IngestServer(Factory make,
+                        const volatile sig_atomic_t *stop = nullptr)
+      : make(std::move(make)), stop(stop) {}
+
+  // Serves frames from in_fd, answering on out_fd, until the input ends or
+  // a Shutdown frame arrives. Returns false after a Shutdown frame or once
+  // stopped. Protocol errors are answered and end the connection; I/O
+  // errors end it silently.
+  bool serve(int in_fd, int out_fd) {
+    FrameChannel channel(in_fd, out_fd, stop);
+    stats.connections++;
+    bool keep_running = true;
+    try {
+      keep_running = serveFrames(channel);
+    } catch (const std::invalid_argument &e) {
+      try {
+        sendError(channel, e.what());
+      } catch (const std::runtime_error &) {
+      }
+    } catch (const std::runtime_error &) {
+    }
+    stats.bytes_in += channel.bytes_in;
+    stats.bytes_out += channel.bytes_out;
+    return keep_running && !stopped();
+  }
+
+  // Accepts connections on a Unix domain socket at `path` one after another
+  // until a client sends Shutdown or the server is stopped.
+  void serve_socket(const std::string &path) {
+    int listener = listen_unix(path);
+    while (!stopped()) {
+      int client = ::accept(listener, nullptr, nullptr);
+      if (client < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        ::close(listener);
+        ::unlink(path.c_str());
+        throw std::runtime_error(std::string("accept: ") +
+                                 std::strerror(errno));
+      }
+      bool keep_running = serve(client, client);
+      ::close(client);
+      if (!keep_running) {
+        break;
+      }
+    }
+    ::close(listener);
+    ::unlink(path.c_str());
+  }
+
+  const ServerStats &statistics() const { return stats; }
+  Algorithm *algorithm() { return algo.get(); }
+
+private:
+  Factory make;
+  const volatile sig_atomic_t *stop;
+  std::unique_ptr<Algorithm> algo;
+  u32 dims = 0;
+  std::vector<Point> batch;
+  std::vector<iovec> iov;
+  std::unique_ptr<CenterSnapshot> centers; // Null when stale
+  ServerStats stats;
+
+  bool stopped() const { return stop && *stop; }
+
+  bool serveFrames(FrameChannel &channel) {
+    while (!stopped()) {
+      u32 length;
+      FrameKind kind;
+      if (!channel.read(length)) {
+        return true;
+      }
+      if (length == 0 || !channel.read(kind)) {
+        throw std::invalid_argument("empty frame");
+      }
+      u64 payload = length - 1;
+      switch (kind) {
+      case FrameKind::Batch:
+        readBatch(channel, payload);
+        break;
+      case FrameKind::Centers:
+        expectEmpty(payload);
+        sendCenters(channel);
+        break;
+      case FrameKind::Assign:
+        answerAssign(channel, payload);
+        break;
+      case FrameKind::Shutdown:
+        expectEmpty(payload);
+        return false;
+      default:
+        throw std::invalid_argument("unknown frame kind " +
+                                    std::to_string(static_cast<int>(kind)));
+      }
+    }
+    return false;
+  }
+
+  static void expectEmpty(u64 payload) {
+    if (payload != 0) {
+      throw std::invalid_argument("unexpected frame payload");
+    }
+  }
+
+  // Reads and checks the count and dims of a point frame whose records are
+  // `record` bytes plus dims doubles each.
+  std::pair<u32, u32> readShape(FrameChannel &channel, u64 payload,
+                                u64 record) {
+    u32 count, frame_dims;
+    if (payload < 2 * sizeof(u32) || !channel.read(count) ||
+        !channel.read(frame_dims)) {
+      throw std::invalid_argument("truncated frame header");
+    }
+    if (count > MAX_FRAME_POINTS || frame_dims == 0 ||
+        frame_dims > MAX_FRAME_DIMS) {
+      throw std::invalid_argument("frame shape out of range");
+    }
+    if (dims != 0 && frame_dims != dims) {
+      throw std::invalid_argument("expected " + std::to_string(dims) +
+                                  " dimensions, got " +
+                                  std::to_string(frame_dims));
+    }
+    if (payload != 2 * sizeof(u32) + count * (record + frame_dims * 8ull)) {
+      throw std::invalid_argument("frame length does not match its shape");
+    }
+    return {count, frame_dims};
+  }
+
+  void readBatch(FrameChannel &channel, u64 payload) {
+    auto [count, frame_dims] = readShape(channel, payload, sizeof(u64));
+    if (!algo) {
+      dims = frame_dims;
+      algo = make(dims);
+    }
+    batch.resize(count, Point(dims));
+    iov.resize(2 * count);
+    for (u32 i = 0; i < count; i++) {
+      iov[2 * i] = {&batch[i].timestamp, sizeof(u64)};
+      iov[2 * i + 1] = {batch[i].features.data(), dims * sizeof(double)};
+    }
+    if (!channel.readv(iov.data(), iov.size())) {
+      throw std::runtime_error("connection closed inside a frame");
+    }
+    algo->cluster(batch);
+    centers.reset();
+    stats.batches++;
+    stats.points += count;
+  }
+
+  const CenterSnapshot &currentCenters() {
+    if (!centers) {
+      centers = std::make_unique<CenterSnapshot>(
+          algo ? algo->centers() : std::vector<Point>(), stats.batches);
+    }
+    return *centers;
+  }
+
+  void sendCenters(FrameChannel &channel) {
+    const CenterSnapshot &snapshot = currentCenters();
+    u32 count = snapshot.centers.size();
+    std::vector<iovec> out;
+    channel.begin_frame(FrameKind::Centers,
+                        2 * sizeof(u32) + count * dims * sizeof(double));
+    channel.write(count);
+    channel.write(dims);
+    for (const Point &center : snapshot.centers) {
+      out.push_back({const_cast<double *>(center.features.data()),
+                     dims * sizeof(double)});
+    }
+    channel.writev(out.data(), out.size());
+    stats.queries++;
+  }
+
+  void answerAssign(FrameChannel &channel, u64 payload) {
+    auto [count, frame_dims] = readShape(channel, payload, 0);
+    std::vector<double> rows(u64(count) * frame_dims);
+    if (!channel.read(rows.data(), rows.size() * sizeof(double))) {
+      throw std::runtime_error("connection closed inside a frame");
+    }
+    const CenterSnapshot &snapshot = currentCenters();
+    std::vector<int> labels(count);
+    std::vector<double> distances(count);
+    for (u32 i = 0; i < count; i++) {
+      double dist2 = 0.0;
+      labels[i] = snapshot.assigner.nearest(&rows[u64(i) * frame_dims], dist2);
+      distances[i] = labels[i] < 0 ? 0.0 : std::sqrt(dist2);
+    }
+    channel.begin_frame(FrameKind::Assign,
+                        sizeof(u32) + count * (sizeof(int) + sizeof(double)));
+    channel.write(count);
+    iovec out[2] = {{labels.data(), count * sizeof(int)},
+                    {distances.data(), count * sizeof(double)}};
+    channel.writev(out, 2);
+    stats.queries++;
+  }
+
+  static void sendError(FrameChannel &channel, const std::string &message) {
+    channel.begin_frame(FrameKind::Error, message.size());
+    channel.write(message.data(), message.size());
+  }
+
+  static sockaddr_un socketAddress(const std::string &path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+      throw std::invalid_argument("socket path too long: " + path);
+    }
+    std::strcpy(address.sun_path, path.c_str());
+    return address;
+  }
+
+public:
+  // A listening socket at `path`, replacing a stale socket file.
+  static int listen_unix(const std::string &path) {
+    sockaddr_un address = socketAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+    }
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) <
+            0 ||
+        ::listen(fd, 16) < 0) {
+      int error = errno;
+      ::close(fd);
+      throw std::runtime_error("cannot listen on " + path + ": " +
+                               std::strerror(error));
+    }
+    return fd;
+  }
+
+  static int connect_unix(const std::string &path) {
+    sockaddr_un address = socketAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&address),
+                  sizeof(address)) < 0) {
+      int error = errno;
+      ::close(fd);
+      throw std::runtime_error("cannot connect to " + path + ": " +
+                               std::strerror(error));
+    }
+    return fd;
+  }
+};
+
+// Client side of the protocol over a connected socket, or over a pipe into
+// a server on stdin when only batches are sent.
+class IngestClient {
+public:
+  IngestClient(int in_fd, int out_fd) : channel(in_fd, out_fd) {}
+
+  // Sends points [begin, end) as one batch.
+  void send_batch(const std::vector<Point> &points, size_t begin, size_t end) {
+    u32 count = end - begin;
+    u32 dims = count ? points[begin].features.size() : 0;
+    channel.begin_frame(FrameKind::Batch,
+                        2 * sizeof(u32) +
+                            count * (sizeof(u64) + dims * sizeof(double)));
+    channel.write(count);
+    channel.write(dims);
+    iov.resize(2 * count);
+    for (u32 i = 0; i < count; i++) {
+      const Point &p = points[begin + i];
+      iov[2 * i] = {const_cast<u64 *>(&p.timestamp), sizeof(u64)};
+      iov[2 * i + 1] = {const_cast<double *>(p.features.data()),
+                        dims * sizeof(double)};
+    }
+    channel.writev(iov.data(), iov.size());
+  }
+
+  std::vector<Point> centers() {
+    channel.begin_frame(FrameKind::Centers, 0);
+    expectReply(FrameKind::Centers);
+    u32 count, dims;
+    channel.read(count);
+    channel.read(dims);
+    std::vector<Point> result(count, Point(dims));
+    for (Point &center : result) {
+      channel.read(center.features.data(), dims * sizeof(double));
+    }
+    return result;
+  }
+
+  // Index of the nearest center of each of points [begin, end), -1 without
+  // centers; distances are stored if requested.
+  std::vector<int> assign(const std::vector<Point> &points, size_t begin,
+                          size_t end,
+                          std::vector<double> *distances = nullptr) {
+    u32 count = end - begin;
+    u32 dims = count ? points[begin].features.size() : 0;
+    channel.begin_frame(FrameKind::Assign,
+                        2 * sizeof(u32) + count * dims * sizeof(double));
+    channel.write(count);
+    channel.write(dims);
+    iov.resize(count);
+    for (u32 i = 0; i < count; i++) {
+      iov[i] = {const_cast<double *>(points[begin + i].features.data()),
+                dims * sizeof(double)};
+    }
+    channel.writev(iov.data(), iov.size());
+    expectReply(FrameKind::Assign);
+    u32 answered;
+    channel.read(answered);
+    std::vector<int> labels(answered);
+    std::vector<double> dist(answered);
+    channel.read(labels.data(), answered * sizeof(int));
+    channel.read(dist.data(), answered * sizeof(double));
+    if (distances) {
+      *distances = std::move(dist);
+    }
+    return labels;
+  }
+
+  void shutdown() { channel.begin_frame(FrameKind::Shutdown, 0); }
+
+  u64 bytes_sent() const { return channel.bytes_out; }
+
+private:
+  FrameChannel channel;
+  std::vector<iovec> iov;
+
+  void expectReply(FrameKind expected) {
+    u32 length;
+    FrameKind kind;
+    if (!channel.read(length) || length == 0 || !channel.read(kind)) {
+      throw std::runtime_error("server closed the connection");
+    }
+    if (kind == FrameKind::Error) {
+      std::string message(length - 1, '\0');
+      channel.read(message.data(), message.size());
+      throw std::runtime_error("server: " + message);
+    }
+    if (kind != expected) {
+      throw std::runtime_error("unexpected reply from server");
+    }
+  }
+};
+
+#endif // PDSC_SERVER_HPP
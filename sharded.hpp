@@ -0,0 +1,190 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_SHARDED_HPP
+#define PDSC_SHARDED_HPP
+
+#include "algorithm.hpp"
+#include "common.hpp"
+#include "memory.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+const int MERGE_INTERVAL = 10; // Batches between two merges of the shards
+
+enum class Partition {
+  RoundRobin,  // Point i goes to shard i mod N
+  SpatialHash, // Points in the same grid cell go to the same shard
+};
+
+struct ShardingConfig {
+  u32 shards = 2;
+  Partition partition = Partition::RoundRobin;
+  int merge_interval = MERGE_INTERVAL; // 0 merges only on demand
+  double hash_cell = 1000.0; // Grid width of the spatial hash
+  int hash_dims = 4;         // Leading features hashed
+};
+
+// Data-parallel wrapper: every batch is split across N independent
+// instances of one algorithm, which cluster their parts concurrently. The
+// instances' summaries are merged into a fresh coordinator instance every
+// merge_interval batches and whenever centers are requested.
+class ShardedAlgorithm : public Algorithm {
+public:
+  using Factory = std::function<std::unique_ptr<Algorithm>()>;
+
+  ShardedAlgorithm(Factory make, const ShardingConfig &config)
+      : make(std::move(make)), config(config), pool(config.shards - 1),
+        parts(config.shards), shard_stats(config.shards) {
+    for (u32 s = 0; s < config.shards; s++) {
+      shards.push_back(this->make());
+    }
+  }
+
+  void cluster(const std::vector<Point> &points) {
+    for (auto &part : parts) {
+      part.clear();
+    }
+    for (size_t i = 0; i < points.size(); i++) {
+      parts[shardOf(points[i])].push_back(points[i]);
+    }
+
+    // Each shard's counters are captured on whichever thread ran it, then
+    // folded into the caller's block so the runner sees the whole batch.
+    // Allocations are charged to the caller's tracker on every thread.
+    StatsBlock caller = thread_stats;
+    MemoryTracker *memory = current_memory;
+    pool.parallel_for(shards.size(), [&](size_t, size_t begin, size_t end) {
+      MemoryScope scope(memory);
+      for (size_t s = begin; s < end; s++) {
+        StatsBlock before = thread_stats;
+        shards[s]->cluster(parts[s]);
+        shard_stats[s] = thread_stats.since(before);
+        thread_stats = before;
+      }
+    });
+    thread_stats = caller;
+    u64 state_size = 0;
+    for (const auto &stats : shard_stats) {
+      for (int i = 0; i < NUM_COUNTERS; i++) {
+        thread_stats.counters[i] += stats.counters[i];
+      }
+      state_size += stats[Gauge::StateSize];
+    }
+
+    dirty = true;
+    if (config.merge_interval > 0 && ++since_merge >= config.merge_interval) {
+      mergeShards();
+    }
+    PDSC_GAUGE(StateSize, state_size);
+  }
+
+  const std::vector<Point> &centers() {
+    if (dirty) {
+      mergeShards();
+    }
+    return coordinator->centers();
+  }
+
+  std::vector<Summary> export_summaries() {
+    if (dirty) {
+      mergeShards();
+    }
+    return coordinator->export_summaries();
+  }
+
+  void merge(const std::vector<Summary> &summaries) {
+    shards[0]->merge(summaries);
+    dirty = true;
+  }
+
+  // Every shard shrinks by its own policy; the coordinator is dropped and
+  // rebuilt on next use.
+  void shrink() {
+    for (auto &shard : shards) {
+      shard->shrink();
+    }
+    coordinator.reset();
+    dirty = true;
+  }
+
+  void snapshot(SnapshotWriter &out) const {
+    out.write_string("sharded");
+    out.write<u32>(shards.size());
+    out.write<u64>(next);
+    out.write<int>(since_merge);
+    for (const auto &shard : shards) {
+      shard->snapshot(out);
+    }
+  }
+
+  // The coordinator is rebuilt from the restored shards on next use.
+  void restore(SnapshotReader &in) {
+    if (in.read_string() != "sharded" || in.read<u32>() != shards.size()) {
+      throw std::runtime_error("snapshot has a different shard layout");
+    }
+    next = in.read<u64>();
+    since_merge = in.read<int>();
+    for (auto &shard : shards) {
+      shard->restore(in);
+    }
+    dirty = true;
+  }
+
+private:
+  Factory make;
+  ShardingConfig config;
+  ThreadPool pool;
+  std::vector<std::unique_ptr<Algorithm>> shards;
+  std::vector<std::vector<Point>> parts;
+  std::vector<StatsBlock> shard_stats;
+  std::unique_ptr<Algorithm> coordinator;
+  bool dirty = true;
+  int since_merge = 0;
+  u64 next = 0; // Round-robin cursor, carried across batches
+
+  size_t shardOf(const Point &point) {
+    if (config.partition == Partition::RoundRobin) {
+      return next++ % shards.size();
+    }
+    u64 hash = 14695981039346656037ull;
+    int dims = std::min<int>(config.hash_dims, point.features.size());
+    for (int d = 0; d < dims; d++) {
+      hash ^= static_cast<u64>(
+          static_cast<long long>(std::floor(point.features[d] / config.hash_cell)));
+      hash *= 1099511628211ull;
+    }
+    return hash % shards.size();
+  }
+
+  void mergeShards() {
+    coordinator = make();
+    for (auto &shard : shards) {
+      coordinator->merge(shard->export_summaries());
+    }
+    since_merge = 0;
+    dirty = false;
+  }
+};
+
+#endif // PDSC_SHARDED_HPP
@@ -19,29 +19,104 @@
 
 #include "algorithm.hpp"
 #include "common.hpp"
+#include "kmeans.hpp"
+#include "ring_window.hpp"
 
 #include <algorithm>
 #include <cmath>
-#include <deque>
 #include <limits>
 #include <random>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 const int WINDOW_SIZE = 1000;
+const int RECLUSTER_INTERVAL = 100; // Points between two reclustering passes
+const int MAX_ITERATIONS = 10;      // Lloyd iterations per reclustering pass
+const double DRIFT_FACTOR = 2.0;    // Recent / reference distance ratio
+
+struct SLKMeansConfig {
+  int window_size = WINDOW_SIZE;
+  int recluster_interval = RECLUSTER_INTERVAL;
+  int max_iterations = MAX_ITERATIONS;
+  double drift_factor = DRIFT_FACTOR;
+  bool incremental = true; // false reruns k-means from scratch per point
+
+  bool set(const std::string &key, double value) {
+    if (key == "window_size") {
+      window_size = checked_count(key, value, 1);
+    } else if (key == "recluster_interval") {
+      recluster_interval = checked_count(key, value, 1);
+    } else if (key == "max_iterations") {
+      max_iterations = checked_count(key, value, 1);
+    } else if (key == "drift_factor") {
+      drift_factor = checked_param(key, value, 0.0);
+    } else if (key == "incremental") {
+      incremental = checked_param(key, value, 0.0, 1.0) != 0.0;
+    } else {
+      return false;
+    }
+    return true;
+  }
+};
 
 class SLKMeans : public Algorithm {
 public:
-  SLKMeans(int dimensions, int k) : dimensions(dimensions), k(k) {
+  SLKMeans(int dimensions, int k, const SLKMeansConfig &config = {},
+           ThreadPool *pool = nullptr)
+      : dimensions(dimensions), k(k), config(config),
+        window(config.window_size, dimensions),
+        assignments(config.window_size, -1),
+        engine(dimensions, k, pool), gen(std::random_device()()) {
     centroids.resize(k, Point(dimensions));
+    sums.resize(k, std::vector<double>(dimensions, 0.0));
+    counts.resize(k, 0);
+    absorbed_sums.resize(k, std::vector<double>(dimensions, 0.0));
+    absorbed_weights.resize(k, 0.0);
   }
 
   void insert(const Point &point) {
-    window.push_back(point);
-    if (window.size() > WINDOW_SIZE) {
-      window.pop_front();
+    const double *features = point.features.data();
+    if (!config.incremental) {
+      window.push(features);
+      if (window.size() >= k) {
+        initializeCentroids();
+        runKMeans(std::numeric_limits<int>::max());
+      }
+      return;
+    }
+
+    // Evict the departing point from its cluster's running sums
+    if (window.full() && initialized) {
+      size_t slot = window.oldest();
+      removeFromCluster(window.row(slot), assignments[slot]);
+    }
+    size_t slot = window.push(features);
+
+    if (!initialized) {
+      if (window.size() >= k) {
+        initializeCentroids();
+        runKMeans(config.max_iterations);
+        initialized = true;
+      }
+      return;
     }
-    if (window.size() >= k) {
-      runKMeans();
+
+    // Assign the arriving point against the warm centroids
+    int bestCluster = 0;
+    double dist = nearestCentroid(features, bestCluster);
+    addToCluster(features, bestCluster);
+    assignments[slot] = bestCluster;
+
+    recent_dist = recent_dist == 0.0
+                      ? dist
+                      : recent_dist + (dist - recent_dist) /
+                                          config.recluster_interval;
+    since_recluster++;
+    bool drifted = reference_dist > 0.0 &&
+                   recent_dist > config.drift_factor * reference_dist;
+    if (since_recluster >= config.recluster_interval || drifted) {
+      runKMeans(config.max_iterations);
     }
   }
 
@@ -49,78 +124,336 @@ public:
     for (const auto &point : points) {
       insert(point);
     }
+    PDSC_GAUGE(StateSize, window.size());
+  }
+
+  const std::vector<Point> &centers() { return centroids; }
+
+  // Halves the window, keeping its newest points, and reclusters them.
+  void shrink() {
+    size_t capacity = std::max<size_t>(window.capacity() / 2, k);
+    if (capacity >= window.capacity())
+      return;
+    window.shrink(capacity);
+    config.window_size = capacity;
+    assignments.assign(capacity, -1);
+    if (initialized) {
+      runKMeans(config.max_iterations);
+    }
+  }
+
+  // One summary per cluster, merged weight included, and one per window
+  // point that no cluster holds yet.
+  std::vector<Summary> export_summaries() {
+    std::vector<Summary> summaries;
+    for (int j = 0; j < k; ++j) {
+      double weight = counts[j] + absorbed_weights[j];
+      if (weight > 0.0) {
+        std::vector<double> sum(dimensions);
+        for (int d = 0; d < dimensions; ++d) {
+          sum[d] = sums[j][d] + absorbed_sums[j][d];
+        }
+        summaries.push_back({sum, {}, weight});
+      }
+    }
+    for (size_t i = 0; i < window.size(); ++i) {
+      if (assignments[i] < 0) {
+        const double *row = window.row(i);
+        summaries.push_back({{row, row + dimensions}, {}, 1.0});
+      }
+    }
+    return summaries;
+  }
+
+  void snapshot(SnapshotWriter &out) const {
+    out.write_header("slkmeans", dimensions);
+    out.write<int>(k);
+    out.write<bool>(initialized);
+    out.write<int>(since_recluster);
+    out.write<double>(recent_dist);
+    out.write<double>(reference_dist);
+    for (int j = 0; j < k; ++j) {
+      out.write_vector(centroids[j].features);
+      out.write_vector(sums[j]);
+    }
+    out.write_vector(counts);
+    out.write_vector(assignments);
+    for (int j = 0; j < k; ++j) {
+      out.write_vector(absorbed_sums[j]);
+    }
+    out.write_vector(absorbed_weights);
+    window.snapshot(out);
+    out.write_rng(gen);
+  }
+
+  void restore(SnapshotReader &in) {
+    in.expect_header("slkmeans", dimensions);
+    if (in.read<int>() != k) {
+      throw std::runtime_error("snapshot has a different k");
+    }
+    initialized = in.read<bool>();
+    since_recluster = in.read<int>();
+    recent_dist = in.read<double>();
+    reference_dist = in.read<double>();
+    for (int j = 0; j < k; ++j) {
+      in.read_array(centroids[j].features.data(), dimensions);
+      in.read_array(sums[j].data(), dimensions);
+    }
+    in.read_array(counts.data(), k);
+    in.read_array(assignments.data(), assignments.size());
+    for (int j = 0; j < k; ++j) {
+      in.read_array(absorbed_sums[j].data(), dimensions);
+    }
+    in.read_array(absorbed_weights.data(), k);
+    window.restore(in);
+    in.read_rng(gen);
   }
 
-  std::vector<Point> output_centers() { return centroids; }
+  // Weighted k-means over this instance's clusters, its unassigned window
+  // points and the incoming clusters. The window points join the cluster
+  // their own cluster landed in; the incoming weight is kept per cluster
+  // as absorbed weight, which inserts and reclustering passes build on.
+  void merge(const std::vector<Summary> &summaries) {
+    rows.clear();
+    weights.clear();
+    std::vector<int> own_row(k, -1);
+    auto add_row = [&](const double *sum, double weight) {
+      for (int d = 0; d < dimensions; ++d) {
+        rows.push_back(sum[d] / weight);
+      }
+      weights.push_back(weight);
+    };
+    for (int j = 0; j < k; ++j) {
+      double weight = counts[j] + absorbed_weights[j];
+      if (weight > 0.0) {
+        own_row[j] = weights.size();
+        std::vector<double> sum(dimensions);
+        for (int d = 0; d < dimensions; ++d) {
+          sum[d] = sums[j][d] + absorbed_sums[j][d];
+        }
+        add_row(sum.data(), weight);
+      }
+    }
+    std::vector<size_t> point_row(window.size());
+    for (size_t i = 0; i < window.size(); ++i) {
+      if (assignments[i] < 0) {
+        point_row[i] = weights.size();
+        add_row(window.row(i), 1.0);
+      }
+    }
+    size_t incoming = weights.size();
+    for (const auto &summary : summaries) {
+      if (summary.weight > 0.0) {
+        add_row(summary.linear_sum.data(), summary.weight);
+      }
+    }
+    if (weights.empty())
+      return;
+
+    size_t n = weights.size();
+    engine.seed_plus_plus(rows.data(), n, weights.data(), gen);
+    engine.run(rows.data(), n, config.max_iterations, weights.data());
+
+    std::vector<std::vector<double>> old_absorbed(k);
+    old_absorbed.swap(absorbed_sums);
+    std::vector<double> old_weights(k, 0.0);
+    old_weights.swap(absorbed_weights);
+    clearClusters();
+    for (size_t i = 0; i < window.size(); ++i) {
+      int j = assignments[i] < 0 ? engine.label(point_row[i])
+                                 : engine.label(own_row[assignments[i]]);
+      assignments[i] = j;
+      counts[j]++;
+      for (int d = 0; d < dimensions; ++d) {
+        sums[j][d] += window.row(i)[d];
+      }
+    }
+    for (int j = 0; j < k; ++j) {
+      if (own_row[j] >= 0 && old_weights[j] > 0.0) {
+        absorb(engine.label(own_row[j]), old_absorbed[j].data(),
+               old_weights[j]);
+      }
+    }
+    for (size_t r = incoming; r < n; ++r) {
+      std::vector<double> sum(dimensions);
+      for (int d = 0; d < dimensions; ++d) {
+        sum[d] = rows[r * dimensions + d] * weights[r];
+      }
+      absorb(engine.label(r), sum.data(), weights[r]);
+    }
+    refreshCentroids();
+    initialized = true;
+  }
 
 private:
   int dimensions;
   int k;
+  SLKMeansConfig config;
+  bool initialized = false;
   std::vector<Point> centroids;
-  std::deque<Point> window;
+  RingWindow window;
+  // Per-cluster running sums over the window, kept in step with slides
+  std::vector<std::vector<double>> sums;
+  std::vector<int> counts;
+  std::vector<int> assignments; // Cluster of each window slot
+  // Weight and sum per cluster taken in by merge() with no window point
+  // behind it; reclustering passes carry it along as one weighted row.
+  std::vector<std::vector<double>> absorbed_sums;
+  std::vector<double> absorbed_weights;
+  std::vector<double> rows, weights; // Scratch of weighted passes
+  KMeans engine;
+  std::mt19937 gen;
+  int since_recluster = 0;
+  double recent_dist = 0.0;    // Smoothed distance of arriving points
+  double reference_dist = 0.0; // Mean window distance at the last pass
 
   void initializeCentroids() {
-    std::random_device rd;
-    std::mt19937 gen(rd());
     std::uniform_int_distribution<> dis(0, window.size() - 1);
     for (int i = 0; i < k; ++i) {
-      centroids[i] = window[dis(gen)];
+      const double *row = window.row(dis(gen));
+      std::copy(row, row + dimensions, centroids[i].features.begin());
+    }
+  }
+
+  double nearestCentroid(const double *features, int &bestCluster) const {
+    double minDist = std::numeric_limits<double>::max();
+    for (int j = 0; j < k; ++j) {
+      double dist = calcDistance(features, centroids[j].features.data());
+      if (dist < minDist) {
+        minDist = dist;
+        bestCluster = j;
+      }
     }
+    return minDist;
   }
 
-  void runKMeans() {
-    // Initialize centroids if the window has enough points
-    if (window.size() < k)
+  void addToCluster(const double *features, int cluster) {
+    counts[cluster]++;
+    for (int d = 0; d < dimensions; ++d) {
+      sums[cluster][d] += features[d];
+    }
+    refreshCentroid(cluster);
+  }
+
+  void removeFromCluster(const double *features, int cluster) {
+    counts[cluster]--;
+    for (int d = 0; d < dimensions; ++d) {
+      sums[cluster][d] -= features[d];
+    }
+    refreshCentroid(cluster);
+  }
+
+  // The centroid is the mean of the cluster's window points and absorbed
+  // weight; an empty cluster keeps its centroid.
+  void refreshCentroid(int j) {
+    double weight = counts[j] + absorbed_weights[j];
+    if (weight <= 0.0)
       return;
-    initializeCentroids();
-
-    bool converged = false;
-    std::vector<int> assignments(window.size());
-
-    while (!converged) {
-      // Step 1: Assign points to the nearest centroid
-      converged = true;
-      for (size_t i = 0; i < window.size(); ++i) {
-        double minDist = std::numeric_limits<double>::max();
-        int bestCluster = -1;
-        for (int j = 0; j < k; ++j) {
-          double dist = calcDistance(window[i], centroids[j]);
-          if (dist < minDist) {
-            minDist = dist;
-            bestCluster = j;
+    for (int d = 0; d < dimensions; ++d) {
+      centroids[j].features[d] = (sums[j][d] + absorbed_sums[j][d]) / weight;
+    }
+  }
+
+  void refreshCentroids() {
+    for (int j = 0; j < k; ++j) {
+      refreshCentroid(j);
+    }
+  }
+
+  void clearClusters() {
+    for (int j = 0; j < k; ++j) {
+      std::fill(sums[j].begin(), sums[j].end(), 0.0);
+      counts[j] = 0;
+      absorbed_sums[j].assign(dimensions, 0.0);
+      absorbed_weights[j] = 0.0;
+    }
+  }
+
+  void absorb(int j, const double *sum, double weight) {
+    for (int d = 0; d < dimensions; ++d) {
+      absorbed_sums[j][d] += sum[d];
+    }
+    absorbed_weights[j] += weight;
+  }
+
+  bool absorbing() const {
+    return std::any_of(absorbed_weights.begin(), absorbed_weights.end(),
+                       [](double w) { return w > 0.0; });
+  }
+
+  // Lloyd iterations starting from the current centroids, capped at
+  // max_iterations. Leaves sums, counts and assignments consistent with the
+  // final centroids. The window's occupied slots are one contiguous slab, so
+  // the engine scans it in place unless absorbed weight has to ride along.
+  void runKMeans(int max_iterations) {
+    bool weighted = absorbing();
+    if (window.size() < k && !weighted)
+      return;
+
+    for (int j = 0; j < k; ++j) {
+      engine.set_centroid(j, centroids[j].features.data());
+    }
+    size_t n = window.size();
+    if (!weighted) {
+      engine.run(window.data(), n, max_iterations);
+      for (int j = 0; j < k; ++j) {
+        std::copy(engine.centroid(j), engine.centroid(j) + dimensions,
+                  centroids[j].features.begin());
+        std::copy(engine.sum(j), engine.sum(j) + dimensions, sums[j].begin());
+        counts[j] = static_cast<int>(engine.count(j));
+      }
+    } else {
+      // The window's rows, then one row per cluster's absorbed weight.
+      rows.assign(window.data(), window.data() + n * dimensions);
+      weights.assign(n, 1.0);
+      for (int j = 0; j < k; ++j) {
+        if (absorbed_weights[j] > 0.0) {
+          for (int d = 0; d < dimensions; ++d) {
+            rows.push_back(absorbed_sums[j][d] / absorbed_weights[j]);
           }
+          weights.push_back(absorbed_weights[j]);
         }
-        if (assignments[i] != bestCluster) {
-          assignments[i] = bestCluster;
-          converged = false;
+      }
+      engine.run(rows.data(), weights.size(), max_iterations,
+                 weights.data());
+      clearClusters();
+      for (size_t i = 0; i < n; ++i) {
+        int j = engine.label(i);
+        counts[j]++;
+        for (int d = 0; d < dimensions; ++d) {
+          sums[j][d] += rows[i * dimensions + d];
         }
       }
-
-      // Step 2: Update centroids
-      std::vector<Point> newCentroids(k, Point(dimensions));
-      std::vector<int> counts(k, 0);
-      for (size_t i = 0; i < window.size(); ++i) {
-        int cluster = assignments[i];
+      for (size_t r = n; r < weights.size(); ++r) {
         for (int d = 0; d < dimensions; ++d) {
-          newCentroids[cluster].features[d] += window[i].features[d];
+          rows[r * dimensions + d] *= weights[r];
         }
-        counts[cluster]++;
+        absorb(engine.label(r), &rows[r * dimensions], weights[r]);
       }
       for (int j = 0; j < k; ++j) {
-        if (counts[j] > 0) {
-          for (int d = 0; d < dimensions; ++d) {
-            newCentroids[j].features[d] /= counts[j];
-          }
-        }
+        std::copy(engine.centroid(j), engine.centroid(j) + dimensions,
+                  centroids[j].features.begin());
       }
-      centroids = newCentroids;
+      refreshCentroids();
+    }
+    if (n == 0)
+      return;
+    double total = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      assignments[i] = engine.label(i);
+      total += calcDistance(window.row(i),
+                            centroids[assignments[i]].features.data());
     }
+    reference_dist = total / n;
+    recent_dist = reference_dist;
+    since_recluster = 0;
   }
 
-  double calcDistance(const Point &a, const Point &b) const {
+  double calcDistance(const double *a, const double *b) const {
+    PDSC_COUNT(DistanceCalls);
     double dist = 0.0;
     for (int i = 0; i < dimensions; ++i) {
-      dist += (a.features[i] - b.features[i]) * (a.features[i] - b.features[i]);
+      dist += (a[i] - b[i]) * (a[i] - b[i]);
     }
     return sqrt(dist);
   }
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_SNAPSHOT_HPP
+#define PDSC_SNAPSHOT_HPP
+
+#include "common.hpp"
+
+#include <cstring>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+const u32 SNAPSHOT_MAGIC = 0x43534450; // "PDSC" little-endian
+const u32 SNAPSHOT_VERSION = 3;
+
+// Appends a binary image of algorithm state to a byte buffer. Arrays are
+// written as a u64 length followed by their raw bytes, so both directions
+// are bulk copies. The format is host-endian and meant for restarting on the
+// same machine, not for exchange.
+class SnapshotWriter {
+public:
+  explicit SnapshotWriter(std::string &buffer) : buffer(buffer) {}
+
+  template <typename T> void write(const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value, "not a plain value");
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  template <typename T> void write_array(const T *data, size_t n) {
+    static_assert(std::is_trivially_copyable<T>::value, "not a plain value");
+    write<u64>(n);
+    buffer.append(reinterpret_cast<const char *>(data), n * sizeof(T));
+  }
+
+  template <typename T, typename A>
+  void write_vector(const std::vector<T, A> &values) {
+    write_array(values.data(), values.size());
+  }
+
+  void write_string(const std::string &value) {
+    write_array(value.data(), value.size());
+  }
+
+  // Generator state, so a restored run draws the same sequence.
+  void write_rng(const std::mt19937 &gen) {
+    std::ostringstream state;
+    state << gen;
+    write_string(state.str());
+  }
+
+  // Tags the following section with the algorithm and its dimensionality.
+  void write_header(const char *tag, u32 dimensions) {
+    write_string(tag);
+    write<u32>(dimensions);
+  }
+
+private:
+  std::string &buffer;
+};
+
+// Reads back what SnapshotWriter wrote. Throws std::runtime_error on
+// truncated input or a section that does not match the reader.
+class SnapshotReader {
+public:
+  SnapshotReader(const char *data, size_t size) : data(data), size(size) {}
+
+  template <typename T> T read() {
+    static_assert(std::is_trivially_copyable<T>::value, "not a plain value");
+    T value;
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  // Reads an array of exactly n elements.
+  template <typename T> void read_array(T *out, size_t n) {
+    if (read<u64>() != n) {
+      throw std::runtime_error("snapshot array size mismatch");
+    }
+    std::memcpy(out, take(n * sizeof(T)), n * sizeof(T));
+  }
+
+  // Reads an array of at most capacity elements; returns its length.
+  template <typename T> size_t read_bounded(T *out, size_t capacity) {
+    u64 n = read<u64>();
+    if (n > capacity) {
+      throw std::runtime_error("snapshot array too large");
+    }
+    std::memcpy(out, take(n * sizeof(T)), n * sizeof(T));
+    return n;
+  }
+
+  template <typename T, typename A> void read_vector(std::vector<T, A> &out) {
+    u64 n = read<u64>();
+    if (n > remaining() / sizeof(T)) {
+      throw std::runtime_error("snapshot truncated");
+    }
+    out.resize(n);
+    std::memcpy(out.data(), take(n * sizeof(T)), n * sizeof(T));
+  }
+
+  std::string read_string() {
+    std::string value;
+    u64 n = read<u64>();
+    const char *bytes = take(n);
+    value.assign(bytes, n);
+    return value;
+  }
+
+  void read_rng(std::mt19937 &gen) {
+    std::istringstream state(read_string());
+    state >> gen;
+    if (!state) {
+      throw std::runtime_error("snapshot has a malformed generator state");
+    }
+  }
+
+  void expect_header(const char *tag, u32 dimensions) {
+    std::string found = read_string();
+    if (found != tag) {
+      throw std::runtime_error("snapshot holds " + found + ", not " + tag);
+    }
+    if (read<u32>() != dimensions) {
+      throw std::runtime_error("snapshot dimensionality mismatch");
+    }
+  }
+
+  // Number of elements about to be read into a container, checked against
+  // the bytes left so a corrupt count cannot trigger a huge allocation.
+  u64 read_count(size_t min_element_size = 1) {
+    u64 n = read<u64>();
+    if (n > remaining() / min_element_size) {
+      throw std::runtime_error("snapshot truncated");
+    }
+    return n;
+  }
+
+  size_t remaining() const { return size - offset; }
+
+private:
+  const char *data;
+  size_t size;
+  size_t offset = 0;
+
+  const char *take(size_t n) {
+    if (n > remaining()) {
+      throw std::runtime_error("snapshot truncated");
+    }
+    const char *p = data + offset;
+    offset += n;
+    return p;
+  }
+};
+
+// Links nodes restored in preorder, given the indices of each node's
+// children, into one tree rooted at the first node. Every child must come
+// after its parent and have no other parent, and every other node must have
+// one; otherwise std::runtime_error is thrown. The nodes stay owned by
+// `nodes` either way, so nothing leaks when a later read fails.
+template <typename Node>
+void link_tree(std::vector<std::unique_ptr<Node>> &nodes,
+               const std::vector<std::vector<u32>> &children,
+               const char *what) {
+  std::vector<bool> parented(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    for (u32 child : children[i]) {
+      if (child <= i || child >= nodes.size() || parented[child]) {
+        throw std::runtime_error(std::string("snapshot has a malformed ") +
+                                 what);
+      }
+      parented[child] = true;
+    }
+  }
+  for (size_t i = 1; i < nodes.size(); i++) {
+    if (!parented[i]) {
+      throw std::runtime_error(std::string("snapshot has a malformed ") + what);
+    }
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    for (u32 child : children[i]) {
+      nodes[i]->children.push_back(nodes[child].get());
+    }
+  }
+}
+
+#endif // PDSC_SNAPSHOT_HPP
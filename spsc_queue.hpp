@@ -0,0 +1,79 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_SPSC_QUEUE_HPP
+#define PDSC_SPSC_QUEUE_HPP
+
+#include "aligned_allocator.hpp"
+#include "common.hpp"
+
+#include <atomic>
+#include <vector>
+
+// Bounded lock-free single-producer/single-consumer ring. Each side keeps a
+// cached copy of the other side's index and only reloads it when the ring
+// looks full (producer) or empty (consumer).
+template <typename T> class SpscQueue {
+public:
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots.resize(size);
+    mask = size - 1;
+  }
+
+  size_t capacity() const { return slots.size(); }
+
+  // Producer side. Returns false when the ring is full.
+  bool try_push(const T &value) {
+    size_t tail = tail_index.load(std::memory_order_relaxed);
+    if (tail - head_cache >= slots.size()) {
+      head_cache = head_index.load(std::memory_order_acquire);
+      if (tail - head_cache >= slots.size()) {
+        return false;
+      }
+    }
+    slots[tail & mask] = value;
+    tail_index.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false when the ring is empty.
+  bool try_pop(T &value) {
+    size_t head = head_index.load(std::memory_order_relaxed);
+    if (head == tail_cache) {
+      tail_cache = tail_index.load(std::memory_order_acquire);
+      if (head == tail_cache) {
+        return false;
+      }
+    }
+    value = slots[head & mask];
+    head_index.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::vector<T> slots;
+  size_t mask;
+  alignas(CACHE_LINE) std::atomic<size_t> head_index{0};
+  alignas(CACHE_LINE) size_t tail_cache = 0; // Consumer's view of tail
+  alignas(CACHE_LINE) std::atomic<size_t> tail_index{0};
+  alignas(CACHE_LINE) size_t head_cache = 0; // Producer's view of head
+};
+
+#endif // PDSC_SPSC_QUEUE_HPP
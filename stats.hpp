@@ -0,0 +1,104 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_STATS_HPP
+#define PDSC_STATS_HPP
+
+#include "common.hpp"
+
+// Hot-path counters and gauges. Each thread owns its own block, so updates
+// are plain increments; the runner samples the block of the thread driving
+// an algorithm after every batch. Build with PDSC_STATS=0 to compile every
+// update out.
+#ifndef PDSC_STATS
+#define PDSC_STATS 1
+#endif
+
+enum class Counter : int {
+  DistanceCalls,      // Point-to-summary distance evaluations
+  KMeansSkips,        // Points whose Hamerly bounds avoided a rescan
+  KMeansRuns,         // Lloyd passes started
+  KMeansIterations,   // Lloyd iterations over all passes
+  BirchSplits,        // BIRCH splitNode calls
+  CluStreamEvictions, // CluStream removeOldestMicroCluster calls
+  DenStreamExpiries,  // DenStream micro-clusters dropped for age
+  DStreamCellCreates, // DStream grid cells created
+  DStreamCellExpiries, // DStream grid cells dropped for age
+  EDMDecayVisits,     // EDMStream DP-tree nodes visited by decayClusters
+  StreamKMReduces,    // StreamKM++ coreset tree reduces
+  IndexCandidates,    // Clusters a nearest-cluster index proposed
+  LSHRehashes,        // LSH bucket moves of a cluster center
+  Count
+};
+
+enum class Gauge : int {
+  StateSize, // Summaries held: micro-clusters, cells, tree nodes, points
+  Count
+};
+
+const int NUM_COUNTERS = static_cast<int>(Counter::Count);
+const int NUM_GAUGES = static_cast<int>(Gauge::Count);
+
+inline const char *COUNTER_NAMES[NUM_COUNTERS] = {
+    "distance_calls",      "kmeans_skips",         "kmeans_runs",
+    "kmeans_iterations",   "birch_splits",         "clustream_evictions",
+    "denstream_expiries",  "dstream_cell_creates", "dstream_cell_expiries",
+    "edm_decay_visits",    "streamkm_reduces",     "index_candidates",
+    "lsh_rehashes"};
+inline const char *GAUGE_NAMES[NUM_GAUGES] = {"state_size"};
+
+struct StatsBlock {
+  u64 counters[NUM_COUNTERS] = {};
+  u64 gauges[NUM_GAUGES] = {};
+
+  u64 operator[](Counter c) const { return counters[static_cast<int>(c)]; }
+  u64 operator[](Gauge g) const { return gauges[static_cast<int>(g)]; }
+
+  // Counter increments since `before`, with this block's gauge readings.
+  StatsBlock since(const StatsBlock &before) const {
+    StatsBlock delta = *this;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+      delta.counters[i] -= before.counters[i];
+    }
+    return delta;
+  }
+
+  void add(const StatsBlock &other) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+      counters[i] += other.counters[i];
+    }
+    for (int i = 0; i < NUM_GAUGES; i++) {
+      gauges[i] = other.gauges[i];
+    }
+  }
+};
+
+inline thread_local StatsBlock thread_stats;
+
+#if PDSC_STATS
+#define PDSC_COUNT(name)                                                       \
+  (thread_stats.counters[static_cast<int>(Counter::name)]++)
+#define PDSC_COUNT_N(name, n)                                                  \
+  (thread_stats.counters[static_cast<int>(Counter::name)] += (n))
+#define PDSC_GAUGE(name, value)                                                \
+  (thread_stats.gauges[static_cast<int>(Gauge::name)] = (value))
+#else
+#define PDSC_COUNT(name) ((void)0)
+#define PDSC_COUNT_N(name, n) ((void)0)
+#define PDSC_GAUGE(name, value) ((void)0)
+#endif
+
+#endif // PDSC_STATS_HPP
@@ -0,0 +1,428 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_STREAMKM_HPP
+#define PDSC_STREAMKM_HPP
+
+#include "algorithm.hpp"
+#include "common.hpp"
+#include "kmeans.hpp"
+#include "memory.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+const int CORESET_FACTOR = 200; // Coreset size m = CORESET_FACTOR * k
+const int KMEANS_RESTARTS = 5;  // k-means++ restarts on the final coreset
+const int FINAL_ITERATIONS = 100;
+
+struct StreamKMConfig {
+  int coreset_factor = CORESET_FACTOR;
+  int restarts = KMEANS_RESTARTS;
+  int final_iterations = FINAL_ITERATIONS;
+
+  bool set(const std::string &key, double value) {
+    if (key == "coreset_factor") {
+      coreset_factor = checked_count(key, value, 1);
+    } else if (key == "restarts") {
+      restarts = checked_count(key, value, 1);
+    } else if (key == "final_iterations") {
+      final_iterations = checked_count(key, value, 1);
+    } else {
+      return false;
+    }
+    return true;
+  }
+};
+
+// StreamKM++ (Ackermann et al.): merge-and-reduce over buckets of m weighted
+// points. Bucket 0 buffers raw points; bucket i > 0 holds a coreset standing
+// for 2^(i-1) * m points. Each reduce builds a coreset tree over 2m points,
+// so memory is O(m log(n / m)).
+class StreamKM : public Algorithm {
+public:
+  StreamKM(int dimensions, int k, const StreamKMConfig &config = {},
+           ThreadPool *pool = nullptr)
+      : dimensions(dimensions), k(k), config(config),
+        m(config.coreset_factor * k),
+        engine(dimensions, k, pool), gen(42) {
+    buckets.emplace_back(m, dimensions);
+    merged.rows.resize(2 * m * dimensions);
+    merged.weights.resize(2 * m);
+    reduced = Bucket(m, dimensions);
+  }
+
+  void insert(const Point &point) { insert(point.features.data(), 1.0); }
+
+  void insert(const double *row, double weight) {
+    Bucket &first = buckets[0];
+    std::copy(row, row + dimensions,
+              first.rows.begin() + first.size * dimensions);
+    first.weights[first.size++] = weight;
+    if (first.size == m) {
+      carry();
+    }
+  }
+
+  void cluster(const std::vector<Point> &points) {
+    for (const auto &point : points) {
+      insert(point);
+    }
+    solved = false;
+    size_t held = 0;
+    for (const auto &bucket : buckets) {
+      held += bucket.size;
+    }
+    PDSC_GAUGE(StateSize, held);
+  }
+
+  std::vector<Summary> export_summaries() {
+    std::vector<Summary> summaries;
+    for (const auto &bucket : buckets) {
+      for (size_t i = 0; i < bucket.size; i++) {
+        Summary summary{std::vector<double>(dimensions), {}, bucket.weights[i]};
+        for (int d = 0; d < dimensions; d++) {
+          summary.linear_sum[d] =
+              bucket.rows[i * dimensions + d] * bucket.weights[i];
+        }
+        summaries.push_back(std::move(summary));
+      }
+    }
+    return summaries;
+  }
+
+  // Only the occupied part of each bucket is written.
+  void snapshot(SnapshotWriter &out) const {
+    out.write_header("streamkm", dimensions);
+    out.write<u64>(m);
+    out.write_rng(gen);
+    out.write<u64>(buckets.size());
+    for (const auto &bucket : buckets) {
+      out.write_array(bucket.rows.data(), bucket.size * dimensions);
+      out.write_array(bucket.weights.data(), bucket.size);
+    }
+  }
+
+  void restore(SnapshotReader &in) {
+    in.expect_header("streamkm", dimensions);
+    if (in.read<u64>() != m) {
+      throw std::runtime_error("snapshot has a different coreset size");
+    }
+    in.read_rng(gen);
+    buckets.clear();
+    u64 levels = in.read_count();
+    for (u64 level = 0; level < levels; level++) {
+      Bucket &bucket = buckets.emplace_back(m, dimensions);
+      size_t n = in.read_bounded(bucket.rows.data(), m * dimensions);
+      if (n % dimensions != 0) {
+        throw std::runtime_error("snapshot has a partial coreset row");
+      }
+      bucket.size = n / dimensions;
+      in.read_array(bucket.weights.data(), bucket.size);
+    }
+    if (buckets.empty()) {
+      buckets.emplace_back(m, dimensions);
+    }
+    solved = false;
+  }
+
+  // Feeds the incoming weighted points through bucket 0, so they are
+  // reduced together with this instance's coresets.
+  void merge(const std::vector<Summary> &summaries) {
+    std::vector<double> row(dimensions);
+    for (const auto &summary : summaries) {
+      for (int d = 0; d < dimensions; d++) {
+        row[d] = summary.linear_sum[d] / summary.weight;
+      }
+      insert(row.data(), summary.weight);
+    }
+    solved = false;
+  }
+
+  // Collapses all levels into one coreset of at most m points on the top
+  // level and frees the storage of the others.
+  void shrink() {
+    size_t top = buckets.size() - 1;
+    bool held = false;
+    for (size_t level = 1; level < top; level++) {
+      held = held || !buckets[level].weights.empty();
+    }
+    if (!held) {
+      return;
+    }
+    Bucket collapsed(m, dimensions);
+    append(collapsed, gatherBuckets());
+    buckets[0].size = 0;
+    for (size_t level = 1; level < top; level++) {
+      buckets[level] = Bucket();
+    }
+    buckets[top] = std::move(collapsed);
+    merged = Bucket(2 * m, dimensions);
+    solved = false;
+  }
+
+  // The coreset is only solved again after it has changed.
+  const std::vector<Point> &centers() {
+    if (!solved) {
+      solve(solution);
+      solved = true;
+    }
+    return solution;
+  }
+
+private:
+  void solve(std::vector<Point> &centers) {
+    const Bucket *coreset = &gatherBuckets();
+    centers.clear();
+    if (coreset->size <= k) {
+      for (size_t i = 0; i < coreset->size; i++) {
+        centers.emplace_back(std::vector<double>(
+            coreset->rows.begin() + i * dimensions,
+            coreset->rows.begin() + (i + 1) * dimensions));
+      }
+      return;
+    }
+
+    double best_cost = std::numeric_limits<double>::max();
+    for (int r = 0; r < config.restarts; r++) {
+      engine.seed_plus_plus(coreset->rows.data(), coreset->size,
+                            coreset->weights.data(), gen);
+      engine.run(coreset->rows.data(), coreset->size, config.final_iterations,
+                 coreset->weights.data());
+      double cost = 0.0;
+      for (size_t i = 0; i < coreset->size; i++) {
+        double dist;
+        engine.nearest(&coreset->rows[i * dimensions], dist);
+        cost += coreset->weights[i] * dist * dist;
+      }
+      if (cost < best_cost) {
+        best_cost = cost;
+        centers.assign(k, Point(dimensions));
+        for (int j = 0; j < k; j++) {
+          std::copy(engine.centroid(j), engine.centroid(j) + dimensions,
+                    centers[j].features.begin());
+        }
+      }
+    }
+  }
+
+  struct Bucket {
+    tracked_vector<double, MemoryCategory::Points> rows, weights;
+    size_t size = 0;
+
+    Bucket() = default;
+    Bucket(size_t capacity, int dimensions)
+        : rows(capacity * dimensions), weights(capacity) {}
+  };
+
+  struct TreeNode {
+    size_t begin, end; // Range of the node's points in order
+    size_t center;     // Point index of the node's representative
+    double cost;       // Sum of w * d^2 to the representative
+    int left, right, parent;
+  };
+
+  int dimensions;
+  int k;
+  StreamKMConfig config;
+  size_t m;
+  std::vector<Bucket> buckets;
+  Bucket merged, reduced;
+  KMeans engine;
+  std::mt19937 gen;
+  std::vector<Point> solution;
+  bool solved = false; // solution is of the current coreset
+  // Coreset tree scratch, reused across reduces.
+  std::vector<TreeNode> tree;
+  std::vector<size_t> order;
+  std::vector<double> dist2;
+  std::vector<char> moved;
+
+  // Union of all buckets, reduced once more if it exceeds m points.
+  const Bucket &gatherBuckets() {
+    merged.size = 0;
+    for (const auto &bucket : buckets) {
+      if (merged.size + bucket.size > merged.weights.size()) {
+        merged.rows.resize((merged.size + bucket.size) * dimensions);
+        merged.weights.resize(merged.size + bucket.size);
+      }
+      append(merged, bucket);
+    }
+    if (merged.size > m) {
+      reduce(merged, reduced);
+      return reduced;
+    }
+    return merged;
+  }
+
+  void append(Bucket &to, const Bucket &from) {
+    std::copy(from.rows.begin(), from.rows.begin() + from.size * dimensions,
+              to.rows.begin() + to.size * dimensions);
+    std::copy(from.weights.begin(), from.weights.begin() + from.size,
+              to.weights.begin() + to.size);
+    to.size += from.size;
+  }
+
+  // Pushes the full bucket 0 up the levels, reducing two coresets into one
+  // wherever the next level is occupied.
+  void carry() {
+    merged.size = 0;
+    append(merged, buckets[0]);
+    buckets[0].size = 0;
+    for (size_t level = 1;; level++) {
+      if (level == buckets.size()) {
+        buckets.emplace_back(m, dimensions);
+      }
+      Bucket &bucket = buckets[level];
+      if (bucket.size == 0) {
+        if (bucket.weights.empty()) {
+          bucket = Bucket(m, dimensions); // Freed by shrink()
+        }
+        append(bucket, merged);
+        return;
+      }
+      append(merged, bucket);
+      bucket.size = 0;
+      reduce(merged, reduced);
+      merged.size = 0;
+      append(merged, reduced);
+    }
+  }
+
+  double squaredDistance(const double *a, const double *b) const {
+    PDSC_COUNT(DistanceCalls);
+    double dist = 0.0;
+    for (int d = 0; d < dimensions; d++) {
+      double diff = a[d] - b[d];
+      dist += diff * diff;
+    }
+    return dist;
+  }
+
+  // Draws an index in order[begin, end) with probability proportional to
+  // weight * dist2.
+  size_t sample(const Bucket &in, size_t begin, size_t end, double total) {
+    double target = std::uniform_real_distribution<double>(0.0, total)(gen);
+    for (size_t i = begin; i < end; i++) {
+      size_t p = order[i];
+      target -= in.weights[p] * dist2[p];
+      if (target <= 0.0) {
+        return p;
+      }
+    }
+    return order[end - 1];
+  }
+
+  // Coreset tree reduce of `in` down to at most m weighted points.
+  void reduce(const Bucket &in, Bucket &out) {
+    PDSC_COUNT(StreamKMReduces);
+    size_t n = in.size;
+    order.resize(n);
+    dist2.resize(n);
+    moved.resize(n);
+    tree.clear();
+
+    double total_weight = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      order[i] = i;
+      total_weight += in.weights[i];
+    }
+    // The first representative is drawn by weight alone.
+    size_t first = n - 1;
+    double target =
+        std::uniform_real_distribution<double>(0.0, total_weight)(gen);
+    for (size_t i = 0; i < n; i++) {
+      target -= in.weights[i];
+      if (target <= 0.0) {
+        first = i;
+        break;
+      }
+    }
+    double cost = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      dist2[i] = squaredDistance(&in.rows[i * dimensions],
+                                 &in.rows[first * dimensions]);
+      cost += in.weights[i] * dist2[i];
+    }
+    tree.push_back({0, n, first, cost, -1, -1, -1});
+
+    size_t leaves = 1;
+    while (leaves < m && tree[0].cost > 0.0) {
+      // Descend to a leaf, choosing children proportionally to their cost.
+      int node = 0;
+      while (tree[node].left != -1) {
+        const TreeNode &parent = tree[node];
+        double pick =
+            std::uniform_real_distribution<double>(0.0, parent.cost)(gen);
+        node = pick < tree[parent.left].cost ? parent.left : parent.right;
+      }
+      TreeNode leaf = tree[node];
+      if (leaf.cost <= 0.0) {
+        break;
+      }
+      size_t center = sample(in, leaf.begin, leaf.end, leaf.cost);
+
+      // Split the leaf between its representative and the new one.
+      double left_cost = 0.0, right_cost = 0.0;
+      for (size_t i = leaf.begin; i < leaf.end; i++) {
+        size_t p = order[i];
+        double d = squaredDistance(&in.rows[p * dimensions],
+                                   &in.rows[center * dimensions]);
+        moved[p] = d < dist2[p];
+        if (moved[p]) {
+          dist2[p] = d;
+          right_cost += in.weights[p] * d;
+        } else {
+          left_cost += in.weights[p] * dist2[p];
+        }
+      }
+      auto mid = std::partition(order.begin() + leaf.begin,
+                                order.begin() + leaf.end,
+                                [this](size_t p) { return !moved[p]; });
+      size_t split = mid - order.begin();
+      int left = tree.size();
+      tree.push_back({leaf.begin, split, leaf.center, left_cost, -1, -1, node});
+      tree.push_back({split, leaf.end, center, right_cost, -1, -1, node});
+      tree[node].left = left;
+      tree[node].right = left + 1;
+      for (int up = node; up != -1; up = tree[up].parent) {
+        tree[up].cost = tree[tree[up].left].cost + tree[tree[up].right].cost;
+      }
+      leaves++;
+    }
+
+    out.size = 0;
+    for (const auto &node : tree) {
+      if (node.left != -1) {
+        continue;
+      }
+      double weight = 0.0;
+      for (size_t i = node.begin; i < node.end; i++) {
+        weight += in.weights[order[i]];
+      }
+      std::copy(in.rows.begin() + node.center * dimensions,
+                in.rows.begin() + (node.center + 1) * dimensions,
+                out.rows.begin() + out.size * dimensions);
+      out.weights[out.size++] = weight;
+    }
+  }
+};
+
+#endif // PDSC_STREAMKM_HPP
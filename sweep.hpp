@@ -0,0 +1,188 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_SWEEP_HPP
+#define PDSC_SWEEP_HPP
+
+#include "common.hpp"
+#include "registry.hpp"
+#include "runner.hpp"
+#include "thread_pool.hpp"
+
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// One point of a parameter grid. batch_size and k are run-level settings;
+// everything else goes to the algorithm's config struct.
+struct SweepConfig {
+  std::string algorithm;
+  Params params;
+  u64 batch_size = BATCH_SIZE;
+  u32 k = 0; // 0 uses the dataset's number of true clusters
+
+  std::string describe() const {
+    std::ostringstream os;
+    os << "batch_size=" << batch_size;
+    if (k) {
+      os << " k=" << k;
+    }
+    for (const auto &[key, value] : params) {
+      os << " " << key << "=" << value;
+    }
+    return os.str();
+  }
+};
+
+struct SweepResult {
+  SweepConfig config;
+  RunResult run;
+  Quality quality;
+};
+
+// Expands one grid line, "algorithm key=v1,v2,... key2=...", into the
+// cartesian product of its values. Blank lines and '#' comments expand to
+// nothing. Throws std::invalid_argument on malformed input.
+inline std::vector<SweepConfig> parse_sweep_line(const std::string &line) {
+  std::istringstream in(line.substr(0, line.find('#')));
+  std::string algorithm, token;
+  if (!(in >> algorithm)) {
+    return {};
+  }
+  std::vector<SweepConfig> grid = {SweepConfig{algorithm}};
+  while (in >> token) {
+    size_t eq = token.find('=');
+    if (eq == std::string::npos || eq + 1 == token.size()) {
+      throw std::invalid_argument("expected key=values, got " + token);
+    }
+    std::string key = token.substr(0, eq);
+    std::vector<double> values;
+    std::istringstream list(token.substr(eq + 1));
+    std::string value;
+    while (std::getline(list, value, ',')) {
+      values.push_back(std::stod(value));
+    }
+    std::vector<SweepConfig> expanded;
+    for (const auto &config : grid) {
+      for (double v : values) {
+        SweepConfig next = config;
+        if (key == "batch_size") {
+          next.batch_size = checked_count(key, v, 1);
+        } else if (key == "k") {
+          next.k = checked_count(key, v, 0);
+        } else {
+          next.params[key] = v;
+        }
+        expanded.push_back(next);
+      }
+    }
+    grid = std::move(expanded);
+  }
+  return grid;
+}
+
+inline std::vector<SweepConfig> load_sweep_file(const std::string &path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    throw std::invalid_argument("cannot open sweep file " + path);
+  }
+  std::vector<SweepConfig> grid;
+  std::string line;
+  while (std::getline(file, line)) {
+    auto configs = parse_sweep_line(line);
+    grid.insert(grid.end(), configs.begin(), configs.end());
+  }
+  return grid;
+}
+
+// Runs every configuration over the shared, read-only dataset, `threads` at
+// a time. Algorithms are built up front so bad parameters fail before any
+// run starts.
+inline std::vector<SweepResult> run_sweep(const std::vector<SweepConfig> &grid,
+                                          const Dataset &dataset,
+                                          ThreadPool &kmeans_pool,
+                                          u32 threads) {
+  for (const auto &config : grid) {
+    make_algorithm(config.algorithm, dataset.dim, 1, config.params);
+  }
+  std::vector<SweepResult> results(grid.size());
+  ThreadPool workers(std::max(1u, threads));
+  std::vector<std::future<void>> pending;
+  for (size_t i = 0; i < grid.size(); i++) {
+    pending.push_back(workers.submit([&, i] {
+      const SweepConfig &config = grid[i];
+      u32 k = config.k ? config.k : dataset.num_true_clusters;
+      AlgorithmSpec spec{config.algorithm, config.algorithm, [&, k] {
+                           return make_algorithm(config.algorithm, dataset.dim,
+                                                 k, config.params,
+                                                 &kmeans_pool);
+                         }};
+      RunOptions options;
+      options.batch_size = config.batch_size;
+      results[i].config = config;
+      results[i].run = run(spec, dataset, options, false);
+      results[i].quality =
+          compute_quality(dataset, results[i].run.centers, &kmeans_pool);
+    }));
+  }
+  for (auto &future : pending) {
+    future.get();
+  }
+  return results;
+}
+
+// Prints one table row per configuration and writes the same to sweep.csv.
+inline void print_sweep(const std::vector<SweepResult> &results) {
+  std::ofstream csv("sweep.csv");
+  csv << "algorithm,config,elapsed_ms,points_per_sec,p99_batch_us,clusters,"
+         "purity,nmi,ari\n";
+  std::cout << std::left << std::setw(11) << "algorithm" << std::setw(53)
+            << "config" << std::right << std::setw(10) << "time(ms)"
+            << std::setw(13) << "points/s" << std::setw(11) << "p99(us)";
+  for (const char *column : {"clusters", "purity", "nmi", "ari"}) {
+    std::cout << std::setw(9) << column;
+  }
+  std::cout << std::endl;
+  for (const auto &result : results) {
+    const RunResult &run = result.run;
+    double rate = run.num_points * 1000.0 /
+                  std::max<long>(1, run.elapsed.count());
+    double p99 = run.latency.percentile(99) / 1e3;
+    std::string config = result.config.describe();
+    const Quality &quality = result.quality;
+    std::ostringstream row;
+    row << std::left << std::setw(10) << result.config.algorithm << " "
+        << std::setw(52) << config << " " << std::right << std::setw(10)
+        << run.elapsed.count() << std::fixed << std::setprecision(0)
+        << std::setw(13) << rate << std::setprecision(1) << std::setw(11)
+        << p99 << std::setw(9) << run.centers.size() << std::setprecision(4);
+    for (double score : {quality.purity, quality.nmi, quality.ari}) {
+      row << std::setw(9) << score;
+    }
+    std::cout << row.str() << std::endl;
+    csv << result.config.algorithm << ",\"" << config << "\","
+        << run.elapsed.count() << "," << rate << "," << p99 << ","
+        << run.centers.size() << "," << quality.purity << "," << quality.nmi
+        << "," << quality.ari << "\n";
+  }
+}
+
+#endif // PDSC_SWEEP_HPP
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_THREAD_POOL_HPP
+#define PDSC_THREAD_POOL_HPP
+
+#include "common.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads. The calling thread takes part in
+// parallel_for, so a pool of n threads runs n + 1 chunks at once.
+class ThreadPool {
+public:
+  ThreadPool(u32 num_threads = std::thread::hardware_concurrency()) {
+    for (u32 i = 0; i < num_threads; i++) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  u32 size() const { return workers.size(); }
+
+  template <typename F> std::future<void> submit(F &&task) {
+    auto packaged =
+        std::make_shared<std::packaged_task<void()>>(std::forward<F>(task));
+    auto future = packaged->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.emplace([packaged] { (*packaged)(); });
+    }
+    cv.notify_one();
+    return future;
+  }
+
+  // Splits [0, n) into at most size() + 1 contiguous chunks and calls
+  // fn(chunk, begin, end) for each. Chunk 0 runs on the calling thread.
+  template <typename F> void parallel_for(size_t n, F &&fn) {
+    size_t chunks = std::min<size_t>(size() + 1, n);
+    if (chunks <= 1) {
+      fn(0, 0, n);
+      return;
+    }
+    size_t step = (n + chunks - 1) / chunks;
+    std::vector<std::future<void>> pending;
+    pending.reserve(chunks - 1);
+    for (size_t c = 1; c < chunks; c++) {
+      size_t begin = std::min(n, c * step), end = std::min(n, begin + step);
+      pending.push_back(submit([&fn, c, begin, end] { fn(c, begin, end); }));
+    }
+    fn(0, 0, std::min(n, step));
+    for (auto &future : pending) {
+      future.get();
+    }
+  }
+
+private:
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping = false;
+
+  void work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (stopping && tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+};
+
+#endif // PDSC_THREAD_POOL_HPP
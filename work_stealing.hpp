@@ -0,0 +1,137 @@
+/*
+ * Copyright 2024 IntelliStream team (https://github.com/intellistream)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDSC_WORK_STEALING_HPP
+#define PDSC_WORK_STEALING_HPP
+
+#include "common.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads with a task deque each. A task is queued on the worker the
+// submitter names and runs there in FIFO order, unless a worker that ran
+// out of work steals it from the back of the deque first. Tasks learn which
+// worker runs them. Queued tasks are still run when the pool is destroyed.
+class WorkStealingPool {
+public:
+  using Task = std::function<void(u32 worker)>;
+
+  explicit WorkStealingPool(u32 num_threads)
+      : queues(std::max(1u, num_threads)) {
+    for (u32 i = 0; i < queues.size(); i++) {
+      workers.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      stopping = true;
+    }
+    idle.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  u32 size() const { return queues.size(); }
+  u64 steals() const { return stolen.load(std::memory_order_relaxed); }
+
+  void submit(u32 worker, Task task) {
+    Queue &queue = queues[worker % queues.size()];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      pending++;
+    }
+    idle.notify_one();
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<Queue> queues;
+  std::vector<std::thread> workers;
+  std::mutex idle_mutex;
+  std::condition_variable idle;
+  size_t pending = 0; // Queued tasks, guarded by idle_mutex
+  bool stopping = false;
+  std::atomic<u64> stolen{0};
+
+  bool pop(u32 worker, Task &task) {
+    Queue &queue = queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    return true;
+  }
+
+  bool steal(u32 worker, Task &task) {
+    for (u32 k = 1; k < queues.size(); k++) {
+      Queue &victim = queues[(worker + k) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.back());
+        victim.tasks.pop_back();
+        stolen.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(u32 worker) {
+    while (true) {
+      Task task;
+      if (pop(worker, task) || steal(worker, task)) {
+        {
+          std::lock_guard<std::mutex> lock(idle_mutex);
+          pending--;
+        }
+        task(worker);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(idle_mutex);
+      if (stopping && pending == 0) {
+        return;
+      }
+      // A queued task another worker is about to take also wakes this one;
+      // it finds nothing and waits again.
+      idle.wait(lock, [this] { return stopping || pending > 0; });
+    }
+  }
+};
+
+#endif // PDSC_WORK_STEALING_HPP